@@ -0,0 +1,598 @@
+/*
+ * Replays an MMD capture written by the wrapper (BITTFIX_CAPTURE) against an
+ * MMD library, e.g. the mock library, the wrapper built against it, or a
+ * BSP's library on a development machine.
+ *
+ * The capture is replayed in phases separated by opens, status handler
+ * registrations, programs and closes, which are replayed in order on the main
+ * thread. Within a phase, the calls of each captured thread are replayed in
+ * order on a thread of their own. A call is only issued once as many
+ * operations have completed as had completed when it was captured, so calls
+ * that waited for earlier transfers wait for them in the replay as well.
+ * Host buffers are reserved for every range of host addresses the capture
+ * touched and are only faulted in by the replayed transfers, so buffers that
+ * were fresh or reused in the application are fresh or reused in the replay.
+ * Bitstreams are not part of the capture, so programs are not replayed.
+ *
+ * Reported are the number of calls, bytes and time spent in the calls per
+ * kind, the latency of non-blocking operations and how many operations
+ * completed in a different order than captured, each for the capture and the
+ * replay.
+ *
+ * Usage: bittfix_replay [-l library] [-d device] [-s recorded|max] capture
+ *   -l  MMD library to replay against (default: the mock library)
+ *   -d  device to open instead of the captured ones
+ *   -s  issue calls at the captured times or as fast as possible (default:
+ *       recorded)
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include <aocl_mmd.h>
+
+#include "capture.hpp"
+#include "futex.hpp"
+
+#define xstr(s) str(s)
+#define str(s) #s
+
+#ifndef MOCK_MMD
+#error "Cannot build without knowing the mock library. Set MOCK_MMD variable."
+#endif
+
+constexpr uintptr_t REPLAY_PAGE_SIZE{4096};
+// waiting longer for a captured completion gives up on it
+constexpr std::chrono::seconds COMPLETION_TIMEOUT{10};
+
+using replay_clock = std::chrono::steady_clock;
+
+typedef struct {
+  decltype(aocl_mmd_open) *open;
+  decltype(aocl_mmd_close) *close;
+  decltype(aocl_mmd_set_status_handler) *set_status_handler;
+  decltype(aocl_mmd_read) *read;
+  decltype(aocl_mmd_write) *write;
+  decltype(aocl_mmd_copy) *copy;
+  decltype(aocl_mmd_shared_mem_alloc) *shared_mem_alloc;
+  decltype(aocl_mmd_shared_mem_free) *shared_mem_free;
+} mmd_t;
+
+// replayed non-blocking operation, passed to the library as aocl_mmd_op_t
+typedef struct {
+  size_t record;
+  uint64_t completed_ns;
+} replay_op_t;
+
+// captured host address range and where it is replayed
+typedef struct {
+  uint64_t begin, end;
+  char *base;
+} host_range_t;
+
+typedef struct {
+  void *host_ptr;
+  size_t size;
+} shared_block_t;
+
+typedef struct {
+  uint64_t calls, bytes;
+  uint64_t captured_ns, replayed_ns;
+} kind_summary_t;
+
+static const char *const KIND_NAMES[]{"",
+                                      "open",
+                                      "close",
+                                      "set_status_handler",
+                                      "program",
+                                      "read",
+                                      "write",
+                                      "copy",
+                                      "shared_mem_alloc",
+                                      "shared_mem_free",
+                                      "completion"};
+
+static mmd_t mmd{};
+static const capture_record_t *records{nullptr};
+static size_t record_count{0};
+static std::unique_ptr<replay_op_t[]> ops{};
+static std::unique_ptr<size_t[]> completion_order{};
+static std::atomic<size_t> completed{0};
+// completions, including failed operations, for threads waiting on them
+static std::atomic<uint32_t> completion_count{0};
+static std::vector<uint64_t> replayed_begin_ns{};
+static std::vector<uint64_t> replayed_duration_ns{};
+static std::vector<host_range_t> host_ranges{};
+static std::map<int, int> handles{};
+static std::mutex shared_blocks_lock{};
+// captured address to replayed block
+static std::map<uint64_t, shared_block_t> shared_blocks{};
+static replay_clock::time_point replay_start{};
+static bool recorded_speed{true};
+static const char *device{nullptr};
+static std::atomic<uint64_t> failed_calls{0};
+static std::atomic<uint64_t> timeouts{0};
+
+static uint64_t replay_ns() {
+  return static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          replay_clock::now() - replay_start)
+          .count());
+}
+
+static void count_completion() {
+  completion_count.fetch_add(1);
+  futex_wake(completion_count);
+}
+
+static void status_handler(int handle, void *user_data, aocl_mmd_op_t op,
+                           int status) {
+  replay_op_t *replay_op = static_cast<replay_op_t *>(op);
+  replay_op->completed_ns = replay_ns();
+  completion_order[completed.fetch_add(1)] = replay_op->record;
+  count_completion();
+}
+
+static bool is_transfer(const capture_record_t &record) {
+  return record.kind == CAPTURE_READ || record.kind == CAPTURE_WRITE;
+}
+
+static bool is_control(const capture_record_t &record) {
+  return record.kind == CAPTURE_OPEN || record.kind == CAPTURE_CLOSE ||
+         record.kind == CAPTURE_SET_STATUS_HANDLER ||
+         record.kind == CAPTURE_PROGRAM;
+}
+
+// Reserves a replay buffer for each range of host addresses that transfers
+// touched. Overlapping ranges share a buffer, so the offsets of transfers
+// into parts of the same buffer are preserved.
+static bool reserve_host_ranges() {
+  std::vector<host_range_t> ranges{};
+  for (size_t i = 0; i < record_count; i++) {
+    if (is_transfer(records[i]) && records[i].args.size) {
+      ranges.push_back({records[i].args.host,
+                        records[i].args.host + records[i].args.size, nullptr});
+    }
+  }
+  std::sort(ranges.begin(), ranges.end(),
+            [](const host_range_t &a, const host_range_t &b) {
+              return a.begin < b.begin;
+            });
+  for (const auto &range : ranges) {
+    if (!host_ranges.empty() && range.begin < host_ranges.back().end) {
+      host_ranges.back().end = std::max(host_ranges.back().end, range.end);
+    } else {
+      host_ranges.push_back(range);
+    }
+  }
+
+  for (auto &range : host_ranges) {
+    // same offset into the first page as in the application
+    const uint64_t first_page = range.begin & ~(REPLAY_PAGE_SIZE - 1);
+    const size_t size = range.end - first_page;
+    void *mem = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED) {
+      std::cerr << "Could not reserve " << size << " bytes of host memory.\n";
+      return false;
+    }
+    range.base = static_cast<char *>(mem) + (range.begin - first_page);
+  }
+  return true;
+}
+
+// Returns the replay's buffer for the host address `host` of a transfer of
+// `size` bytes. No range is reserved for empty transfers, they get a dummy.
+static char *host_buffer(uint64_t host, uint64_t size) {
+  static char empty[1];
+  if (!size) {
+    return empty;
+  }
+  {
+    std::lock_guard<std::mutex> lg{shared_blocks_lock};
+    auto block = shared_blocks.upper_bound(host);
+    if (block != shared_blocks.begin() &&
+        host < (--block)->first + block->second.size) {
+      return static_cast<char *>(block->second.host_ptr) +
+             (host - block->first);
+    }
+  }
+  auto range = std::upper_bound(
+      host_ranges.begin(), host_ranges.end(), host,
+      [](uint64_t addr, const host_range_t &r) { return addr < r.begin; });
+  if (range == host_ranges.begin()) { // not captured as a transfer
+    return empty;
+  }
+  return (--range)->base + (host - range->begin);
+}
+
+static int replayed_handle(int handle) {
+  auto it = handles.find(handle);
+  return it != handles.end() ? it->second : -1;
+}
+
+// Waits until `count` operations have completed, as they had when the call
+// was captured.
+static void wait_for_completions(uint64_t count) {
+  const auto deadline = replay_clock::now() + COMPLETION_TIMEOUT;
+  const timespec poll{0, 100000000};
+  for (;;) {
+    const uint32_t current = completion_count.load();
+    if (current >= count) {
+      return;
+    }
+    if (replay_clock::now() > deadline) {
+      timeouts.fetch_add(1);
+      return;
+    }
+    futex_wait(completion_count, current, &poll);
+  }
+}
+
+static void replay_call(size_t i) {
+  const capture_record_t &record = records[i];
+  const capture_args_t &args = record.args;
+  wait_for_completions(record.completions);
+  if (recorded_speed) {
+    std::this_thread::sleep_until(replay_start +
+                                  std::chrono::nanoseconds{record.begin_ns});
+  }
+
+  const int handle = replayed_handle(record.handle);
+  replay_op_t *op = args.op ? &ops[i] : nullptr;
+  int ret{0};
+  replayed_begin_ns[i] = replay_ns();
+  switch (record.kind) {
+  case CAPTURE_READ:
+    ret = mmd.read(handle, op, args.size, host_buffer(args.host, args.size),
+                   record.interface, args.offset);
+    break;
+  case CAPTURE_WRITE:
+    ret = mmd.write(handle, op, args.size, host_buffer(args.host, args.size),
+                    record.interface, args.offset);
+    break;
+  case CAPTURE_COPY:
+    ret = mmd.copy(handle, op, args.size, record.interface, args.offset,
+                   args.host);
+    break;
+  case CAPTURE_SHARED_MEM_ALLOC: {
+    unsigned long long device_ptr;
+    void *host_ptr = mmd.shared_mem_alloc(handle, args.size, &device_ptr);
+    if (host_ptr) {
+      std::lock_guard<std::mutex> lg{shared_blocks_lock};
+      shared_blocks[args.host] = {host_ptr, args.size};
+    }
+    ret = !host_ptr;
+    break;
+  }
+  case CAPTURE_SHARED_MEM_FREE: {
+    std::unique_lock<std::mutex> lg{shared_blocks_lock};
+    auto block = shared_blocks.find(args.host);
+    if (block == shared_blocks.end()) {
+      ret = -1;
+      break;
+    }
+    const shared_block_t freed = block->second;
+    shared_blocks.erase(block);
+    lg.unlock();
+    mmd.shared_mem_free(handle, freed.host_ptr, freed.size);
+    break;
+  }
+  default:
+    break;
+  }
+  replayed_duration_ns[i] = replay_ns() - replayed_begin_ns[i];
+
+  if (ret) {
+    failed_calls.fetch_add(1);
+    // operations that never complete must not hold up later calls
+    if (op) {
+      count_completion();
+    }
+  }
+}
+
+static void replay_control(size_t i) {
+  const capture_record_t &record = records[i];
+  if (recorded_speed) {
+    std::this_thread::sleep_until(replay_start +
+                                  std::chrono::nanoseconds{record.begin_ns});
+  }
+  replayed_begin_ns[i] = replay_ns();
+  switch (record.kind) {
+  case CAPTURE_OPEN:
+    if (record.handle >= 0) {
+      const std::string captured{record.name,
+                                 strnlen(record.name, sizeof(record.name))};
+      const int handle = mmd.open(device ? device : captured.c_str());
+      if (handle < 0) {
+        failed_calls.fetch_add(1);
+      }
+      handles[record.handle] = handle;
+    }
+    break;
+  case CAPTURE_SET_STATUS_HANDLER:
+    if (mmd.set_status_handler(replayed_handle(record.handle), status_handler,
+                               nullptr)) {
+      failed_calls.fetch_add(1);
+    }
+    break;
+  case CAPTURE_PROGRAM:
+    // the device keeps its handle
+    handles[static_cast<int>(record.args.offset)] =
+        replayed_handle(record.handle);
+    break;
+  case CAPTURE_CLOSE:
+    // operations still in flight belong to the device
+    wait_for_completions(record.completions);
+    if (mmd.close(replayed_handle(record.handle))) {
+      failed_calls.fetch_add(1);
+    }
+    break;
+  default:
+    break;
+  }
+  replayed_duration_ns[i] = replay_ns() - replayed_begin_ns[i];
+}
+
+static void replay() {
+  size_t captured_completions{0};
+  for (size_t i = 0; i < record_count; i++) {
+    captured_completions += records[i].kind == CAPTURE_COMPLETION;
+  }
+
+  replay_start = replay_clock::now();
+  size_t i = 0;
+  while (i < record_count) {
+    if (is_control(records[i])) {
+      replay_control(i++);
+      continue;
+    }
+
+    // calls up to the next control record, by captured thread
+    std::map<uint16_t, std::vector<size_t>> phase{};
+    for (; i < record_count && !is_control(records[i]); i++) {
+      if (records[i].kind != CAPTURE_NONE &&
+          records[i].kind != CAPTURE_COMPLETION) {
+        phase[records[i].thread].push_back(i);
+      }
+    }
+    std::vector<std::thread> threads{};
+    for (const auto &calls : phase) {
+      threads.emplace_back([&calls] {
+        for (const size_t call : calls.second) {
+          replay_call(call);
+        }
+      });
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+  }
+  // operations still in flight at the end of the capture
+  wait_for_completions(captured_completions);
+}
+
+static double percentile(std::vector<uint64_t> &values, size_t percent) {
+  if (values.empty()) {
+    return 0;
+  }
+  std::sort(values.begin(), values.end());
+  return static_cast<double>(values[(values.size() - 1) * percent / 100]) /
+         1e3;
+}
+
+// Number of operations that completed one after the other in the capture but
+// in the opposite order in the replay.
+static size_t reordered_completions(const std::vector<size_t> &captured) {
+  std::vector<size_t> replayed_rank(record_count, SIZE_MAX);
+  const size_t replayed = completed.load();
+  for (size_t i = 0; i < replayed; i++) {
+    replayed_rank[completion_order[i]] = i;
+  }
+  size_t reordered{0};
+  for (size_t i = 1; i < captured.size(); i++) {
+    reordered += replayed_rank[captured[i - 1]] > replayed_rank[captured[i]];
+  }
+  return reordered;
+}
+
+static void report() {
+  std::vector<kind_summary_t> kinds(CAPTURE_COMPLETION + 1);
+  // issuing records of the captured completions, in order
+  std::vector<size_t> captured_order{};
+  std::vector<uint64_t> captured_latencies{}, replayed_latencies{};
+  // issuing records by op, an op completes the oldest call it was passed to
+  std::multimap<uint64_t, size_t> in_flight{};
+  uint64_t captured_end{0}, replayed_end{0};
+
+  for (size_t i = 0; i < record_count; i++) {
+    const capture_record_t &record = records[i];
+    if (record.kind == CAPTURE_NONE || record.kind > CAPTURE_COMPLETION) {
+      continue;
+    }
+    captured_end = std::max(captured_end, record.begin_ns + record.duration_ns);
+    if (record.kind == CAPTURE_COMPLETION) {
+      auto issued = in_flight.lower_bound(record.args.op);
+      if (issued == in_flight.end() || issued->first != record.args.op) {
+        continue;
+      }
+      captured_order.push_back(issued->second);
+      captured_latencies.push_back(record.begin_ns -
+                                   records[issued->second].begin_ns);
+      if (const uint64_t done = ops[issued->second].completed_ns) {
+        replayed_latencies.push_back(done - replayed_begin_ns[issued->second]);
+        replayed_end = std::max(replayed_end, done);
+      }
+      in_flight.erase(issued);
+      continue;
+    }
+
+    if (record.args.op && !is_control(record) &&
+        record.kind != CAPTURE_SHARED_MEM_ALLOC &&
+        record.kind != CAPTURE_SHARED_MEM_FREE) {
+      in_flight.emplace(record.args.op, i);
+    }
+    kind_summary_t &kind = kinds[record.kind];
+    kind.calls++;
+    kind.bytes += is_transfer(record) || record.kind == CAPTURE_COPY
+                      ? record.args.size
+                      : 0;
+    kind.captured_ns += record.duration_ns;
+    kind.replayed_ns += replayed_duration_ns[i];
+    replayed_end =
+        std::max(replayed_end, replayed_begin_ns[i] + replayed_duration_ns[i]);
+  }
+
+  std::cout << std::fixed << std::setprecision(1) << std::setw(20) << "call"
+            << std::setw(10) << "calls" << std::setw(14) << "MiB"
+            << std::setw(32) << "ms in calls captured/replayed"
+            << "\n";
+  for (int kind = CAPTURE_OPEN; kind < CAPTURE_COMPLETION; kind++) {
+    const kind_summary_t &summary = kinds[kind];
+    if (!summary.calls) {
+      continue;
+    }
+    std::cout << std::setw(20) << KIND_NAMES[kind] << std::setw(10)
+              << summary.calls << std::setw(14)
+              << static_cast<double>(summary.bytes) / (1 << 20)
+              << std::setw(19) << static_cast<double>(summary.captured_ns) / 1e6
+              << " / " << std::setw(10)
+              << static_cast<double>(summary.replayed_ns) / 1e6 << "\n";
+  }
+
+  std::cout << "Duration captured/replayed: "
+            << static_cast<double>(captured_end) / 1e6 << " / "
+            << static_cast<double>(replayed_end) / 1e6 << " ms\n"
+            << "Completions captured/replayed: " << captured_order.size()
+            << " / " << completed.load() << ", swapped in the replay: "
+            << reordered_completions(captured_order) << "\n"
+            << "Latency of non-blocking operations captured/replayed: p50 "
+            << percentile(captured_latencies, 50) << " / "
+            << percentile(replayed_latencies, 50) << " us, p99 "
+            << percentile(captured_latencies, 99) << " / "
+            << percentile(replayed_latencies, 99) << " us\n";
+  if (kinds[CAPTURE_PROGRAM].calls) {
+    std::cout << "Programs not replayed: " << kinds[CAPTURE_PROGRAM].calls
+              << "\n";
+  }
+  if (failed_calls.load() || timeouts.load()) {
+    std::cout << "Failed calls: " << failed_calls.load()
+              << ", gave up waiting for completions: " << timeouts.load()
+              << "\n";
+  }
+}
+
+static bool load_capture(const char *path) {
+  const int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st {};
+  if (fd < 0 || fstat(fd, &st) ||
+      static_cast<size_t>(st.st_size) < sizeof(capture_header_t)) {
+    std::cerr << "Could not read capture " << path << ".\n";
+    return false;
+  }
+  void *mem = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ,
+                   MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) {
+    std::cerr << "Could not map capture " << path << ".\n";
+    return false;
+  }
+
+  const capture_header_t *header = static_cast<capture_header_t *>(mem);
+  if (header->magic != CAPTURE_MAGIC || header->version != CAPTURE_VERSION) {
+    std::cerr << path << " is not a capture of this version.\n";
+    return false;
+  }
+  records = reinterpret_cast<const capture_record_t *>(header + 1);
+  record_count = std::min<size_t>(
+      header->records, (static_cast<size_t>(st.st_size) - sizeof(*header)) /
+                           sizeof(capture_record_t));
+  if (header->dropped) {
+    std::cerr << "Capture is incomplete, " << header->dropped
+              << " records were dropped.\n";
+  }
+  return true;
+}
+
+static bool load_library(const char *path) {
+  void *lib = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+  if (!lib) {
+    std::cerr << "Could not load " << path << ": " << dlerror() << "\n";
+    return false;
+  }
+  mmd.open = reinterpret_cast<decltype(mmd.open)>(dlsym(lib, "aocl_mmd_open"));
+  mmd.close =
+      reinterpret_cast<decltype(mmd.close)>(dlsym(lib, "aocl_mmd_close"));
+  mmd.set_status_handler = reinterpret_cast<decltype(mmd.set_status_handler)>(
+      dlsym(lib, "aocl_mmd_set_status_handler"));
+  mmd.read = reinterpret_cast<decltype(mmd.read)>(dlsym(lib, "aocl_mmd_read"));
+  mmd.write =
+      reinterpret_cast<decltype(mmd.write)>(dlsym(lib, "aocl_mmd_write"));
+  mmd.copy = reinterpret_cast<decltype(mmd.copy)>(dlsym(lib, "aocl_mmd_copy"));
+  mmd.shared_mem_alloc = reinterpret_cast<decltype(mmd.shared_mem_alloc)>(
+      dlsym(lib, "aocl_mmd_shared_mem_alloc"));
+  mmd.shared_mem_free = reinterpret_cast<decltype(mmd.shared_mem_free)>(
+      dlsym(lib, "aocl_mmd_shared_mem_free"));
+  if (!mmd.open || !mmd.close || !mmd.set_status_handler || !mmd.read ||
+      !mmd.write || !mmd.copy || !mmd.shared_mem_alloc ||
+      !mmd.shared_mem_free) {
+    std::cerr << path << " does not implement the MMD API.\n";
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  const char *library{xstr(MOCK_MMD)};
+  bool usage = argc % 2 != 0;
+  for (int i = 1; !usage && i + 1 < argc; i += 2) {
+    if (!strcmp(argv[i], "-l")) {
+      library = argv[i + 1];
+    } else if (!strcmp(argv[i], "-d")) {
+      device = argv[i + 1];
+    } else if (!strcmp(argv[i], "-s") && !strcmp(argv[i + 1], "max")) {
+      recorded_speed = false;
+    } else if (strcmp(argv[i], "-s") || strcmp(argv[i + 1], "recorded")) {
+      usage = true;
+    }
+  }
+  if (usage) {
+    std::cerr << "Usage: " << argv[0]
+              << " [-l library] [-d device] [-s recorded|max] capture\n";
+    return 1;
+  }
+
+  if (!load_capture(argv[argc - 1]) || !load_library(library) ||
+      !reserve_host_ranges()) {
+    return 1;
+  }
+  ops.reset(new replay_op_t[record_count]{});
+  completion_order.reset(new size_t[record_count]{});
+  for (size_t i = 0; i < record_count; i++) {
+    ops[i].record = i;
+  }
+  replayed_begin_ns.assign(record_count, 0);
+  replayed_duration_ns.assign(record_count, 0);
+
+  replay();
+  report();
+  return 0;
+}
@@ -0,0 +1,115 @@
+/*
+ * Prints the transfer statistics of running applications that use the
+ * reliable transfer patch.
+ *
+ * Without a pid, all processes that currently publish statistics are shown.
+ * Segments left behind by processes that no longer exist are removed.
+ * With an interval, the statistics are printed again every `interval`
+ * seconds until interrupted.
+ *
+ * Usage: bittfix_stat [-i interval] [pid]...
+ */
+
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <iostream>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "stats.hpp"
+
+static std::vector<std::string> find_segments() {
+  std::vector<std::string> names{};
+  const std::string prefix{STATS_SHM_PREFIX + 1};
+  if (DIR *shm = opendir("/dev/shm")) {
+    while (dirent *entry = readdir(shm)) {
+      if (!strncmp(entry->d_name, prefix.c_str(), prefix.size())) {
+        names.push_back(std::string{"/"} + entry->d_name);
+      }
+    }
+    closedir(shm);
+  }
+  return names;
+}
+
+// Segments of processes that crashed are never unlinked by their owner.
+static bool stale(const std::string &name) {
+  const std::string pid{name.substr(strlen(STATS_SHM_PREFIX))};
+  char *end{nullptr};
+  const long value = std::strtol(pid.c_str(), &end, 10);
+  return !pid.empty() && !*end && value > 0 &&
+         kill(static_cast<pid_t>(value), 0) && errno == ESRCH;
+}
+
+static bool print_segment(const std::string &name) {
+  if (stale(name)) {
+    shm_unlink(name.c_str());
+    return false;
+  }
+  const int fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  void *mem{MAP_FAILED};
+  if (fstat(fd, &st) == 0 &&
+      static_cast<size_t>(st.st_size) >= sizeof(stats_segment_t)) {
+    mem = mmap(nullptr, sizeof(stats_segment_t), PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (mem == MAP_FAILED) {
+    return false;
+  }
+
+  const stats_segment_t *stats = static_cast<const stats_segment_t *>(mem);
+  const bool valid =
+      __atomic_load_n(&stats->magic, __ATOMIC_ACQUIRE) == STATS_MAGIC &&
+      stats->version == STATS_VERSION;
+  if (valid) {
+    std::cout << "== pid " << stats->pid << " ==\n";
+    print_stats(*stats, std::cout);
+  }
+  munmap(mem, sizeof(stats_segment_t));
+  return valid;
+}
+
+int main(int argc, char **argv) {
+  unsigned long interval{0};
+  std::vector<std::string> names{};
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-i") && i + 1 < argc) {
+      interval = std::strtoul(argv[++i], nullptr, 10);
+    } else if (argv[i][0] == '-') {
+      std::cerr << "Usage: " << argv[0] << " [-i interval] [pid]...\n";
+      return 1;
+    } else {
+      names.push_back(STATS_SHM_PREFIX + std::string{argv[i]});
+    }
+  }
+
+  for (;;) {
+    const std::vector<std::string> segments =
+        names.empty() ? find_segments() : names;
+    size_t printed{0};
+    for (const auto &name : segments) {
+      printed += print_segment(name);
+    }
+    if (!printed) {
+      std::cout << "No transfer statistics found.\n";
+    }
+    if (!interval) {
+      return printed ? 0 : 1;
+    }
+    std::cout << std::endl;
+    std::this_thread::sleep_for(std::chrono::seconds{interval});
+  }
+}
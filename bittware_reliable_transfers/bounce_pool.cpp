@@ -0,0 +1,140 @@
+#include "bounce_pool.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <immintrin.h>
+#include <iostream>
+#include <mutex>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <thread>
+
+#include "mpmc_queue.hpp"
+#include "numa.hpp"
+#include "stamping.hpp"
+
+constexpr size_t MAX_BOUNCE_BUFFERS{64};
+// Smaller copies fit into the cache, where regular stores are faster.
+constexpr size_t MIN_STREAM_COPY_SIZE{2 << 20};
+
+static bounce_buffer_t buffers[MAX_BOUNCE_BUFFERS]{};
+static mpmc_queue_t<bounce_buffer_t *, MAX_BOUNCE_BUFFERS> free_buffers{};
+static mpmc_queue_t<bounce_buffer_t *, MAX_BOUNCE_BUFFERS> dirty_buffers{};
+static sem_t restamp_sem{};
+static void (*stamp_fn)(void *dst, size_t len, uint64_t nonce){};
+static std::once_flag pool_started{};
+
+static void restamp_worker() {
+  register_internal_thread();
+  for (;;) {
+    while (sem_wait(&restamp_sem) && errno == EINTR) {
+    }
+    bounce_buffer_t *buffer;
+    while (!dirty_buffers.pop(buffer)) {
+      sched_yield();
+    }
+    // Stamps of pages beyond the last read are stale as well, as they were
+    // written with the previous nonce.
+    buffer->nonce = new_stamp_nonce();
+    stamp_fn(buffer->data, buffer->size, buffer->nonce);
+    free_buffers.push(buffer);
+  }
+}
+
+static void create_pool(size_t count, size_t size,
+                        void (*stamp)(void *dst, size_t len, uint64_t nonce),
+                        int node) {
+  stamp_fn = stamp;
+  size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+  count = std::min(count, MAX_BOUNCE_BUFFERS);
+
+  // pages are only faulted in once the memory policy is set
+  const int populate = node < 0 ? MAP_POPULATE : 0;
+  bool locked{true};
+  bool placed{true};
+  size_t created{0};
+  for (; created < count; created++) {
+    void *data = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | populate, -1, 0);
+    if (data == MAP_FAILED) {
+      break;
+    }
+    placed &= node < 0 || prefer_numa_node(data, size, node);
+    locked &= mlock(data, size) == 0;
+    buffers[created] = {data, size, new_stamp_nonce()};
+    stamp(data, size, buffers[created].nonce);
+    free_buffers.push(&buffers[created]);
+  }
+
+  if (created < count) {
+    std::cerr << "PC2 WARNING: Could only allocate " << created << " of "
+              << count << " bounce buffers.\n";
+  }
+  if (!locked) {
+    std::cerr << "PC2 WARNING: Could not lock bounce buffers in memory. "
+                 "Consider raising the locked memory limit (ulimit -l).\n";
+  }
+  if (!placed) {
+    std::cerr << "PC2 WARNING: Could not place bounce buffers on NUMA node "
+              << node << ".\n";
+  }
+  if (created) {
+    sem_init(&restamp_sem, 0, 0);
+    std::thread(restamp_worker).detach();
+  }
+}
+
+void start_bounce_pool(size_t count, size_t size,
+                       void (*stamp)(void *dst, size_t len, uint64_t nonce),
+                       int node) {
+  std::call_once(pool_started, create_pool, count, size, stamp, node);
+}
+
+bounce_buffer_t *acquire_bounce_buffer() {
+  bounce_buffer_t *buffer;
+  return free_buffers.pop(buffer) ? buffer : nullptr;
+}
+
+void release_bounce_buffer(bounce_buffer_t *buffer, bool unused) {
+  if (unused) {
+    free_buffers.push(buffer);
+    return;
+  }
+  // never fails, there are only as many buffers as cells
+  dirty_buffers.push(buffer);
+  sem_post(&restamp_sem);
+}
+
+void stream_copy(void *dst, const void *src, size_t len) {
+  unsigned char *d = static_cast<unsigned char *>(dst);
+  const unsigned char *s = static_cast<const unsigned char *>(src);
+  if (len < MIN_STREAM_COPY_SIZE) {
+    std::memcpy(d, s, len);
+    return;
+  }
+
+  // streaming stores need an aligned destination
+  const size_t head =
+      std::min(len, (16 - (reinterpret_cast<uintptr_t>(d) & 15)) & 15);
+  std::memcpy(d, s, head);
+  d += head;
+  s += head;
+  len -= head;
+
+  for (; len >= 64; d += 64, s += 64, len -= 64) {
+    const __m128i *from = reinterpret_cast<const __m128i *>(s);
+    __m128i *to = reinterpret_cast<__m128i *>(d);
+    const __m128i a = _mm_loadu_si128(from);
+    const __m128i b = _mm_loadu_si128(from + 1);
+    const __m128i c = _mm_loadu_si128(from + 2);
+    const __m128i e = _mm_loadu_si128(from + 3);
+    _mm_stream_si128(to, a);
+    _mm_stream_si128(to + 1, b);
+    _mm_stream_si128(to + 2, c);
+    _mm_stream_si128(to + 3, e);
+  }
+  std::memcpy(d, s, len);
+  _mm_sfence();
+}
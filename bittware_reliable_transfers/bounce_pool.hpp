@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Pool of staging buffers for reads into host memory that is not resident
+ * yet. Stamping such a destination faults in every page on the read path,
+ * which is the slowest case of the workaround. Instead, the transfer goes to
+ * a staging buffer that is locked in memory and already stamped, is verified
+ * there and then copied out to the destination with streaming stores. A
+ * single background thread restamps released buffers before they are handed
+ * out again, so acquiring a buffer never stamps. If all buffers are in use or
+ * still being restamped, acquire_bounce_buffer() fails and the read takes the
+ * usual path.
+ */
+
+typedef struct bounce_buffer_s {
+  void *data;
+  size_t size;
+  // nonce the whole buffer is stamped with
+  uint64_t nonce;
+} bounce_buffer_t;
+
+// Allocates `count` buffers of `size` bytes each on NUMA node `node` (-1 for
+// no preference), stamps them with `stamp` and starts the restamping thread.
+// Only the first call has an effect.
+void start_bounce_pool(size_t count, size_t size,
+                       void (*stamp)(void *dst, size_t len, uint64_t nonce),
+                       int node);
+
+// Returns a stamped buffer, or nullptr if none is available.
+bounce_buffer_t *acquire_bounce_buffer();
+
+// Returns a buffer to the pool. Unless it is `unused`, it is restamped with a
+// new nonce first.
+void release_bounce_buffer(bounce_buffer_t *buffer, bool unused = false);
+
+// Copies [src, src + len) to dst. Copies too large for the cache use
+// non-temporal stores, so they do not displace the data of the application.
+void stream_copy(void *dst, const void *src, size_t len);
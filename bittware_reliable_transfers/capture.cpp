@@ -0,0 +1,134 @@
+#include "capture.hpp"
+
+#include <cstdlib>
+#include <fcntl.h>
+#include <iostream>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "trace.hpp"
+
+constexpr uint64_t DEFAULT_CAPTURE_EVENTS{1 << 24};
+
+std::atomic<bool> capture_enabled{false};
+static uint64_t capacity{DEFAULT_CAPTURE_EVENTS};
+static capture_record_t *records{nullptr};
+static std::atomic<uint64_t> head{0};
+static std::atomic<uint64_t> completions{0};
+static std::atomic<uint16_t> threads{0};
+static uint64_t start_ns{0};
+
+capture_record_t *capture_begin(capture_kind_t kind, int handle) {
+  static thread_local const uint16_t thread = threads.fetch_add(1);
+  const uint64_t idx = head.fetch_add(1, std::memory_order_relaxed);
+  if (idx >= capacity) {
+    return nullptr;
+  }
+  capture_record_t *record = &records[idx];
+  record->thread = thread;
+  record->handle = static_cast<int16_t>(handle);
+  record->interface = -1;
+  record->completions = completions.load(std::memory_order_relaxed);
+  record->begin_ns = trace_now_ns() - start_ns;
+  // records claimed but not filled in at exit have no kind and are skipped
+  record->kind = kind;
+  return record;
+}
+
+void capture_end(capture_record_t *record) {
+  record->duration_ns = trace_now_ns() - start_ns - record->begin_ns;
+}
+
+void capture_completion(int handle, const void *op, int status) {
+  if (!capture_enabled.load(std::memory_order_relaxed)) {
+    return;
+  }
+  if (capture_record_t *record = capture_begin(CAPTURE_COMPLETION, handle)) {
+    record->interface = static_cast<int16_t>(status);
+    record->args = {reinterpret_cast<uint64_t>(op), 0, 0, 0};
+  }
+  completions.fetch_add(1, std::memory_order_relaxed);
+}
+
+static bool write_all(int fd, const void *data, size_t size) {
+  const char *p = static_cast<const char *>(data);
+  while (size) {
+    const ssize_t written = write(fd, p, size);
+    if (written <= 0) {
+      return false;
+    }
+    p += written;
+    size -= static_cast<size_t>(written);
+  }
+  return true;
+}
+
+class capture_writer_t {
+  std::string path{};
+
+public:
+  capture_writer_t() {
+    const char *capture = getenv("BITTFIX_CAPTURE");
+    if (!capture || !*capture) {
+      return;
+    }
+    path = capture;
+    const size_t pid = path.find("%p");
+    if (pid != std::string::npos) {
+      path.replace(pid, 2, std::to_string(getpid()));
+    }
+
+    if (const char *events = getenv("BITTFIX_CAPTURE_EVENTS")) {
+      capacity = std::strtoull(events, nullptr, 10);
+    }
+    // only the records in use are ever backed by memory
+    void *mem = mmap(nullptr, capacity * sizeof(capture_record_t),
+                     PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (!capacity || mem == MAP_FAILED) {
+      std::cerr << "PC2 WARNING: Could not reserve memory for the MMD "
+                   "capture. Capturing is disabled.\n";
+      return;
+    }
+    records = static_cast<capture_record_t *>(mem);
+    start_ns = trace_now_ns();
+    capture_enabled.store(true);
+  }
+
+  ~capture_writer_t() {
+    if (!capture_enabled.exchange(false)) {
+      return;
+    }
+
+    const uint64_t claimed = head.load();
+    capture_header_t header{};
+    header.magic = CAPTURE_MAGIC;
+    header.version = CAPTURE_VERSION;
+    header.pid = getpid();
+    header.records = claimed < capacity ? claimed : capacity;
+    header.dropped = claimed - header.records;
+
+    const int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                        0644);
+    const bool written =
+        fd >= 0 && write_all(fd, &header, sizeof(header)) &&
+        write_all(fd, records, header.records * sizeof(capture_record_t));
+    if (fd >= 0) {
+      close(fd);
+    }
+
+    if (!written) {
+      std::cerr << "PC2 WARNING: Could not write MMD capture to " << path
+                << ".\n";
+    } else if (header.dropped) {
+      std::cerr << "PC2 WARNING: MMD capture full, " << header.dropped
+                << " records dropped. Consider raising "
+                   "BITTFIX_CAPTURE_EVENTS.\n";
+    } else {
+      std::cerr << "PC2 MMD capture of " << header.records
+                << " records written to " << path << ".\n";
+    }
+  }
+};
+static capture_writer_t capture_writer{};
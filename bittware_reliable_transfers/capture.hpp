@@ -0,0 +1,122 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Capture of the MMD call stream for offline replay. If BITTFIX_CAPTURE names
+ * an output file, every open, close, program, status handler registration,
+ * read, write, copy and shared memory allocation is recorded with its
+ * arguments, its start time and duration, and the completion of every
+ * non-blocking operation with its status. No payload data is recorded. Host
+ * buffers are only identified by their address. A "%p" in the file name is
+ * replaced by the process id.
+ *
+ * Records are claimed from a single anonymous mapping of at most
+ * BITTFIX_CAPTURE_EVENTS records (default: 16777216) with one atomic add, so
+ * capturing neither locks nor allocates and their order in the log is the
+ * order of the calls. Each record also holds the number of completions that
+ * had been reported when the call was made, which lets a replay preserve
+ * calls that waited for earlier operations to complete. The log is written
+ * at exit. bittfix_replay re-drives it against any MMD library.
+ *
+ * The layout below is shared with bittfix_replay and versioned by
+ * CAPTURE_VERSION.
+ */
+
+constexpr uint64_t CAPTURE_MAGIC{0x5450414358494642ull}; // "BFIXCAPT"
+constexpr uint32_t CAPTURE_VERSION{1};
+
+enum capture_kind_t : uint16_t {
+  CAPTURE_NONE,
+  CAPTURE_OPEN,
+  CAPTURE_CLOSE,
+  CAPTURE_SET_STATUS_HANDLER,
+  CAPTURE_PROGRAM,
+  CAPTURE_READ,
+  CAPTURE_WRITE,
+  CAPTURE_COPY,
+  CAPTURE_SHARED_MEM_ALLOC,
+  CAPTURE_SHARED_MEM_FREE,
+  CAPTURE_COMPLETION,
+};
+
+typedef struct {
+  // operation the call belongs to, 0 for blocking calls
+  uint64_t op;
+  uint64_t size;
+  // device offset, source offset of copies, handle returned by programs
+  uint64_t offset;
+  // host buffer address, destination offset of copies
+  uint64_t host;
+} capture_args_t;
+
+typedef struct {
+  uint16_t kind;
+  // index of the calling thread in the order of their first call
+  uint16_t thread;
+  // returned handle of opens
+  int16_t handle;
+  // status of completions, -1 if not applicable
+  int16_t interface;
+  // since the start of the capture
+  uint64_t begin_ns;
+  uint64_t duration_ns;
+  // completions reported before the call
+  uint64_t completions;
+  union {
+    capture_args_t args;
+    // device name of opens, not terminated if it fills the array
+    char name[sizeof(capture_args_t)];
+  };
+} capture_record_t;
+
+typedef struct {
+  uint64_t magic;
+  uint32_t version;
+  int32_t pid;
+  uint64_t records;
+  // records lost because the capture was full
+  uint64_t dropped;
+} capture_header_t;
+
+extern std::atomic<bool> capture_enabled;
+
+// Returns a record with its kind, thread, time and completion count set, or
+// nullptr if the capture is full.
+capture_record_t *capture_begin(capture_kind_t kind, int handle);
+void capture_end(capture_record_t *record);
+
+// Records the completion of `op` as reported to the application.
+void capture_completion(int handle, const void *op, int status);
+
+// Records a call for the lifetime of the scope.
+class capture_scope_t {
+  capture_record_t *record;
+
+public:
+  capture_scope_t(capture_kind_t kind, int handle, int interface = -1,
+                  const void *op = nullptr, uint64_t size = 0,
+                  uint64_t offset = 0, uint64_t host = 0)
+      : record{capture_enabled.load(std::memory_order_relaxed)
+                   ? capture_begin(kind, handle)
+                   : nullptr} {
+    if (record) {
+      record->interface = static_cast<int16_t>(interface);
+      record->args = {reinterpret_cast<uint64_t>(op), size, offset, host};
+    }
+  }
+
+  ~capture_scope_t() {
+    if (record) {
+      capture_end(record);
+    }
+  }
+
+  // For calls whose result identifies what later calls refer to.
+  capture_record_t *get() { return record; }
+
+  capture_scope_t(const capture_scope_t &) = delete;
+  capture_scope_t &operator=(const capture_scope_t &) = delete;
+};
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include <aocl_mmd.h>
+
+/*
+ * Restores the order in which the BSP reported completions on a device after
+ * some of them were held back for validation. Every completion reported by
+ * the BSP gets a sequence number from push(). Once it may be delivered,
+ * complete() marks it ready and hands all ready completions that are next in
+ * line to the original status handler. Only one thread delivers at a time,
+ * so the original handler sees the completions strictly in BSP order.
+ *
+ * push() never waits, as the status handler may run in signal context and
+ * interrupt the thread that would deliver. If the queue is full, the
+ * completion gets no position and is delivered on its own, out of order.
+ */
+class completion_queue_t {
+  typedef struct {
+    std::atomic<bool> ready;
+    aocl_mmd_op_t op;
+    void *user_data;
+    int status;
+  } completion_t;
+
+  static constexpr size_t CAPACITY{4096};
+
+  completion_t ring[CAPACITY]{};
+  alignas(64) std::atomic<uint64_t> tail{0};
+  alignas(64) std::atomic<uint64_t> head{0};
+  std::atomic<bool> delivering{false};
+
+public:
+  // Position of a completion that did not fit into the queue.
+  static constexpr uint64_t UNORDERED{~0ull};
+
+  // Reserves the next position in completion order, or returns UNORDERED if
+  // the queue is full.
+  uint64_t push(aocl_mmd_op_t op, void *user_data, int status) {
+    uint64_t seq = tail.load();
+    do {
+      if (seq - head.load() >= CAPACITY) {
+        return UNORDERED;
+      }
+    } while (!tail.compare_exchange_weak(seq, seq + 1));
+    completion_t &completion = ring[seq % CAPACITY];
+    completion.op = op;
+    completion.user_data = user_data;
+    completion.status = status;
+    return seq;
+  }
+
+  // Returns true once every reserved completion has been delivered.
+  bool drained() const {
+    return head.load() == tail.load() && !delivering.load();
+  }
+
+  void complete(uint64_t seq, int handle, aocl_mmd_status_handler_fn fn) {
+    ring[seq % CAPACITY].ready.store(true);
+
+    // Whoever fails to become the delivering thread relies on the current
+    // one to re-check the head of the queue after it stepped down.
+    for (;;) {
+      bool expected{false};
+      if (!delivering.compare_exchange_strong(expected, true)) {
+        return;
+      }
+      uint64_t next = head.load();
+      while (ring[next % CAPACITY].ready.load()) {
+        completion_t &completion = ring[next % CAPACITY];
+        fn(handle, completion.user_data, completion.op, completion.status);
+        completion.ready.store(false);
+        head.store(++next);
+      }
+      delivering.store(false);
+      if (!ring[next % CAPACITY].ready.load()) {
+        return;
+      }
+    }
+  }
+};
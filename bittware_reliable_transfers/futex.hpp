@@ -0,0 +1,25 @@
+#pragma once
+
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <ctime>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ * Minimal futex wrappers for one-shot flags that a thread blocks on until
+ * another one sets them. futex_wake() is async-signal-safe.
+ */
+
+// Blocks while `word` holds `value`, at most for `timeout` unless it is
+// nullptr. May return spuriously.
+static inline void futex_wait(std::atomic<uint32_t> &word, uint32_t value,
+                              const timespec *timeout = nullptr) {
+  syscall(SYS_futex, &word, FUTEX_WAIT_PRIVATE, value, timeout, nullptr, 0);
+}
+
+static inline void futex_wake(std::atomic<uint32_t> &word) {
+  syscall(SYS_futex, &word, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+}
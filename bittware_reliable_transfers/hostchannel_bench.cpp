@@ -0,0 +1,224 @@
+/*
+ * Throughput and latency benchmark of hostchannel streams (see
+ * hostchannel_stream.hpp) against the hostchannels of the mock MMD library.
+ *
+ * A writer thread streams timestamped messages into a host-to-device channel,
+ * which the mock device echoes into a device-to-host channel, where the main
+ * thread reads them back. For each batch size, the benchmark reports the
+ * messages per second, the median and 99th percentile latency from writing a
+ * message to reading it back, the ack_buffer calls per message and how often
+ * and how long both streams stalled on a full or empty channel. A batch size
+ * of 0 acknowledges every message, which costs as many round trips as
+ * calling get_buffer and ack_buffer per message.
+ *
+ * MOCK_MMD_HOSTCHANNEL_CALL_NS sets the time each get_buffer and ack_buffer
+ * call takes in the mock library.
+ *
+ * Usage: hostchannel_bench [-b bytes,...] [-m bytes] [-n messages] [-q bytes]
+ *                          [-p spin|yield|backoff]
+ *   -b  batch sizes (default: 0,256,4096,65536)
+ *   -m  message size, at least 16 (default: 64)
+ *   -n  messages per batch size (default: 200000)
+ *   -q  queue depth of the channels (default: 1048576)
+ *   -p  polling policy of the streams (default: yield)
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <aocl_mmd.h>
+
+#include "hostchannel_stream.hpp"
+#include "mock_mmd.hpp"
+
+using bench_clock = std::chrono::steady_clock;
+
+typedef struct {
+  uint64_t sequence;
+  uint64_t sent_ns;
+} message_header_t;
+
+typedef struct {
+  double messages_per_s;
+  double p50_us, p99_us;
+  double write_acks, read_acks;
+  uint64_t write_stalls, read_stalls;
+  double stall_ms;
+} bench_result_t;
+
+static const hostchannel_fns_t mock_fns{aocl_mmd_hostchannel_get_buffer,
+                                        aocl_mmd_hostchannel_ack_buffer};
+
+static uint64_t now_ns(bench_clock::time_point start) {
+  return static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() -
+                                                           start)
+          .count());
+}
+
+static bool run(int handle, const hostchannel_stream_config_t &config,
+                size_t message_size, size_t messages, size_t queue_depth,
+                bench_result_t &result) {
+  char to_device_name[]{"host_to_dev"};
+  char to_host_name[]{"dev_to_host"};
+  const int to_device = aocl_mmd_hostchannel_create(
+      handle, to_device_name, queue_depth, MOCK_MMD_HOST_TO_DEVICE);
+  const int to_host = aocl_mmd_hostchannel_create(
+      handle, to_host_name, queue_depth, MOCK_MMD_DEVICE_TO_HOST);
+  if (to_device < 0 || to_host < 0) {
+    std::cerr << "Could not create hostchannels.\n";
+    return false;
+  }
+
+  hostchannel_writer_t writer{mock_fns, handle, to_device, config};
+  hostchannel_reader_t reader{mock_fns, handle, to_host, config};
+  std::vector<uint64_t> latencies(messages);
+  std::atomic<bool> ok{true};
+  const auto start = bench_clock::now();
+
+  std::thread writing{[&] {
+    std::vector<unsigned char> message(message_size);
+    for (size_t i = 0; i < messages && ok; i++) {
+      const message_header_t header{i, now_ns(start)};
+      std::memcpy(message.data(), &header, sizeof(header));
+      ok = writer.write(message.data(), message.size());
+    }
+    writer.flush();
+  }};
+
+  std::vector<unsigned char> message(message_size);
+  for (size_t i = 0; i < messages; i++) {
+    message_header_t header;
+    if (!reader.read(message.data(), message.size())) {
+      ok = false;
+      break;
+    }
+    std::memcpy(&header, message.data(), sizeof(header));
+    if (header.sequence != i) {
+      std::cerr << "Message " << header.sequence << " received as " << i
+                << ".\n";
+      ok = false;
+      break;
+    }
+    latencies[i] = now_ns(start) - header.sent_ns;
+  }
+  const double seconds =
+      std::chrono::duration<double>(bench_clock::now() - start).count();
+  writing.join();
+  reader.flush();
+
+  aocl_mmd_hostchannel_destroy(handle, to_device);
+  aocl_mmd_hostchannel_destroy(handle, to_host);
+  if (!ok) {
+    std::cerr << "Streaming failed.\n";
+    return false;
+  }
+
+  std::sort(latencies.begin(), latencies.end());
+  const hostchannel_stats_t &w = writer.stats();
+  const hostchannel_stats_t &r = reader.stats();
+  result.messages_per_s = static_cast<double>(messages) / seconds;
+  result.p50_us = static_cast<double>(latencies[messages / 2]) / 1e3;
+  result.p99_us = static_cast<double>(latencies[messages * 99 / 100]) / 1e3;
+  result.write_acks =
+      static_cast<double>(w.ack_calls.load()) / static_cast<double>(messages);
+  result.read_acks =
+      static_cast<double>(r.ack_calls.load()) / static_cast<double>(messages);
+  result.write_stalls = w.stalls.load();
+  result.read_stalls = r.stalls.load();
+  result.stall_ms =
+      static_cast<double>(w.stall_ns.load() + r.stall_ns.load()) / 1e6;
+  return true;
+}
+
+static std::vector<unsigned long> parse_list(const char *list) {
+  std::vector<unsigned long> values{};
+  std::istringstream entries{list};
+  std::string entry;
+  while (std::getline(entries, entry, ',')) {
+    values.push_back(std::strtoul(entry.c_str(), nullptr, 10));
+  }
+  return values;
+}
+
+int main(int argc, char **argv) {
+  std::vector<unsigned long> batch_sizes{0, 256, 4096, 65536};
+  size_t message_size{64};
+  size_t messages{200000};
+  size_t queue_depth{1 << 20};
+  hostchannel_stream_config_t config{0, HOSTCHANNEL_YIELD, 64,
+                                     std::chrono::microseconds{1},
+                                     std::chrono::microseconds{100}};
+  bool usage = argc % 2 == 0;
+  for (int i = 1; !usage && i + 1 < argc; i += 2) {
+    const std::string value{argv[i + 1]};
+    if (!strcmp(argv[i], "-b")) {
+      batch_sizes = parse_list(argv[i + 1]);
+    } else if (!strcmp(argv[i], "-m")) {
+      message_size = std::strtoul(argv[i + 1], nullptr, 10);
+    } else if (!strcmp(argv[i], "-n")) {
+      messages = std::strtoul(argv[i + 1], nullptr, 10);
+    } else if (!strcmp(argv[i], "-q")) {
+      queue_depth = std::strtoul(argv[i + 1], nullptr, 10);
+    } else if (!strcmp(argv[i], "-p") && value == "spin") {
+      config.poll = HOSTCHANNEL_SPIN;
+    } else if (!strcmp(argv[i], "-p") && value == "yield") {
+      config.poll = HOSTCHANNEL_YIELD;
+    } else if (!strcmp(argv[i], "-p") && value == "backoff") {
+      config.poll = HOSTCHANNEL_BACKOFF;
+    } else {
+      usage = true;
+    }
+  }
+  if (usage || batch_sizes.empty() || message_size < sizeof(message_header_t) ||
+      !messages || queue_depth < message_size) {
+    std::cerr << "Usage: " << argv[0]
+              << " [-b bytes,...] [-m bytes] [-n messages] [-q bytes] "
+                 "[-p spin|yield|backoff]\n";
+    return 1;
+  }
+
+  const int handle = aocl_mmd_open("acl0");
+  if (handle < 0) {
+    std::cerr << "Could not open mock device.\n";
+    return 1;
+  }
+
+  std::cout << std::setw(8) << "batch" << std::setw(14) << "messages/s"
+            << std::setw(10) << "MB/s" << std::setw(10) << "p50 us"
+            << std::setw(10) << "p99 us" << std::setw(22)
+            << "acks/msg write/read" << std::setw(22)
+            << "stalls write/read" << std::setw(12) << "stall ms"
+            << "\n";
+  std::cout << std::fixed;
+  for (const auto batch_size : batch_sizes) {
+    config.batch_size = batch_size;
+    bench_result_t result{};
+    if (!run(handle, config, message_size, messages, queue_depth, result)) {
+      return 1;
+    }
+    std::cout << std::setw(8) << batch_size << std::setprecision(0)
+              << std::setw(14) << result.messages_per_s << std::setw(10)
+              << result.messages_per_s * static_cast<double>(message_size) /
+                     1e6
+              << std::setprecision(1) << std::setw(10) << result.p50_us
+              << std::setw(10) << result.p99_us << std::setprecision(3)
+              << std::setw(13) << result.write_acks << " / " << std::setw(6)
+              << result.read_acks << std::setw(13) << result.write_stalls
+              << " / " << std::setw(6) << result.read_stalls
+              << std::setprecision(1) << std::setw(12) << result.stall_ms
+              << "\n";
+  }
+  aocl_mmd_close(handle);
+  return 0;
+}
@@ -0,0 +1,102 @@
+#include "hostchannel_stream.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <sched.h>
+#include <thread>
+
+#include "stats.hpp"
+
+using stream_clock = std::chrono::steady_clock;
+
+bool hostchannel_stream_t::acknowledge() {
+  int status{0};
+  const size_t acked = fns.ack_buffer(handle, channel, pending, &status);
+  stats_add(counters.ack_calls, 1);
+  if (status || acked != pending) {
+    // start over with the next get_buffer
+    stats_add(counters.errors, 1);
+    window = nullptr;
+    window_size = 0;
+    pending = 0;
+    return false;
+  }
+  // the rest of the window stays available
+  window += pending;
+  window_size -= pending;
+  pending = 0;
+  return true;
+}
+
+bool hostchannel_stream_t::refill() {
+  if (pending && !acknowledge()) {
+    return false;
+  }
+
+  stream_clock::time_point stall_start{};
+  std::chrono::nanoseconds backoff{config.min_backoff};
+  for (unsigned polls = 0;; polls++) {
+    int status{0};
+    size_t size{0};
+    void *buffer = fns.get_buffer(handle, channel, &size, &status);
+    stats_add(counters.get_buffer_calls, 1);
+    if (status) {
+      stats_add(counters.errors, 1);
+      return false;
+    }
+    if (buffer && size) {
+      window = static_cast<unsigned char *>(buffer);
+      window_size = size;
+      if (polls) {
+        stats_add(counters.stall_ns,
+                  static_cast<uint64_t>(
+                      std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          stream_clock::now() - stall_start)
+                          .count()));
+      }
+      return true;
+    }
+
+    if (!polls) {
+      stats_add(counters.stalls, 1);
+      stall_start = stream_clock::now();
+    }
+    switch (config.poll) {
+    case HOSTCHANNEL_SPIN:
+      break;
+    case HOSTCHANNEL_YIELD:
+      sched_yield();
+      break;
+    case HOSTCHANNEL_BACKOFF:
+      if (polls >= config.spins) {
+        std::this_thread::sleep_for(backoff);
+        backoff = std::min(backoff * 2, config.max_backoff);
+      }
+      break;
+    }
+  }
+}
+
+bool hostchannel_stream_t::transfer(unsigned char *data, size_t len,
+                                    bool to_channel) {
+  size_t done{0};
+  while (done < len) {
+    if (pending == window_size && !refill()) {
+      return false;
+    }
+    const size_t part = std::min(len - done, window_size - pending);
+    if (to_channel) {
+      std::memcpy(window + pending, data + done, part);
+    } else {
+      std::memcpy(data + done, window + pending, part);
+    }
+    pending += part;
+    done += part;
+    if (pending >= config.batch_size && !acknowledge()) {
+      return false;
+    }
+  }
+  stats_add(counters.bytes, len);
+  stats_add(counters.messages, 1);
+  return true;
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+#include <aocl_mmd.h>
+
+/*
+ * Streaming on top of the hostchannel calls of the MMD API. Without it, every
+ * message costs a get_buffer and an ack_buffer call, each of which is a round
+ * trip to the device's registers. A stream keeps the buffer window returned
+ * by get_buffer and copies messages into (or out of) it, acknowledging them
+ * with a single ack_buffer call once `batch_size` bytes are pending. Only
+ * when the window is used up is get_buffer called again. Larger batches need
+ * fewer round trips but hold messages back until the batch is full or the
+ * stream is flushed.
+ *
+ * If the channel is full (or empty), the stream polls get_buffer according to
+ * `poll`: spinning, yielding the CPU between polls, or spinning `spins` times
+ * and then sleeping for exponentially growing intervals between `min_backoff`
+ * and `max_backoff`. Pending bytes are always acknowledged before polling, so
+ * a stream never waits for space it holds itself.
+ *
+ * A stream is used by a single thread. Its counters may be read by any
+ * thread while it is in use.
+ */
+
+enum hostchannel_poll_t {
+  HOSTCHANNEL_SPIN,
+  HOSTCHANNEL_YIELD,
+  HOSTCHANNEL_BACKOFF,
+};
+
+typedef struct {
+  // 0 acknowledges every write or read
+  size_t batch_size;
+  hostchannel_poll_t poll;
+  unsigned spins;
+  std::chrono::nanoseconds min_backoff, max_backoff;
+} hostchannel_stream_config_t;
+
+typedef struct {
+  std::atomic<uint64_t> bytes;
+  std::atomic<uint64_t> messages;
+  std::atomic<uint64_t> get_buffer_calls;
+  std::atomic<uint64_t> ack_calls;
+  // get_buffer calls that found the channel full (or empty)
+  std::atomic<uint64_t> stalls;
+  std::atomic<uint64_t> stall_ns;
+  // failed get_buffer and ack_buffer calls
+  std::atomic<uint64_t> errors;
+} hostchannel_stats_t;
+
+// The hostchannel calls of the MMD library a stream is driven through.
+typedef struct {
+  decltype(aocl_mmd_hostchannel_get_buffer) *get_buffer;
+  decltype(aocl_mmd_hostchannel_ack_buffer) *ack_buffer;
+} hostchannel_fns_t;
+
+class hostchannel_stream_t {
+  const hostchannel_fns_t fns;
+  const int handle, channel;
+  const hostchannel_stream_config_t config;
+  hostchannel_stats_t counters{};
+  unsigned char *window{nullptr};
+  size_t window_size{0};
+  // bytes of the window written or read but not acknowledged yet
+  size_t pending{0};
+
+  bool acknowledge();
+  // Waits until the window has room, false on errors.
+  bool refill();
+
+protected:
+  hostchannel_stream_t(const hostchannel_fns_t &fns_, int handle_,
+                       int channel_,
+                       const hostchannel_stream_config_t &config_)
+      : fns{fns_}, handle{handle_}, channel{channel_}, config{config_} {}
+  ~hostchannel_stream_t() = default;
+
+  // Copies `len` bytes between `data` and the channel, in the direction
+  // given by `to_channel`.
+  bool transfer(unsigned char *data, size_t len, bool to_channel);
+
+public:
+  hostchannel_stream_t(const hostchannel_stream_t &) = delete;
+  hostchannel_stream_t &operator=(const hostchannel_stream_t &) = delete;
+
+  // Acknowledges all pending bytes.
+  bool flush() { return !pending || acknowledge(); }
+
+  const hostchannel_stats_t &stats() const { return counters; }
+};
+
+// Stream into a host-to-device channel.
+class hostchannel_writer_t : public hostchannel_stream_t {
+public:
+  hostchannel_writer_t(const hostchannel_fns_t &fns_, int handle_,
+                       int channel_,
+                       const hostchannel_stream_config_t &config_)
+      : hostchannel_stream_t{fns_, handle_, channel_, config_} {}
+  ~hostchannel_writer_t() { flush(); }
+
+  // Writes a message of `len` bytes, waiting while the channel is full.
+  bool write(const void *data, size_t len) {
+    return transfer(static_cast<unsigned char *>(const_cast<void *>(data)),
+                    len, true);
+  }
+};
+
+// Stream out of a device-to-host channel.
+class hostchannel_reader_t : public hostchannel_stream_t {
+public:
+  hostchannel_reader_t(const hostchannel_fns_t &fns_, int handle_,
+                       int channel_,
+                       const hostchannel_stream_config_t &config_)
+      : hostchannel_stream_t{fns_, handle_, channel_, config_} {}
+  ~hostchannel_reader_t() { flush(); }
+
+  // Reads a message of exactly `len` bytes, waiting while the channel is
+  // empty.
+  bool read(void *data, size_t len) {
+    return transfer(static_cast<unsigned char *>(data), len, false);
+  }
+};
@@ -0,0 +1,481 @@
+/*
+ * Stand-in for a BSP's MMD library, so the wrapper can be built and
+ * benchmarked on machines without a Bittware 520N.
+ *
+ * Global memory is not stored. A read of device offset `o` fills the host
+ * buffer with mock_mmd_pattern(o). Writes and copies complete immediately.
+ * Non-blocking reads are queued and carried out by DMA worker threads, which
+ * report their completion to the registered status handler. All reads share
+ * a simulated PCIe link of limited bandwidth.
+ *
+ * Environment:
+ *   MOCK_MMD_DMA_THREADS  number of DMA worker threads (default: 2)
+ *   MOCK_MMD_BANDWIDTH    link bandwidth in GB/s, 0 for unlimited (default)
+ *   MOCK_MMD_DROP_RATE    probability of a page being left out of a read
+ *                         (default: 0)
+ *   MOCK_MMD_HOSTCHANNEL_CALL_NS
+ *                         time a hostchannel get_buffer or ack_buffer call
+ *                         takes, like a round trip to the device's registers
+ *                         (default: 1000)
+ *
+ * Devices are opened by any name ending in a digit, e.g. acl0, and get the
+ * handle digit + 1. The global memory interface is MOCK_MMD_GMEM_INTERFACE.
+ * Handle h reports the PCIe address 0000:<h>:00.0.
+ *
+ * Hostchannels are rings of `queue_depth` bytes in host memory. The device
+ * echoes all data acknowledged in its host-to-device channels into its
+ * device-to-host channel, or discards it if it has none. Directions are
+ * MOCK_MMD_HOST_TO_DEVICE and MOCK_MMD_DEVICE_TO_HOST.
+ */
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <thread>
+
+#include <aocl_mmd.h>
+
+#include "mock_mmd.hpp"
+
+constexpr size_t MOCK_PAGE_SIZE{4096};
+constexpr int MAX_MOCK_HANDLES{11};
+constexpr int MAX_MOCK_CHANNELS{8};
+
+typedef struct {
+  int handle;
+  aocl_mmd_op_t op;
+  size_t len;
+  void *dst;
+  size_t offset;
+  std::chrono::steady_clock::time_point done_at;
+} dma_job_t;
+
+typedef struct {
+  std::atomic<aocl_mmd_status_handler_fn> status_handler{nullptr};
+  std::atomic<void *> user_data{nullptr};
+} mock_device_t;
+
+typedef struct {
+  bool open;
+  int direction;
+  unsigned char *ring;
+  size_t capacity;
+  // bytes ever written into and read out of the ring
+  uint64_t head, tail;
+} mock_channel_t;
+
+class mock_env_t {
+public:
+  unsigned long dma_threads{2};
+  // bytes per ns, 0 for unlimited
+  double bandwidth{0};
+  double drop_rate{0};
+  std::chrono::nanoseconds hostchannel_call{1000};
+  mock_env_t() {
+    if (const char *threads = getenv("MOCK_MMD_DMA_THREADS")) {
+      dma_threads = std::max(1ul, std::strtoul(threads, nullptr, 10));
+    }
+    if (const char *bw = getenv("MOCK_MMD_BANDWIDTH")) {
+      bandwidth = std::strtod(bw, nullptr);
+    }
+    if (const char *rate = getenv("MOCK_MMD_DROP_RATE")) {
+      drop_rate = std::strtod(rate, nullptr);
+    }
+    if (const char *call = getenv("MOCK_MMD_HOSTCHANNEL_CALL_NS")) {
+      hostchannel_call =
+          std::chrono::nanoseconds{std::strtoul(call, nullptr, 10)};
+    }
+  }
+};
+static const mock_env_t env{};
+
+static mock_device_t devices[MAX_MOCK_HANDLES]{};
+// channel ids start at 1
+static std::mutex channel_lock{};
+static mock_channel_t channels[MAX_MOCK_HANDLES][MAX_MOCK_CHANNELS]{};
+static std::atomic<uint64_t> dropped_pages{0};
+
+// Never destroyed, detached DMA workers wait on them until the process ends.
+static std::mutex &queue_lock = *new std::mutex{};
+static std::condition_variable &queue_cv = *new std::condition_variable{};
+static std::deque<dma_job_t> &queue = *new std::deque<dma_job_t>{};
+static std::once_flag dma_workers_started{};
+
+static std::mutex link_lock{};
+static std::chrono::steady_clock::time_point link_busy_until{};
+
+// Reserves the link for a transfer of `len` bytes and returns when it ends.
+static std::chrono::steady_clock::time_point reserve_link(size_t len) {
+  const auto now = std::chrono::steady_clock::now();
+  if (env.bandwidth <= 0) {
+    return now;
+  }
+  const auto duration = std::chrono::nanoseconds{
+      static_cast<int64_t>(static_cast<double>(len) / env.bandwidth)};
+  std::lock_guard<std::mutex> lg{link_lock};
+  link_busy_until = std::max(link_busy_until, now) + duration;
+  return link_busy_until;
+}
+
+// Fills [dst, dst + len) with the pattern at `offset`, one page at a time.
+static void fill_page(unsigned char *dst, size_t len, size_t offset) {
+  // the pattern of the first page, which repeats every 256 bytes
+  static const auto pattern = [] {
+    std::array<unsigned char, 512> bytes{};
+    for (size_t i = 0; i < bytes.size(); i++) {
+      bytes[i] = mock_mmd_pattern(i);
+    }
+    return bytes;
+  }();
+  size_t i = 0;
+  while (i < len) {
+    const size_t at = offset + i;
+    const size_t n = std::min<size_t>(
+        {256, len - i,
+         MOCK_MMD_PATTERN_PAGE_SIZE - at % MOCK_MMD_PATTERN_PAGE_SIZE});
+    memcpy(dst + i, &pattern[(at + at / MOCK_MMD_PATTERN_PAGE_SIZE) & 255],
+           n);
+    i += n;
+  }
+}
+
+static void transfer(void *dst, size_t len, size_t offset) {
+  thread_local std::minstd_rand rng{std::random_device{}()};
+  std::uniform_real_distribution<double> coin{0, 1};
+  unsigned char *bytes = static_cast<unsigned char *>(dst);
+  const uintptr_t first_byte = reinterpret_cast<uintptr_t>(dst);
+
+  size_t i = 0;
+  while (i < len) {
+    // only whole host pages are dropped, like the real defect does
+    const uintptr_t page = (first_byte + i) & ~(MOCK_PAGE_SIZE - 1);
+    const size_t page_end =
+        std::min<size_t>(page + MOCK_PAGE_SIZE - first_byte, len);
+    const bool whole_page =
+        page == first_byte + i && page_end - i == MOCK_PAGE_SIZE;
+    if (whole_page && env.drop_rate > 0 && coin(rng) < env.drop_rate) {
+      dropped_pages.fetch_add(1, std::memory_order_relaxed);
+    } else {
+      fill_page(bytes + i, page_end - i, offset + i);
+    }
+    i = page_end;
+  }
+}
+
+static void dma_worker() {
+  for (;;) {
+    dma_job_t job;
+    {
+      std::unique_lock<std::mutex> lg{queue_lock};
+      queue_cv.wait(lg, [] { return !queue.empty(); });
+      job = queue.front();
+      queue.pop_front();
+    }
+    transfer(job.dst, job.len, job.offset);
+    std::this_thread::sleep_until(job.done_at);
+
+    mock_device_t &device = devices[job.handle];
+    if (aocl_mmd_status_handler_fn fn = device.status_handler.load()) {
+      fn(job.handle, device.user_data.load(), job.op, 0);
+    }
+  }
+}
+
+static bool valid_handle(int handle) {
+  return handle > 0 && handle < MAX_MOCK_HANDLES;
+}
+
+static void complete_immediately(int handle, aocl_mmd_op_t op) {
+  if (op) {
+    mock_device_t &device = devices[handle];
+    if (aocl_mmd_status_handler_fn fn = device.status_handler.load()) {
+      fn(handle, device.user_data.load(), op, 0);
+    }
+  }
+}
+
+uint64_t mock_mmd_dropped_pages() { return dropped_pages.load(); }
+
+int aocl_mmd_open(const char *name) {
+  const size_t len = name ? strlen(name) : 0;
+  if (!len || name[len - 1] < '0' || name[len - 1] > '9') {
+    return -1;
+  }
+  std::call_once(dma_workers_started, [] {
+    for (unsigned long i = 0; i < env.dma_threads; i++) {
+      std::thread(dma_worker).detach();
+    }
+  });
+  return name[len - 1] - '0' + 1;
+}
+
+int aocl_mmd_close(int handle) { return valid_handle(handle) ? 0 : -1; }
+
+int aocl_mmd_get_offline_info(aocl_mmd_offline_info_t requested_info_id,
+                              size_t param_value_size, void *param_value,
+                              size_t *param_size_ret) {
+  return -1;
+}
+
+int aocl_mmd_get_info(int handle, aocl_mmd_info_t requested_info_id,
+                      size_t param_value_size, void *param_value,
+                      size_t *param_size_ret) {
+  if (valid_handle(handle) && requested_info_id == AOCL_MMD_PCIE_INFO) {
+    const int written = snprintf(static_cast<char *>(param_value),
+                                 param_value_size, "mock:0000:%02x:00.0",
+                                 handle);
+    if (param_size_ret) {
+      *param_size_ret = written + 1;
+    }
+    return 0;
+  }
+  if (!valid_handle(handle) || requested_info_id != AOCL_MMD_MEMORY_INTERFACE ||
+      param_value_size < sizeof(int)) {
+    return -1;
+  }
+  *static_cast<int *>(param_value) = MOCK_MMD_GMEM_INTERFACE;
+  if (param_size_ret) {
+    *param_size_ret = sizeof(int);
+  }
+  return 0;
+}
+
+int aocl_mmd_set_status_handler(int handle, aocl_mmd_status_handler_fn fn,
+                                void *user_data) {
+  if (!valid_handle(handle)) {
+    return -1;
+  }
+  devices[handle].user_data.store(user_data);
+  devices[handle].status_handler.store(fn);
+  return 0;
+}
+
+int aocl_mmd_read(int handle, aocl_mmd_op_t op, size_t len, void *dst,
+                  int interface, size_t offset) {
+  if (!valid_handle(handle)) {
+    return -1;
+  }
+  const auto done_at = reserve_link(len);
+  if (!op) {
+    transfer(dst, len, offset);
+    std::this_thread::sleep_until(done_at);
+    return 0;
+  }
+  {
+    std::lock_guard<std::mutex> lg{queue_lock};
+    queue.push_back({handle, op, len, dst, offset, done_at});
+  }
+  queue_cv.notify_one();
+  return 0;
+}
+
+int aocl_mmd_write(int handle, aocl_mmd_op_t op, size_t len, const void *src,
+                   int interface, size_t offset) {
+  if (!valid_handle(handle)) {
+    return -1;
+  }
+  complete_immediately(handle, op);
+  return 0;
+}
+
+int aocl_mmd_copy(int handle, aocl_mmd_op_t op, size_t len, int interface,
+                  size_t src_offset, size_t dst_offset) {
+  if (!valid_handle(handle)) {
+    return -1;
+  }
+  complete_immediately(handle, op);
+  return 0;
+}
+
+int aocl_mmd_set_interrupt_handler(int handle, aocl_mmd_interrupt_handler_fn fn,
+                                   void *user_data) {
+  return 0;
+}
+
+int aocl_mmd_set_device_interrupt_handler(
+    int handle, aocl_mmd_device_interrupt_handler_fn fn, void *user_data) {
+  return 0;
+}
+
+int aocl_mmd_yield(int handle) { return 0; }
+
+int aocl_mmd_program(int handle, void *user_data, size_t size,
+                     aocl_mmd_program_mode_t program_mode) {
+  return handle;
+}
+
+static mock_channel_t *get_channel(int handle, int channel) {
+  if (!valid_handle(handle) || channel < 1 || channel > MAX_MOCK_CHANNELS ||
+      !channels[handle][channel - 1].open) {
+    return nullptr;
+  }
+  return &channels[handle][channel - 1];
+}
+
+// Busy waits for the duration of a register round trip.
+static void hostchannel_call() {
+  const auto until = std::chrono::steady_clock::now() + env.hostchannel_call;
+  while (std::chrono::steady_clock::now() < until) {
+  }
+}
+
+// Contiguous space (host-to-device) or data (device-to-host) of `channel`
+// available to the host.
+static size_t host_window(const mock_channel_t &channel, uint64_t &position) {
+  const bool to_device = channel.direction == MOCK_MMD_HOST_TO_DEVICE;
+  position = to_device ? channel.head : channel.tail;
+  const uint64_t used = channel.head - channel.tail;
+  const size_t available = to_device ? channel.capacity - used : used;
+  return std::min(available, channel.capacity - position % channel.capacity);
+}
+
+// Moves data of the host-to-device channels of `handle` into its
+// device-to-host channel. Called with channel_lock held.
+static void echo(int handle) {
+  mock_channel_t *out{nullptr};
+  for (auto &channel : channels[handle]) {
+    if (channel.open && channel.direction == MOCK_MMD_DEVICE_TO_HOST) {
+      out = &channel;
+      break;
+    }
+  }
+  for (auto &in : channels[handle]) {
+    if (!in.open || in.direction != MOCK_MMD_HOST_TO_DEVICE) {
+      continue;
+    }
+    if (!out) {
+      in.tail = in.head;
+      continue;
+    }
+    while (in.head != in.tail && out->head - out->tail < out->capacity) {
+      const size_t len = std::min(
+          {in.head - in.tail, in.capacity - in.tail % in.capacity,
+           out->capacity - (out->head - out->tail),
+           out->capacity - out->head % out->capacity});
+      memcpy(out->ring + out->head % out->capacity,
+             in.ring + in.tail % in.capacity, len);
+      in.tail += len;
+      out->head += len;
+    }
+  }
+}
+
+int aocl_mmd_hostchannel_create(int handle, char *channel_name,
+                                size_t queue_depth, int direction) {
+  if (!valid_handle(handle) || !queue_depth ||
+      (direction != MOCK_MMD_HOST_TO_DEVICE &&
+       direction != MOCK_MMD_DEVICE_TO_HOST)) {
+    return -1;
+  }
+  std::lock_guard<std::mutex> lg{channel_lock};
+  for (int i = 0; i < MAX_MOCK_CHANNELS; i++) {
+    mock_channel_t &channel = channels[handle][i];
+    if (!channel.open) {
+      channel = {true, direction, new unsigned char[queue_depth], queue_depth,
+                 0, 0};
+      return i + 1;
+    }
+  }
+  return -1;
+}
+
+int aocl_mmd_hostchannel_destroy(int handle, int channel) {
+  std::lock_guard<std::mutex> lg{channel_lock};
+  mock_channel_t *destroyed = get_channel(handle, channel);
+  if (!destroyed) {
+    return -1;
+  }
+  delete[] destroyed->ring;
+  *destroyed = {};
+  return 0;
+}
+
+void *aocl_mmd_hostchannel_get_buffer(int handle, int channel,
+                                      size_t *buffer_size, int *status) {
+  hostchannel_call();
+  std::lock_guard<std::mutex> lg{channel_lock};
+  mock_channel_t *ch = get_channel(handle, channel);
+  if (!ch) {
+    *status = -1;
+    return nullptr;
+  }
+  echo(handle);
+  uint64_t position;
+  *buffer_size = host_window(*ch, position);
+  *status = 0;
+  return ch->ring + position % ch->capacity;
+}
+
+size_t aocl_mmd_hostchannel_ack_buffer(int handle, int channel,
+                                       size_t send_size, int *status) {
+  hostchannel_call();
+  std::lock_guard<std::mutex> lg{channel_lock};
+  mock_channel_t *ch = get_channel(handle, channel);
+  if (!ch) {
+    *status = -1;
+    return 0;
+  }
+  uint64_t position;
+  const size_t acked = std::min(send_size, host_window(*ch, position));
+  if (ch->direction == MOCK_MMD_HOST_TO_DEVICE) {
+    ch->head += acked;
+  } else {
+    ch->tail += acked;
+  }
+  echo(handle);
+  *status = 0;
+  return acked;
+}
+
+void *aocl_mmd_shared_mem_alloc(int handle, size_t size,
+                                unsigned long long *device_ptr_out) {
+  void *host_ptr = aligned_alloc(MOCK_PAGE_SIZE, (size + MOCK_PAGE_SIZE - 1) &
+                                                     ~(MOCK_PAGE_SIZE - 1));
+  *device_ptr_out = reinterpret_cast<unsigned long long>(host_ptr);
+  return host_ptr;
+}
+
+void aocl_mmd_shared_mem_free(int handle, void *host_ptr, size_t size) {
+  free(host_ptr);
+}
+
+int aocl_mmd_sch_status(const char *device_name, size_t channel_number,
+                        unsigned int *param_value) {
+  return -1;
+}
+
+int aocl_mmd_sch_ctrl(const char *device_name, size_t channel_number,
+                      unsigned int param_value) {
+  return -1;
+}
+
+int aocl_mmd_sch_perfctrl(const char *device_name, size_t channel_number,
+                          unsigned int param_value) {
+  return -1;
+}
+
+int aocl_mmd_sch_rxperf(const char *device_name, size_t channel_number,
+                        unsigned int *param_value) {
+  return -1;
+}
+
+int aocl_mmd_sch_txperf(const char *device_name, size_t channel_number,
+                        unsigned int *param_value) {
+  return -1;
+}
+
+int aocl_mmd_card_info(const char *device_name,
+                       aocl_mmd_info_t requested_info_id,
+                       size_t param_value_size, void *param_value,
+                       size_t *param_size_ret) {
+  return -1;
+}
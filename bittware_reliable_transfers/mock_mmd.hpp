@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Extensions of the mock MMD library (mock_mmd.cpp) beyond the MMD API.
+ */
+
+constexpr int MOCK_MMD_GMEM_INTERFACE{2};
+
+// directions of hostchannels
+constexpr int MOCK_MMD_DEVICE_TO_HOST{0};
+constexpr int MOCK_MMD_HOST_TO_DEVICE{1};
+
+// Global memory pages in which the pattern is shifted
+constexpr size_t MOCK_MMD_PATTERN_PAGE_SIZE{4096};
+
+// Content of global memory at `offset`. Repeats every 256 bytes within a
+// page and shifts by one byte from page to page, so data of the wrong page
+// does not match.
+static inline unsigned char mock_mmd_pattern(size_t offset) {
+  return static_cast<unsigned char>(
+      (offset + offset / MOCK_MMD_PATTERN_PAGE_SIZE) * 31 + 7);
+}
+
+// Number of pages left out of reads so far
+extern "C" uint64_t mock_mmd_dropped_pages();
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Bounded lock-free multi-producer multi-consumer queue after D. Vyukov.
+ * Neither push() nor pop() block or allocate, so both may be used from a
+ * status handler running in signal context. push() fails if the queue is
+ * full, pop() fails if it is empty or the next element is still being
+ * written by its producer.
+ */
+template <typename T, size_t CAPACITY> class mpmc_queue_t {
+  static_assert((CAPACITY & (CAPACITY - 1)) == 0,
+                "CAPACITY must be a power of two");
+
+  typedef struct {
+    std::atomic<size_t> sequence;
+    T data;
+  } cell_t;
+
+  cell_t cells[CAPACITY];
+  alignas(64) std::atomic<size_t> enqueue_pos{0};
+  alignas(64) std::atomic<size_t> dequeue_pos{0};
+
+public:
+  mpmc_queue_t() {
+    for (size_t i = 0; i < CAPACITY; i++) {
+      cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  bool push(const T &data) {
+    size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+    for (;;) {
+      cell_t &cell = cells[pos & (CAPACITY - 1)];
+      const size_t seq = cell.sequence.load(std::memory_order_acquire);
+      const auto diff =
+          static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+      if (diff == 0) {
+        if (enqueue_pos.compare_exchange_weak(pos, pos + 1,
+                                              std::memory_order_relaxed)) {
+          cell.data = data;
+          cell.sequence.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = enqueue_pos.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  bool pop(T &data) {
+    size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+    for (;;) {
+      cell_t &cell = cells[pos & (CAPACITY - 1)];
+      const size_t seq = cell.sequence.load(std::memory_order_acquire);
+      const auto diff =
+          static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+      if (diff == 0) {
+        if (dequeue_pos.compare_exchange_weak(pos, pos + 1,
+                                              std::memory_order_relaxed)) {
+          data = cell.data;
+          cell.sequence.store(pos + CAPACITY, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = dequeue_pos.load(std::memory_order_relaxed);
+      }
+    }
+  }
+};
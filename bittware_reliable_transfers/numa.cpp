@@ -0,0 +1,154 @@
+#include "numa.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <linux/mempolicy.h>
+#include <mutex>
+#include <pthread.h>
+#include <regex>
+#include <sstream>
+#include <string>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static const char *const PCI_DEVICES_PATH{"/bus/pci/devices/"};
+static const char *const NUMA_NODES_PATH{"/devices/system/node/node"};
+
+// nodes beyond this are never bound to
+constexpr int MAX_NUMA_NODES{1024};
+constexpr int BITS_PER_MASK_WORD{8 * sizeof(unsigned long)};
+// pages sampled by mostly_remote()
+constexpr int REMOTE_SAMPLES{4};
+constexpr uintptr_t NUMA_PAGE_SIZE{4096};
+// internal threads beyond this are not moved
+constexpr int MAX_INTERNAL_THREADS{256};
+
+static std::mutex internal_threads_lock{};
+static pthread_t internal_threads[MAX_INTERNAL_THREADS]{};
+static int internal_thread_count{0};
+static cpu_set_t internal_cpus{};
+
+int pcie_numa_node(const char *sysfs_root, const char *pcie_info) {
+  // BSPs differ in how they format the PCIe info, but all of them contain the
+  // address of the device as [domain:]bus:slot.func
+  static const std::regex address{
+      "(?:([0-9a-f]{4}):)?([0-9a-f]{2}):([0-9a-f]{2})\\.([0-9a-f]+)",
+      std::regex::icase};
+  std::cmatch match;
+  if (!pcie_info || !std::regex_search(pcie_info, match, address)) {
+    return -1;
+  }
+
+  char device[16];
+  snprintf(device, sizeof(device), "%04lx:%02lx:%02lx.%lx",
+           match[1].matched ? std::stoul(match[1].str(), nullptr, 16) : 0ul,
+           std::stoul(match[2].str(), nullptr, 16),
+           std::stoul(match[3].str(), nullptr, 16),
+           std::stoul(match[4].str(), nullptr, 16));
+
+  std::ifstream numa_node{std::string{sysfs_root} + PCI_DEVICES_PATH +
+                          device + "/numa_node"};
+  int node{-1};
+  if (!(numa_node >> node)) {
+    return -1;
+  }
+  // -1 on machines without NUMA
+  return node;
+}
+
+bool numa_node_cpus(const char *sysfs_root, int node, cpu_set_t *cpus) {
+  if (node < 0) {
+    return false;
+  }
+  std::ifstream cpulist_file{std::string{sysfs_root} + NUMA_NODES_PATH +
+                             std::to_string(node) + "/cpulist"};
+  std::string cpulist;
+  if (!std::getline(cpulist_file, cpulist)) {
+    return false;
+  }
+
+  // comma-separated list of CPUs and ranges of CPUs, e.g. "0-15,32-47"
+  CPU_ZERO(cpus);
+  std::istringstream entries{cpulist};
+  std::string entry;
+  while (std::getline(entries, entry, ',')) {
+    unsigned first, last;
+    const int fields = sscanf(entry.c_str(), "%u-%u", &first, &last);
+    if (fields < 1) {
+      continue;
+    }
+    if (fields == 1) {
+      last = first;
+    }
+    for (unsigned cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+      CPU_SET(cpu, cpus);
+    }
+  }
+  return CPU_COUNT(cpus) > 0;
+}
+
+bool prefer_numa_node(void *addr, size_t len, int node) {
+  if (node < 0 || node >= MAX_NUMA_NODES) {
+    return false;
+  }
+  unsigned long nodes[MAX_NUMA_NODES / BITS_PER_MASK_WORD]{};
+  nodes[node / BITS_PER_MASK_WORD] = 1ul << (node % BITS_PER_MASK_WORD);
+  // The kernel ignores the last bit of the mask.
+  return syscall(SYS_mbind, addr, len, MPOL_PREFERRED, nodes,
+                 MAX_NUMA_NODES + 1, 0) == 0;
+}
+
+bool mostly_remote(const void *addr, size_t len, int node) {
+  if (node < 0 || !len) {
+    return false;
+  }
+  const uintptr_t first = reinterpret_cast<uintptr_t>(addr) &
+                          ~(NUMA_PAGE_SIZE - 1);
+  const uintptr_t span = reinterpret_cast<uintptr_t>(addr) + len - first;
+  void *pages[REMOTE_SAMPLES];
+  for (int i = 0; i < REMOTE_SAMPLES; i++) {
+    pages[i] = reinterpret_cast<void *>(
+        first + (span * i / REMOTE_SAMPLES & ~(NUMA_PAGE_SIZE - 1)));
+  }
+
+  // Without target nodes, move_pages only reports where the pages are.
+  int status[REMOTE_SAMPLES];
+  if (syscall(SYS_move_pages, 0, REMOTE_SAMPLES, pages, nullptr, status, 0)) {
+    return false;
+  }
+  int remote{0}, local{0};
+  for (int i = 0; i < REMOTE_SAMPLES; i++) {
+    // negative errno for pages that are not resident
+    if (status[i] >= 0) {
+      status[i] == node ? local++ : remote++;
+    }
+  }
+  return remote > local;
+}
+
+void register_internal_thread() {
+  std::lock_guard<std::mutex> lg{internal_threads_lock};
+  if (internal_thread_count == MAX_INTERNAL_THREADS) {
+    return;
+  }
+  internal_threads[internal_thread_count++] = pthread_self();
+  if (CPU_COUNT(&internal_cpus)) {
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &internal_cpus);
+  }
+}
+
+void add_internal_thread_cpus(const cpu_set_t *cpus) {
+  std::lock_guard<std::mutex> lg{internal_threads_lock};
+  cpu_set_t widened;
+  CPU_OR(&widened, &internal_cpus, cpus);
+  if (CPU_EQUAL(&widened, &internal_cpus)) {
+    return;
+  }
+  internal_cpus = widened;
+  // internal threads never exit, their handles stay valid
+  for (int i = 0; i < internal_thread_count; i++) {
+    pthread_setaffinity_np(internal_threads[i], sizeof(cpu_set_t),
+                           &internal_cpus);
+  }
+}
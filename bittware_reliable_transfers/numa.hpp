@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+#include <sched.h>
+
+/*
+ * NUMA topology as exposed through sysfs, and placement of the wrapper's own
+ * threads and memory on the nodes of the devices they work for. All sysfs
+ * lookups take the root of the tree, "/sys" on a real system, so they can be
+ * pointed at a fake tree. Memory policies and page locations are handled with
+ * the raw syscalls, the wrapper does not depend on libnuma.
+ */
+
+// Returns the NUMA node of the PCIe device described by `pcie_info`, the
+// string reported for AOCL_MMD_PCIE_INFO, or -1 if it cannot be determined.
+int pcie_numa_node(const char *sysfs_root, const char *pcie_info);
+
+// Fills `cpus` with the CPUs of NUMA node `node`. Returns false if the node
+// is unknown.
+bool numa_node_cpus(const char *sysfs_root, int node, cpu_set_t *cpus);
+
+// Makes the pages of [addr, addr + len) that are not faulted in yet prefer
+// `node`. Returns false if the kernel refused.
+bool prefer_numa_node(void *addr, size_t len, int node);
+
+// Returns true if most of a few sampled pages of [addr, addr + len) are
+// resident on another node than `node`. Pages that are not resident yet do
+// not count.
+bool mostly_remote(const void *addr, size_t len, int node);
+
+// Wrapper-internal threads register themselves when they start, so they can
+// be moved to the CPUs of the devices opened later on.
+void register_internal_thread();
+
+// Allows all registered and future internal threads to run on `cpus` as well.
+// Until this is called for the first time, internal threads are not pinned.
+void add_internal_thread_cpus(const cpu_set_t *cpus);
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <sys/mman.h>
+
+#include <aocl_mmd.h>
+
+#include "bounce_pool.hpp"
+
+/*
+ * Wrapped non-blocking read operations live in a single, lazily backed slab of
+ * cache-line aligned slots that is reserved once at load time. The status
+ * handler recognizes a wrapped op in O(1) and without taking any lock: the
+ * pointer must fall into the slab and the slot must carry the live magic.
+ * Completed slots go back onto a lock-free free list. Both acquire() and
+ * release() are async-signal-safe, so the status handler may recycle slots
+ * even when the BSP delivers completions from a signal handler.
+ */
+
+constexpr uint64_t OP_MAGIC_TAG{0x50433257ull << 32}; // "PC2W"
+constexpr uint64_t OP_MAGIC_TAG_MASK{0xffffffffull << 32};
+
+typedef struct alignas(64) wrapped_aocl_mmd_op_s {
+  // OP_MAGIC_TAG while in use, 0 while free
+  std::atomic<uint64_t> magic;
+  std::atomic<uint32_t> next_free;
+  aocl_mmd_op_t op;
+  size_t len;
+  void *dst;
+  int interface;
+  size_t offset;
+  int handle;
+  // position in the completion order of the device
+  uint64_t completion;
+  std::chrono::steady_clock::time_point issued;
+  // nonce dst was stamped with
+  uint64_t nonce;
+  // staging buffer the BSP reads into instead of dst, if any
+  bounce_buffer_t *bounce;
+
+  // Chunked reads: a parent op tracks the chunks it was split into, each of
+  // which is a wrapped op itself and points back to its parent.
+  struct wrapped_aocl_mmd_op_s *parent;
+  std::atomic<uint32_t> unreported_chunks;
+  std::atomic<uint32_t> pending_chunks;
+  std::atomic<int> status;
+  std::atomic<uint32_t> done;
+} wrapped_aocl_mmd_op_t;
+
+class op_pool_t {
+  wrapped_aocl_mmd_op_t *slots{};
+  uint32_t capacity{0};
+  std::atomic<uint32_t> used{0};
+  // (ABA counter << 32) | (slot index + 1), 0 if empty
+  std::atomic<uint64_t> free_head{0};
+
+  wrapped_aocl_mmd_op_t *pop_free() {
+    uint64_t head = free_head.load(std::memory_order_acquire);
+    while (head & 0xffffffff) {
+      wrapped_aocl_mmd_op_t *slot = &slots[(head & 0xffffffff) - 1];
+      uint64_t next = ((head >> 32) + 1) << 32 |
+                      slot->next_free.load(std::memory_order_relaxed);
+      if (free_head.compare_exchange_weak(head, next,
+                                          std::memory_order_acquire)) {
+        return slot;
+      }
+    }
+    return nullptr;
+  }
+
+public:
+  explicit op_pool_t(uint32_t max_ops) {
+    void *mem = mmap(nullptr, max_ops * sizeof(wrapped_aocl_mmd_op_t),
+                     PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem != MAP_FAILED) {
+      slots = static_cast<wrapped_aocl_mmd_op_t *>(mem);
+      capacity = max_ops;
+    }
+  }
+
+  // Returns nullptr if all slots are in flight.
+  wrapped_aocl_mmd_op_t *acquire() {
+    wrapped_aocl_mmd_op_t *slot = pop_free();
+    if (!slot && used.load(std::memory_order_relaxed) < capacity) {
+      uint32_t idx = used.fetch_add(1, std::memory_order_relaxed);
+      if (idx < capacity) {
+        slot = &slots[idx];
+      }
+    }
+    if (slot) {
+      slot->magic.store(OP_MAGIC_TAG, std::memory_order_release);
+    }
+    return slot;
+  }
+
+  void release(wrapped_aocl_mmd_op_t *slot) {
+    slot->magic.store(0, std::memory_order_relaxed);
+    const uint64_t idx = static_cast<uint64_t>(slot - slots) + 1;
+    uint64_t head = free_head.load(std::memory_order_relaxed);
+    do {
+      slot->next_free.store(static_cast<uint32_t>(head & 0xffffffff),
+                            std::memory_order_relaxed);
+    } while (!free_head.compare_exchange_weak(
+        head, (((head >> 32) + 1) << 32) | idx, std::memory_order_release,
+        std::memory_order_relaxed));
+  }
+
+  // Returns the wrapper behind `op` or nullptr if `op` is not a live wrapper.
+  wrapped_aocl_mmd_op_t *lookup(aocl_mmd_op_t op) const {
+    const uintptr_t addr = reinterpret_cast<uintptr_t>(op);
+    const uintptr_t base = reinterpret_cast<uintptr_t>(slots);
+    if (addr < base || addr >= base + capacity * sizeof(*slots) ||
+        (addr - base) % sizeof(*slots)) {
+      return nullptr;
+    }
+    wrapped_aocl_mmd_op_t *slot = static_cast<wrapped_aocl_mmd_op_t *>(op);
+    if ((slot->magic.load(std::memory_order_acquire) & OP_MAGIC_TAG_MASK) !=
+        OP_MAGIC_TAG) {
+      return nullptr;
+    }
+    return slot;
+  }
+};
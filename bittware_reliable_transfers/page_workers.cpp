@@ -0,0 +1,129 @@
+#include "page_workers.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <mutex>
+#include <semaphore.h>
+#include <thread>
+
+#include "futex.hpp"
+#include "mpmc_queue.hpp"
+#include "numa.hpp"
+#include "stamping.hpp"
+
+// Smaller parts are not worth waking up a worker for
+constexpr size_t MIN_PART_SIZE{4 << 20};
+// More parts than threads balance out threads that start late
+constexpr size_t PARTS_PER_THREAD{4};
+constexpr size_t MAX_QUEUED_JOBS{256};
+
+typedef struct {
+  page_part_fn_t fn;
+  void *ctx;
+  uintptr_t begin, end;
+  size_t part_size, parts;
+  std::atomic<size_t> next_part;
+  std::atomic<size_t> finished_parts;
+  std::atomic<uint32_t> done;
+  // the caller and each worker that was handed the job
+  std::atomic<uint32_t> refs;
+} page_job_t;
+
+// set when the first device is opened, i.e. before any read
+static std::atomic<unsigned long> workers{0};
+static mpmc_queue_t<page_job_t *, MAX_QUEUED_JOBS> job_queue{};
+static sem_t job_sem{};
+static std::once_flag workers_started{};
+
+static inline size_t part_size(size_t len) {
+  const size_t per_part =
+      len / ((workers.load(std::memory_order_relaxed) + 1) * PARTS_PER_THREAD);
+  return std::max(MIN_PART_SIZE,
+                  (per_part + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+}
+
+static void run_parts(page_job_t *job) {
+  const uintptr_t base = job->begin & ~(PAGE_SIZE - 1);
+  for (;;) {
+    const size_t part = job->next_part.fetch_add(1);
+    if (part >= job->parts) {
+      return;
+    }
+    const uintptr_t begin = part ? base + part * job->part_size : job->begin;
+    const uintptr_t end =
+        std::min(base + (part + 1) * job->part_size, job->end);
+    job->fn(reinterpret_cast<void *>(begin), end - begin, part, job->ctx);
+
+    if (job->finished_parts.fetch_add(1) + 1 == job->parts) {
+      job->done.store(1);
+      futex_wake(job->done);
+    }
+  }
+}
+
+static void release_job(page_job_t *job) {
+  if (job->refs.fetch_sub(1) == 1) {
+    delete job;
+  }
+}
+
+static void page_worker() {
+  register_internal_thread();
+  for (;;) {
+    while (sem_wait(&job_sem) && errno == EINTR) {
+    }
+    page_job_t *job;
+    while (!job_queue.pop(job)) {
+      sched_yield();
+    }
+    run_parts(job);
+    release_job(job);
+  }
+}
+
+void start_page_workers(unsigned long threads) {
+  std::call_once(workers_started, [threads] {
+    sem_init(&job_sem, 0, 0);
+    for (unsigned long i = 0; i < threads; i++) {
+      std::thread(page_worker).detach();
+    }
+    workers.store(threads, std::memory_order_relaxed);
+  });
+}
+
+size_t page_part_count(const void *dst, size_t len) {
+  const uintptr_t begin = reinterpret_cast<uintptr_t>(dst);
+  const size_t size = part_size(len);
+  return (begin + len - (begin & ~(PAGE_SIZE - 1)) + size - 1) / size;
+}
+
+void for_each_page_part(void *dst, size_t len, page_part_fn_t fn, void *ctx) {
+  page_job_t *job = new page_job_t{};
+  job->fn = fn;
+  job->ctx = ctx;
+  job->begin = reinterpret_cast<uintptr_t>(dst);
+  job->end = job->begin + len;
+  job->part_size = part_size(len);
+  job->parts = page_part_count(dst, len);
+
+  // A worker that picks up the job after all parts are done drops its
+  // reference right away, so the caller never has to wait for it.
+  const size_t helpers = std::min<size_t>(
+      workers.load(std::memory_order_relaxed), job->parts - 1);
+  job->refs.store(static_cast<uint32_t>(helpers + 1));
+  for (size_t i = 0; i < helpers; i++) {
+    if (job_queue.push(job)) {
+      sem_post(&job_sem);
+    } else {
+      job->refs.fetch_sub(1);
+    }
+  }
+
+  run_parts(job);
+  while (!job->done.load()) {
+    futex_wait(job->done, 0);
+  }
+  release_job(job);
+}
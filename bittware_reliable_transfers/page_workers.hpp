@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstddef>
+
+/*
+ * A small persistent pool of threads that share the page walk of stamping and
+ * checking very large transfers. A range is split into parts of whole pages
+ * which the workers and the calling thread claim one at a time, so a busy
+ * worker never holds up a caller. Workers sleep on a semaphore while idle.
+ * Splitting a range costs one allocation and a few atomics, which only pays
+ * off for transfers of tens of MiB and more.
+ */
+
+typedef void (*page_part_fn_t)(void *dst, size_t len, size_t part, void *ctx);
+
+// Starts `threads` workers. Only the first call has an effect. The workers
+// are internal threads in the sense of numa.hpp.
+void start_page_workers(unsigned long threads);
+
+// Returns the number of parts for_each_page_part() splits [dst, dst + len)
+// into.
+size_t page_part_count(const void *dst, size_t len);
+
+// Calls `fn` for each part of [dst, dst + len) on the workers and the calling
+// thread and returns after all parts are done. All parts but the first begin
+// at a page boundary. Parts are numbered in address order.
+void for_each_page_part(void *dst, size_t len, page_part_fn_t fn, void *ctx);
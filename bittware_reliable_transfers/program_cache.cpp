@@ -0,0 +1,162 @@
+#include "program_cache.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <string>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+constexpr uint64_t PROGRAM_RECORD_MAGIC{0x3130676f72707462}; // "btprog01"
+constexpr size_t BOOT_ID_SIZE{40};
+
+typedef struct {
+  uint64_t magic;
+  char boot_id[BOOT_ID_SIZE];
+  uint64_t hash;
+  uint64_t size;
+} program_record_data_t;
+
+constexpr uint64_t PRIME64_1{0x9e3779b185ebca87};
+constexpr uint64_t PRIME64_2{0xc2b2ae3d27d4eb4f};
+constexpr uint64_t PRIME64_3{0x165667b19e3779f9};
+constexpr uint64_t PRIME64_4{0x85ebca77c2b2ae63};
+constexpr uint64_t PRIME64_5{0x27d4eb2f165667c5};
+
+static inline uint64_t rotl(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char *p) {
+  uint64_t value;
+  std::memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static inline uint32_t read32(const unsigned char *p) {
+  uint32_t value;
+  std::memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+  return rotl(acc + input * PRIME64_2, 31) * PRIME64_1;
+}
+
+static inline uint64_t xxh64_merge(uint64_t acc, uint64_t value) {
+  return (acc ^ xxh64_round(0, value)) * PRIME64_1 + PRIME64_4;
+}
+
+uint64_t hash_bitstream(const void *data, size_t size) {
+  const unsigned char *p = static_cast<const unsigned char *>(data);
+  const unsigned char *const end = p + size;
+  uint64_t h;
+
+  if (size >= 32) {
+    uint64_t v1 = PRIME64_1 + PRIME64_2;
+    uint64_t v2 = PRIME64_2;
+    uint64_t v3 = 0;
+    uint64_t v4 = -PRIME64_1;
+    for (; p + 32 <= end; p += 32) {
+      v1 = xxh64_round(v1, read64(p));
+      v2 = xxh64_round(v2, read64(p + 8));
+      v3 = xxh64_round(v3, read64(p + 16));
+      v4 = xxh64_round(v4, read64(p + 24));
+    }
+    h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+    h = xxh64_merge(h, v1);
+    h = xxh64_merge(h, v2);
+    h = xxh64_merge(h, v3);
+    h = xxh64_merge(h, v4);
+  } else {
+    h = PRIME64_5;
+  }
+  h += size;
+
+  for (; p + 8 <= end; p += 8) {
+    h = rotl(h ^ xxh64_round(0, read64(p)), 27) * PRIME64_1 + PRIME64_4;
+  }
+  if (p + 4 <= end) {
+    h = rotl(h ^ (read32(p) * PRIME64_1), 23) * PRIME64_2 + PRIME64_3;
+    p += 4;
+  }
+  for (; p < end; p++) {
+    h = rotl(h ^ (*p * PRIME64_5), 11) * PRIME64_1;
+  }
+
+  h ^= h >> 33;
+  h *= PRIME64_2;
+  h ^= h >> 29;
+  h *= PRIME64_3;
+  return h ^ (h >> 32);
+}
+
+static void read_boot_id(char *boot_id) {
+  std::memset(boot_id, 0, BOOT_ID_SIZE);
+  std::ifstream file{"/proc/sys/kernel/random/boot_id"};
+  file.getline(boot_id, BOOT_ID_SIZE);
+}
+
+program_record_t::program_record_t(const char *device) {
+  std::string path{PROGRAM_RECORD_PREFIX + std::to_string(geteuid()) + '.'};
+  for (const char *c = device; *c; c++) {
+    path += *c == '/' ? '_' : *c;
+  }
+
+  fd = open(path.c_str(), O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    return;
+  }
+  // /dev/shm is writable by everyone, only trust records of this user
+  struct stat st;
+  if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_uid != geteuid() ||
+      (st.st_mode & 022)) {
+    close(fd);
+    fd = -1;
+    return;
+  }
+  while (flock(fd, LOCK_EX) && errno == EINTR) {
+  }
+}
+
+program_record_t::~program_record_t() {
+  if (fd >= 0) {
+    // also releases the lock
+    close(fd);
+  }
+}
+
+bool program_record_t::matches(uint64_t hash, uint64_t size) const {
+  program_record_data_t record{};
+  if (fd < 0 || pread(fd, &record, sizeof(record), 0) !=
+                    static_cast<ssize_t>(sizeof(record))) {
+    return false;
+  }
+  char boot_id[BOOT_ID_SIZE];
+  read_boot_id(boot_id);
+  return record.magic == PROGRAM_RECORD_MAGIC && boot_id[0] &&
+         !std::memcmp(record.boot_id, boot_id, BOOT_ID_SIZE) &&
+         record.hash == hash && record.size == size;
+}
+
+void program_record_t::invalidate() {
+  if (fd >= 0 && ftruncate(fd, 0)) {
+    // a record that cannot be invalidated must not be trusted either
+    program_record_data_t record{};
+    pwrite(fd, &record, sizeof(record), 0);
+  }
+}
+
+void program_record_t::store(uint64_t hash, uint64_t size) {
+  if (fd < 0) {
+    return;
+  }
+  program_record_data_t record{};
+  record.magic = PROGRAM_RECORD_MAGIC;
+  read_boot_id(record.boot_id);
+  record.hash = hash;
+  record.size = size;
+  pwrite(fd, &record, sizeof(record), 0);
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Node-wide record of the bitstream each device was last programmed with, so
+ * processes that program a device with the bitstream it already holds can
+ * skip the reprogramming. Each user has a record file per device under
+ * /dev/shm, named after the user id and the device, which holds the hash and
+ * size of the bitstream and the boot id of the node. Records of a previous
+ * boot never match. Records that are symbolic links, belong to another user
+ * or are writable by others are not used.
+ *
+ * A program_record_t locks the record file of a device for its lifetime, so
+ * concurrent processes that want to program the same device, e.g. the ranks
+ * of an MPI job, are serialized: the first one programs the device and the
+ * others find a matching record. The record is invalidated before the device
+ * is programmed and only stored after programming succeeded, so a failed or
+ * interrupted programming never leaves a matching record behind.
+ */
+
+constexpr auto PROGRAM_RECORD_PREFIX{"/dev/shm/bittfix-program."};
+
+// XXH64 of [data, data + size)
+uint64_t hash_bitstream(const void *data, size_t size);
+
+class program_record_t {
+  int fd{-1};
+
+public:
+  // Opens and locks the record of `device`. Without access to the record, it
+  // never matches and nothing is stored.
+  explicit program_record_t(const char *device);
+  ~program_record_t();
+  program_record_t(const program_record_t &) = delete;
+  program_record_t &operator=(const program_record_t &) = delete;
+
+  // True if the device holds a bitstream with this hash and size.
+  bool matches(uint64_t hash, uint64_t size) const;
+  void invalidate();
+  void store(uint64_t hash, uint64_t size);
+};
@@ -0,0 +1,248 @@
+#include "residency.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <sched.h>
+#include <sys/mman.h>
+#include <vector>
+
+#include "stamping.hpp"
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+// Faulting in fewer pages than this is cheaper than a syscall to populate them
+constexpr size_t MIN_POPULATE_PAGES{16};
+// Stamping a resident page takes a few ns, faulting one in far more than this
+constexpr int64_t MAX_RESIDENT_STAMP_NS_PER_PAGE{100};
+
+// ranges the cache can hold, further ones are not remembered
+constexpr size_t MAX_RESIDENT_RANGES{1024};
+// pages of a cached range checked on each hit
+constexpr size_t RESIDENCY_SAMPLES{4};
+
+typedef enum { RANGE_UNKNOWN, RANGE_RESIDENT, RANGE_RECYCLED } range_state_t;
+
+typedef struct {
+  uintptr_t begin, end;
+  bool recycled;
+} resident_range_t;
+
+// Fixed size, so looking up a range never allocates.
+class residency_cache_t {
+  // non-overlapping page-aligned ranges sorted by start address
+  resident_range_t ranges[MAX_RESIDENT_RANGES]{};
+  size_t count{0};
+  std::atomic_flag locked = ATOMIC_FLAG_INIT;
+
+  void lock() {
+    while (locked.test_and_set(std::memory_order_acquire)) {
+      sched_yield();
+    }
+  }
+
+  void unlock() { locked.clear(std::memory_order_release); }
+
+  // Index of the first range that ends after `addr`.
+  size_t first_after(uintptr_t addr) const {
+    return std::partition_point(
+               ranges, ranges + count,
+               [addr](const resident_range_t &r) { return r.end <= addr; }) -
+           ranges;
+  }
+
+  void erase_locked(uintptr_t begin, uintptr_t end) {
+    size_t i = first_after(begin);
+    if (i < count && ranges[i].begin < begin && ranges[i].end > end) {
+      // split, the part behind is dropped if there is no room for it
+      if (count < MAX_RESIDENT_RANGES) {
+        std::copy_backward(ranges + i + 1, ranges + count,
+                           ranges + count + 1);
+        ranges[i + 1] = {end, ranges[i].end, ranges[i].recycled};
+        count++;
+      }
+      ranges[i].end = begin;
+      return;
+    }
+    if (i < count && ranges[i].begin < begin) {
+      ranges[i++].end = begin;
+    }
+    size_t j = i;
+    while (j < count && ranges[j].end <= end) {
+      j++;
+    }
+    if (j < count && ranges[j].begin < end) {
+      ranges[j].begin = end;
+    }
+    std::copy(ranges + j, ranges + count, ranges + i);
+    count -= j - i;
+  }
+
+public:
+  // Whether [begin, end) lies within a single range, and how it is flagged.
+  range_state_t lookup(uintptr_t begin, uintptr_t end) {
+    lock();
+    const size_t i = first_after(begin);
+    range_state_t state{RANGE_UNKNOWN};
+    if (i < count && ranges[i].begin <= begin && ranges[i].end >= end) {
+      state = ranges[i].recycled ? RANGE_RECYCLED : RANGE_RESIDENT;
+    }
+    unlock();
+    return state;
+  }
+
+  // Sets [begin, end) to `recycled`, merging it with adjacent ranges flagged
+  // the same.
+  void insert(uintptr_t begin, uintptr_t end, bool recycled) {
+    lock();
+    erase_locked(begin, end);
+    const size_t i = first_after(begin);
+    const bool merge_prev = i > 0 && ranges[i - 1].end == begin &&
+                            ranges[i - 1].recycled == recycled;
+    const bool merge_next =
+        i < count && ranges[i].begin == end && ranges[i].recycled == recycled;
+    if (merge_prev && merge_next) {
+      ranges[i - 1].end = ranges[i].end;
+      std::copy(ranges + i + 1, ranges + count, ranges + i);
+      count--;
+    } else if (merge_prev) {
+      ranges[i - 1].end = end;
+    } else if (merge_next) {
+      ranges[i].begin = begin;
+    } else if (count < MAX_RESIDENT_RANGES) {
+      std::copy_backward(ranges + i, ranges + count, ranges + count + 1);
+      ranges[i] = {begin, end, recycled};
+      count++;
+    }
+    unlock();
+  }
+
+  // Forgets [begin, end), keeping the parts of ranges outside of it.
+  void invalidate(uintptr_t begin, uintptr_t end) {
+    lock();
+    erase_locked(begin, end);
+    unlock();
+  }
+};
+
+// Trivially destructible, reads may still be issued during process teardown.
+static residency_cache_t cache{};
+
+static std::atomic<bool> populate_write_supported{true};
+
+static inline uintptr_t page_floor(const void *ptr) {
+  return reinterpret_cast<uintptr_t>(ptr) & ~(PAGE_SIZE - 1);
+}
+
+static inline uintptr_t page_ceil(const void *ptr, size_t len) {
+  return (reinterpret_cast<uintptr_t>(ptr) + len + PAGE_SIZE - 1) &
+         ~(PAGE_SIZE - 1);
+}
+
+/*
+ * A range cached as resident may have been unmapped and mapped again since,
+ * which the wrapper does not see. So a few of its pages are checked with
+ * mincore on every hit, at positions that move from one check to the next.
+ * A fresh mapping has none of its pages resident, so any sample catches it.
+ */
+static bool samples_resident(uintptr_t begin, uintptr_t end) {
+  static std::atomic<size_t> rotation{0};
+  const size_t pages = (end - begin) / PAGE_SIZE;
+  const size_t shift = rotation.fetch_add(1, std::memory_order_relaxed);
+  for (size_t i = 0; i < RESIDENCY_SAMPLES; i++) {
+    const size_t page = (i * pages / RESIDENCY_SAMPLES + shift) % pages;
+    unsigned char residency;
+    if (mincore(reinterpret_cast<void *>(begin + page * PAGE_SIZE), PAGE_SIZE,
+                &residency) ||
+        !(residency & 1)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Returns true if all pages were resident already.
+static bool populate(uintptr_t begin, uintptr_t end, bool use_mlock) {
+  void *addr = reinterpret_cast<void *>(begin);
+  const size_t len = end - begin;
+
+  std::vector<unsigned char> residency(len / PAGE_SIZE);
+  if (mincore(addr, len, residency.data())) {
+    return false;
+  }
+  const auto missing = std::count_if(residency.begin(), residency.end(),
+                                     [](unsigned char r) { return !(r & 1); });
+  if (static_cast<size_t>(missing) < MIN_POPULATE_PAGES) {
+    return !missing;
+  }
+
+  if (!use_mlock && populate_write_supported.load(std::memory_order_relaxed)) {
+    if (madvise(addr, len, MADV_POPULATE_WRITE) == 0 || errno != EINVAL) {
+      return false;
+    }
+    // kernel older than 5.14
+    populate_write_supported.store(false, std::memory_order_relaxed);
+  }
+
+  if (mlock(addr, len) == 0) {
+    munlock(addr, len);
+  }
+  return false;
+}
+
+bool make_resident(void *dst, size_t len, bool use_mlock) {
+  if (len < MIN_POPULATE_PAGES * PAGE_SIZE) {
+    return false;
+  }
+
+  const uintptr_t begin = page_floor(dst);
+  const uintptr_t end = page_ceil(dst, len);
+  const range_state_t state = cache.lookup(begin, end);
+  if (state == RANGE_RESIDENT && samples_resident(begin, end)) {
+    return true;
+  }
+
+  const bool resident = populate(begin, end, use_mlock);
+  // recycled ranges stay flagged until they are found fully resident
+  cache.insert(begin, end, state == RANGE_RECYCLED && !resident);
+  return false;
+}
+
+bool looks_resident(const void *dst, size_t len) {
+  if (len < MIN_POPULATE_PAGES * PAGE_SIZE) {
+    return true;
+  }
+
+  const uintptr_t begin = page_floor(dst);
+  const uintptr_t end = page_ceil(dst, len);
+  const range_state_t state = cache.lookup(begin, end);
+  if (state == RANGE_RESIDENT && samples_resident(begin, end)) {
+    return true;
+  }
+
+  std::vector<unsigned char> residency((end - begin) / PAGE_SIZE);
+  if (mincore(reinterpret_cast<void *>(begin), end - begin,
+              residency.data())) {
+    return true;
+  }
+  const auto missing = std::count_if(residency.begin(), residency.end(),
+                                     [](unsigned char r) { return !(r & 1); });
+  if (state != RANGE_UNKNOWN && missing) {
+    // remapped, populated again by the read if it is not staged
+    cache.invalidate(begin, end);
+  } else if (state == RANGE_RECYCLED && !missing) {
+    cache.insert(begin, end, false);
+  }
+  return static_cast<size_t>(missing) < MIN_POPULATE_PAGES;
+}
+
+void report_stamp_time(void *dst, size_t len,
+                       std::chrono::nanoseconds elapsed) {
+  const auto pages = static_cast<int64_t>(len / PAGE_SIZE);
+  if (elapsed.count() > pages * MAX_RESIDENT_STAMP_NS_PER_PAGE) {
+    cache.insert(page_floor(dst), page_ceil(dst, len), true);
+  }
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+
+/*
+ * Stamping freshly allocated host memory that is not yet backed by physical
+ * pages costs one page fault per page. To avoid this first-touch trap,
+ * make_resident() populates a destination range before it is stamped, using
+ * the cheapest strategy according to its current residency (mincore):
+ * nothing if (almost) all pages are resident, otherwise MADV_POPULATE_WRITE
+ * or, on kernels without it or if `use_mlock` is set, a one-time mlock.
+ *
+ * Populated ranges are remembered, so repeated reads into the same buffer
+ * only check a few sampled pages with mincore instead of the whole range.
+ * The wrapper does not see memory being unmapped and mapped again, as it is
+ * loaded with dlopen and cannot interpose munmap and friends. A remapped
+ * range has none of its pages resident, so the samples catch it, and it is
+ * populated again. Pages released by the C library inside a range may slip
+ * through, so report_stamp_time() flags ranges whose stamping was too slow
+ * to have hit resident pages. Such recycled ranges are checked with mincore
+ * in full on every read until a check finds them fully resident again. The
+ * cache holds a fixed number of ranges.
+ */
+
+// Returns true if [dst, dst + len) is known to be resident, i.e. nothing was
+// done.
+bool make_resident(void *dst, size_t len, bool use_mlock);
+
+// Returns false if [dst, dst + len) is not known to be resident and more
+// than a few of its pages are missing. Does not populate anything.
+bool looks_resident(const void *dst, size_t len);
+
+// Reports the time it took to stamp [dst, dst + len) after make_resident()
+// returned true for it.
+void report_stamp_time(void *dst, size_t len, std::chrono::nanoseconds elapsed);
@@ -0,0 +1,227 @@
+#include "shared_mem_cache.hpp"
+
+#include <deque>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "stamping.hpp"
+#include "stats.hpp"
+
+constexpr int MAX_CACHED_HANDLES{64};
+// idle blocks are looked for at most this often
+constexpr std::chrono::seconds TRIM_INTERVAL{1};
+
+using cache_clock = std::chrono::steady_clock;
+
+typedef struct {
+  void *host_ptr;
+  unsigned long long device_ptr;
+  cache_clock::time_point freed;
+} cached_block_t;
+
+typedef struct {
+  std::mutex lock;
+  // free blocks by class size, least recently freed first
+  std::map<size_t, std::deque<cached_block_t>> free_blocks;
+  // device pointers of the blocks currently handed out
+  std::unordered_map<void *, unsigned long long> device_ptrs;
+  size_t cached_bytes;
+  cache_clock::time_point last_trim;
+} handle_cache_t;
+
+typedef struct {
+  void *host_ptr;
+  size_t size;
+} victim_t;
+
+static shared_mem_cache_config_t config{};
+static shared_mem_alloc_fn_t bsp_alloc{};
+static shared_mem_free_fn_t bsp_free{};
+static handle_cache_t caches[MAX_CACHED_HANDLES]{};
+
+static size_t class_size(size_t size) {
+  if (size <= PAGE_SIZE) {
+    return PAGE_SIZE;
+  }
+  const int shift = 63 - __builtin_clzll(size - 1);
+  const size_t step = size_t{1} << (shift - 2);
+  return (size + step - 1) & ~(step - 1);
+}
+
+static handle_cache_t *get_cache(int handle, size_t size) {
+  if (!config.max_cached_bytes || size > config.max_size || handle < 0 ||
+      handle >= MAX_CACHED_HANDLES) {
+    return nullptr;
+  }
+  return &caches[handle];
+}
+
+// Moves the least recently freed block of `cache` to `victims`.
+static void evict_oldest(handle_cache_t &cache,
+                         std::vector<victim_t> &victims) {
+  auto oldest = cache.free_blocks.end();
+  for (auto it = cache.free_blocks.begin(); it != cache.free_blocks.end();
+       ++it) {
+    if (oldest == cache.free_blocks.end() ||
+        it->second.front().freed < oldest->second.front().freed) {
+      oldest = it;
+    }
+  }
+  const size_t size = oldest->first;
+  const cached_block_t &block = oldest->second.front();
+  victims.push_back({block.host_ptr, size});
+  cache.cached_bytes -= size;
+  oldest->second.pop_front();
+  if (oldest->second.empty()) {
+    cache.free_blocks.erase(oldest);
+  }
+}
+
+// Evicts blocks that were idle for too long. The caller holds the lock.
+static void trim_idle(handle_cache_t &cache, std::vector<victim_t> &victims) {
+  const auto now = cache_clock::now();
+  if (!config.idle.count() || now - cache.last_trim < TRIM_INTERVAL) {
+    return;
+  }
+  cache.last_trim = now;
+  for (auto it = cache.free_blocks.begin(); it != cache.free_blocks.end();) {
+    auto &blocks = it->second;
+    while (!blocks.empty() && now - blocks.front().freed > config.idle) {
+      victims.push_back({blocks.front().host_ptr, it->first});
+      cache.cached_bytes -= it->first;
+      blocks.pop_front();
+    }
+    it = blocks.empty() ? cache.free_blocks.erase(it) : std::next(it);
+  }
+}
+
+// Returns evicted blocks to the BSP. Must not hold the cache's lock.
+static void release_victims(int handle,
+                            const std::vector<victim_t> &victims) {
+  shared_mem_stats_t *stats = get_shared_mem_stats(handle);
+  for (const auto &victim : victims) {
+    bsp_free(handle, victim.host_ptr, victim.size);
+    stats->cached_bytes.fetch_sub(victim.size, std::memory_order_relaxed);
+    stats_add(stats->trimmed_bytes, victim.size);
+  }
+}
+
+void start_shared_mem_cache(const shared_mem_cache_config_t &cache_config,
+                            shared_mem_alloc_fn_t alloc,
+                            shared_mem_free_fn_t free) {
+  config = cache_config;
+  bsp_alloc = alloc;
+  bsp_free = free;
+}
+
+void *cached_shared_mem_alloc(int handle, size_t size,
+                              unsigned long long *device_ptr_out) {
+  shared_mem_stats_t *stats = get_shared_mem_stats(handle);
+  handle_cache_t *cache = get_cache(handle, size);
+  const size_t alloc_size = cache ? class_size(size) : size;
+
+  if (cache) {
+    std::vector<victim_t> victims{};
+    void *host_ptr{nullptr};
+    {
+      std::lock_guard<std::mutex> lg{cache->lock};
+      auto it = cache->free_blocks.find(alloc_size);
+      if (it != cache->free_blocks.end()) {
+        const cached_block_t block = it->second.back();
+        it->second.pop_back();
+        if (it->second.empty()) {
+          cache->free_blocks.erase(it);
+        }
+        cache->cached_bytes -= alloc_size;
+        cache->device_ptrs[block.host_ptr] = block.device_ptr;
+        *device_ptr_out = block.device_ptr;
+        host_ptr = block.host_ptr;
+      }
+      trim_idle(*cache, victims);
+    }
+    release_victims(handle, victims);
+    if (host_ptr) {
+      stats_add(stats->hits, 1);
+      stats_add(stats->hit_bytes, size);
+      stats->cached_bytes.fetch_sub(alloc_size, std::memory_order_relaxed);
+      return host_ptr;
+    }
+  }
+
+  const auto start = cache_clock::now();
+  void *host_ptr = bsp_alloc(handle, alloc_size, device_ptr_out);
+  stats_add(stats->miss_ns,
+            static_cast<uint64_t>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    cache_clock::now() - start)
+                    .count()));
+  stats_add(stats->misses, 1);
+  stats_add(stats->miss_bytes, size);
+
+  if (cache && host_ptr) {
+    std::lock_guard<std::mutex> lg{cache->lock};
+    cache->device_ptrs[host_ptr] = *device_ptr_out;
+  }
+  return host_ptr;
+}
+
+void cached_shared_mem_free(int handle, void *host_ptr, size_t size) {
+  handle_cache_t *cache = get_cache(handle, size);
+  if (!cache || !host_ptr) {
+    bsp_free(handle, host_ptr, size);
+    return;
+  }
+
+  const size_t alloc_size = class_size(size);
+  std::vector<victim_t> victims{};
+  // blocks unknown to the cache were allocated with the requested size
+  size_t free_size{size};
+  bool cached{false};
+  {
+    std::lock_guard<std::mutex> lg{cache->lock};
+    auto it = cache->device_ptrs.find(host_ptr);
+    if (it != cache->device_ptrs.end()) {
+      free_size = alloc_size;
+      // a block larger than the cap itself is not worth evicting everything
+      if (alloc_size <= config.max_cached_bytes) {
+        while (cache->cached_bytes + alloc_size > config.max_cached_bytes &&
+               !cache->free_blocks.empty()) {
+          evict_oldest(*cache, victims);
+        }
+        cache->free_blocks[alloc_size].push_back(
+            {host_ptr, it->second, cache_clock::now()});
+        cache->cached_bytes += alloc_size;
+        cached = true;
+      }
+      cache->device_ptrs.erase(it);
+    }
+    trim_idle(*cache, victims);
+  }
+
+  if (cached) {
+    stats_add(get_shared_mem_stats(handle)->cached_bytes, alloc_size);
+  } else {
+    bsp_free(handle, host_ptr, free_size);
+  }
+  release_victims(handle, victims);
+}
+
+void flush_shared_mem_cache(int handle) {
+  if (handle < 0 || handle >= MAX_CACHED_HANDLES) {
+    return;
+  }
+  handle_cache_t &cache = caches[handle];
+  std::vector<victim_t> victims{};
+  {
+    std::lock_guard<std::mutex> lg{cache.lock};
+    while (!cache.free_blocks.empty()) {
+      evict_oldest(cache, victims);
+    }
+    // blocks still held die with the device, a device opened later under the
+    // same handle must not resolve them
+    cache.device_ptrs.clear();
+  }
+  release_victims(handle, victims);
+}
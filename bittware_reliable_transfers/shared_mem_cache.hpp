@@ -0,0 +1,46 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+
+/*
+ * Cache of shared (pinned, device-visible) host memory in front of
+ * aocl_mmd_shared_mem_alloc/free. Allocating such memory in the BSP is
+ * expensive, and runtimes that allocate and free it per buffer pay for it
+ * every time. Freed allocations are kept per device handle and size class
+ * and handed out again by later allocations of the same class. Size classes
+ * are four per power of two, so an allocation occupies at most 25% more than
+ * requested.
+ *
+ * The cache holds at most `max_cached_bytes` per device. Beyond that, and
+ * for blocks that were not reused for `idle` seconds, the least recently
+ * freed blocks are returned to the BSP. Allocations larger than `max_size`
+ * bypass the cache. Hits and misses are counted in the transfer statistics.
+ */
+
+typedef struct {
+  // 0 disables caching
+  size_t max_cached_bytes;
+  size_t max_size;
+  // 0 keeps idle blocks until the cap is reached
+  std::chrono::seconds idle;
+} shared_mem_cache_config_t;
+
+typedef void *(*shared_mem_alloc_fn_t)(int handle, size_t size,
+                                       unsigned long long *device_ptr_out);
+typedef void (*shared_mem_free_fn_t)(int handle, void *host_ptr, size_t size);
+
+// Sets up the cache in front of the BSP's allocation functions. Must be
+// called before any other function of the cache.
+void start_shared_mem_cache(const shared_mem_cache_config_t &config,
+                            shared_mem_alloc_fn_t alloc,
+                            shared_mem_free_fn_t free);
+
+void *cached_shared_mem_alloc(int handle, size_t size,
+                              unsigned long long *device_ptr_out);
+
+void cached_shared_mem_free(int handle, void *host_ptr, size_t size);
+
+// Returns all cached blocks of `handle` to the BSP and forgets the blocks
+// still held by the application, e.g. before the device is closed.
+void flush_shared_mem_cache(int handle);
@@ -0,0 +1,147 @@
+/*
+ * Microbenchmark for the page stamping kernels in stamping.cpp.
+ *
+ * For every buffer size and every kernel supported by this CPU, it reports
+ * the stamp and check throughput relative to the buffer size and how much
+ * slower a small, cache-resident working set becomes after stamping. The
+ * device transfer between stamping and checking is simulated by overwriting
+ * the buffer with streaming stores, so checking always takes the error-free
+ * path. A stamped buffer has to be recognized by every kernel, but not when
+ * checked with the nonce of another transfer.
+ *
+ * Usage: stamp_bench [size in MiB]...
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <sys/mman.h>
+#include <vector>
+
+#include <emmintrin.h>
+
+#include "stamping.hpp"
+
+constexpr size_t MiB{1 << 20};
+constexpr size_t HOT_SET_SIZE{256 << 10};
+constexpr size_t MIN_BYTES_PER_RUN{size_t{4} << 30};
+
+using bench_clock = std::chrono::steady_clock;
+
+static double seconds_since(bench_clock::time_point start) {
+  return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+// Overwrites the buffer the way a DMA engine would: without pulling it into
+// the CPU caches.
+static void simulate_dma(void *dst, size_t len) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i *ptr = static_cast<__m128i *>(dst);
+  for (size_t i = 0; i < len / sizeof(__m128i); i++) {
+    _mm_stream_si128(ptr + i, zero);
+  }
+  _mm_sfence();
+}
+
+static uint64_t touch(const std::vector<uint64_t> &hot_set) {
+  uint64_t sum{0};
+  for (auto v : hot_set) {
+    sum += v;
+  }
+  return sum;
+}
+
+// Time for one pass over the hot set, measured right after `disturb` ran.
+template <typename F>
+static double hot_set_time(std::vector<uint64_t> &hot_set, F disturb) {
+  constexpr int REPS{16};
+  double total{0};
+  for (int i = 0; i < REPS; i++) {
+    touch(hot_set);
+    disturb();
+    auto start = bench_clock::now();
+    hot_set[0] += touch(hot_set) & 1;
+    total += seconds_since(start);
+  }
+  return total / REPS;
+}
+
+int main(int argc, char **argv) {
+  std::vector<size_t> sizes{};
+  for (int i = 1; i < argc; i++) {
+    sizes.push_back(std::stoul(argv[i]) * MiB);
+  }
+  if (sizes.empty()) {
+    sizes = {1 * MiB, 16 * MiB, 256 * MiB, 1024 * MiB};
+  }
+
+  const stamp_kernel_t *kernels[8];
+  size_t num_kernels = available_stamp_kernels(kernels, 8);
+
+  std::vector<uint64_t> hot_set(HOT_SET_SIZE / sizeof(uint64_t), 1);
+
+  std::cout << std::setw(10) << "size [MiB]" << std::setw(10) << "kernel"
+            << std::setw(16) << "stamp [GiB/s]" << std::setw(16)
+            << "check [GiB/s]" << std::setw(16) << "hot set [x]\n";
+
+  for (size_t size : sizes) {
+    void *buf = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (buf == MAP_FAILED) {
+      std::cerr << "Cannot allocate " << size / MiB << " MiB.\n";
+      return EXIT_FAILURE;
+    }
+    simulate_dma(buf, size);
+
+    const size_t reps = std::max<size_t>(1, MIN_BYTES_PER_RUN / size);
+    const double baseline = hot_set_time(hot_set, [] {});
+
+    for (size_t k = 0; k < num_kernels; k++) {
+      const stamp_kernel_t &kernel = *kernels[k];
+      double stamp_time{0}, check_time{0};
+      int corrupted{0};
+
+      for (size_t r = 0; r < reps; r++) {
+        const uint64_t nonce = new_stamp_nonce();
+        auto start = bench_clock::now();
+        kernel.stamp(buf, size, nonce);
+        stamp_time += seconds_since(start);
+
+        simulate_dma(buf, size);
+
+        start = bench_clock::now();
+        corrupted |= kernel.check(buf, size, nonce, nullptr);
+        check_time += seconds_since(start);
+      }
+
+      const uint64_t nonce = new_stamp_nonce();
+      const double pollution =
+          hot_set_time(hot_set, [&] { kernel.stamp(buf, size, nonce); }) /
+          baseline;
+
+      bool detected{true}, stale{false};
+      for (size_t other = 0; other < num_kernels; other++) {
+        detected &= kernels[other]->check(buf, size, nonce, nullptr) != 0;
+        stale |= kernels[other]->check(buf, size, new_stamp_nonce(),
+                                       nullptr) != 0;
+      }
+
+      const double gib = static_cast<double>(size * reps) / (1 << 30);
+      std::cout << std::setw(10) << size / MiB << std::setw(10) << kernel.name
+                << std::fixed << std::setprecision(1) << std::setw(16)
+                << gib / stamp_time << std::setw(16) << gib / check_time
+                << std::setprecision(2) << std::setw(15) << pollution
+                << (corrupted ? "  (false positive!)" : "")
+                << (detected ? "" : "  (stamp not detected!)")
+                << (stale ? "  (stale stamp detected!)" : "") << "\n";
+    }
+
+    munmap(buf, size);
+  }
+
+  return EXIT_SUCCESS;
+}
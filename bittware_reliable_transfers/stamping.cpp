@@ -0,0 +1,277 @@
+#include "stamping.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <immintrin.h>
+#include <random>
+
+// The hardware prefetcher does not cross page boundaries, so the verification
+// kernels prefetch the stamp of the page this many pages ahead.
+constexpr uintptr_t PREFETCH_DISTANCE{8 * PAGE_SIZE};
+constexpr size_t CACHE_LINE_SIZE{64};
+constexpr size_t STAMP_LANES_32{STAMP_SIZE / sizeof(uint32_t)};
+
+/*
+ * A stamp consists of eight 32-bit lanes. Lane i of the stamp of a page is
+ * hash(key_i ^ page_word), where the keys are derived from the nonce of the
+ * transfer and page_word from the page's address. The hash is the lowbias32
+ * integer hash (C. Wellons), which needs only shifts, xors and 32-bit
+ * multiplies and thus computes all lanes of a stamp in one AVX2 register.
+ */
+typedef struct {
+  alignas(32) uint32_t lanes[STAMP_LANES_32];
+} stamp_keys_t;
+
+static inline uint64_t splitmix64(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ull;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+  return x ^ (x >> 31);
+}
+
+static inline stamp_keys_t stamp_keys(uint64_t nonce) {
+  stamp_keys_t keys;
+  for (size_t i = 0; i < STAMP_LANES_32; i += 2) {
+    const uint64_t key = splitmix64(nonce + i);
+    keys.lanes[i] = static_cast<uint32_t>(key);
+    keys.lanes[i + 1] = static_cast<uint32_t>(key >> 32);
+  }
+  return keys;
+}
+
+static inline uint32_t page_word(uintptr_t page) {
+  const uint64_t index = page / PAGE_SIZE;
+  return static_cast<uint32_t>(index) ^
+         static_cast<uint32_t>(index >> 32) * 0x9e3779b9u;
+}
+
+static inline uint32_t lowbias32(uint32_t x) {
+  x ^= x >> 16;
+  x *= 0x7feb352du;
+  x ^= x >> 15;
+  x *= 0x846ca68bu;
+  return x ^ (x >> 16);
+}
+
+static std::atomic<uint64_t> nonce_counter{std::random_device{}() |
+                                           uint64_t{std::random_device{}()}
+                                               << 32};
+
+uint64_t new_stamp_nonce() {
+  // splitmix64 is a bijection, the nonces only repeat after 2^64 transfers
+  return splitmix64(nonce_counter.fetch_add(1, std::memory_order_relaxed));
+}
+
+// Only pages whose stamp lies entirely within the buffer are stamped
+// => first page will be skipped if not aligned
+static inline uintptr_t first_page(const void *dst) {
+  return (reinterpret_cast<uintptr_t>(dst) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+}
+
+static inline uintptr_t end_byte(const void *dst, size_t len) {
+  return reinterpret_cast<uintptr_t>(dst) + len;
+}
+
+static inline void stamp_of_page(uint32_t *stamp, const stamp_keys_t &keys,
+                                 uintptr_t page) {
+  const uint32_t word = page_word(page);
+  for (size_t i = 0; i < STAMP_LANES_32; i++) {
+    stamp[i] = lowbias32(keys.lanes[i] ^ word);
+  }
+}
+
+static void stamp_scalar(void *dst, size_t len, uint64_t nonce) {
+  const stamp_keys_t keys = stamp_keys(nonce);
+  const uintptr_t end = end_byte(dst, len);
+  for (uintptr_t pp = first_page(dst); pp + STAMP_SIZE <= end;
+       pp += PAGE_SIZE) {
+    uint32_t stamp[STAMP_LANES_32];
+    stamp_of_page(stamp, keys, pp);
+    std::memcpy(reinterpret_cast<void *>(pp), stamp, STAMP_SIZE);
+  }
+}
+
+static int check_scalar(const void *dst, size_t len, uint64_t nonce,
+                        std::vector<page_range_t> *corrupted) {
+  const stamp_keys_t keys = stamp_keys(nonce);
+  const uintptr_t end = end_byte(dst, len);
+  int ret{0};
+  for (uintptr_t pp = first_page(dst); pp + STAMP_SIZE <= end;
+       pp += PAGE_SIZE) {
+    uint32_t stamp[STAMP_LANES_32];
+    stamp_of_page(stamp, keys, pp);
+    if (!std::memcmp(reinterpret_cast<const void *>(pp), stamp, STAMP_SIZE)) {
+      ret = 1;
+      if (corrupted) {
+        add_page_range(*corrupted, pp, end);
+      }
+    }
+  }
+  return ret;
+}
+
+__attribute__((target("avx2"))) static inline __m256i
+stamp_of_page_avx2(__m256i keys, uintptr_t page) {
+  __m256i x = _mm256_xor_si256(
+      keys, _mm256_set1_epi32(static_cast<int>(page_word(page))));
+  x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+  x = _mm256_mullo_epi32(x, _mm256_set1_epi32(0x7feb352d));
+  x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 15));
+  x = _mm256_mullo_epi32(x, _mm256_set1_epi32(static_cast<int>(0x846ca68bu)));
+  return _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+}
+
+/*
+ * The SIMD kernels stamp the whole first cache line of a page with streaming
+ * stores whenever it fits into the buffer. Writing a full line lets the write
+ * combining buffer go out as a single burst without reading the line first,
+ * and the stamped lines never enter the cache. The trailing sfence is
+ * mandatory: a stamp still sitting in a write combining buffer when the DMA
+ * starts could otherwise land on top of the transferred data.
+ */
+
+__attribute__((target("avx2"))) static void stamp_avx2(void *dst, size_t len,
+                                                        uint64_t nonce) {
+  const stamp_keys_t key_lanes = stamp_keys(nonce);
+  const __m256i keys =
+      _mm256_load_si256(reinterpret_cast<const __m256i *>(key_lanes.lanes));
+  const uintptr_t end = end_byte(dst, len);
+  for (uintptr_t pp = first_page(dst); pp + STAMP_SIZE <= end;
+       pp += PAGE_SIZE) {
+    const __m256i stamp = stamp_of_page_avx2(keys, pp);
+    __m256i *page_ptr = reinterpret_cast<__m256i *>(pp);
+    if (pp + CACHE_LINE_SIZE <= end) {
+      _mm256_stream_si256(page_ptr, stamp);
+      _mm256_stream_si256(page_ptr + 1, stamp);
+    } else {
+      _mm256_store_si256(page_ptr, stamp);
+    }
+  }
+  _mm_sfence();
+}
+
+__attribute__((target("avx2"))) static int
+check_avx2(const void *dst, size_t len, uint64_t nonce,
+           std::vector<page_range_t> *corrupted) {
+  const stamp_keys_t key_lanes = stamp_keys(nonce);
+  const __m256i keys =
+      _mm256_load_si256(reinterpret_cast<const __m256i *>(key_lanes.lanes));
+  const uintptr_t end = end_byte(dst, len);
+  int ret{0};
+  for (uintptr_t pp = first_page(dst); pp + STAMP_SIZE <= end;
+       pp += PAGE_SIZE) {
+    if (pp + PREFETCH_DISTANCE < end) {
+      _mm_prefetch(reinterpret_cast<const char *>(pp + PREFETCH_DISTANCE),
+                   _MM_HINT_NTA);
+    }
+    const __m256i stamp =
+        _mm256_load_si256(reinterpret_cast<const __m256i *>(pp));
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+            stamp, stamp_of_page_avx2(keys, pp))) == -1) {
+      ret = 1;
+      if (corrupted) {
+        add_page_range(*corrupted, pp, end);
+      }
+    }
+  }
+  return ret;
+}
+
+// Only the low four 64-bit lanes of a 512-bit register hold the stamp.
+constexpr __mmask8 STAMP_LANES{0x0f};
+
+__attribute__((target("avx512f"))) static inline __m512i
+stamp_of_page_avx512(__m256i keys, uintptr_t page) {
+  return _mm512_maskz_broadcast_i64x4(0xff, stamp_of_page_avx2(keys, page));
+}
+
+__attribute__((target("avx512f"))) static void
+stamp_avx512(void *dst, size_t len, uint64_t nonce) {
+  const stamp_keys_t key_lanes = stamp_keys(nonce);
+  const __m256i keys =
+      _mm256_load_si256(reinterpret_cast<const __m256i *>(key_lanes.lanes));
+  const uintptr_t end = end_byte(dst, len);
+  for (uintptr_t pp = first_page(dst); pp + STAMP_SIZE <= end;
+       pp += PAGE_SIZE) {
+    const __m512i stamp = stamp_of_page_avx512(keys, pp);
+    __m512i *page_ptr = reinterpret_cast<__m512i *>(pp);
+    if (pp + CACHE_LINE_SIZE <= end) {
+      _mm512_stream_si512(page_ptr, stamp);
+    } else {
+      _mm512_mask_store_epi64(page_ptr, STAMP_LANES, stamp);
+    }
+  }
+  _mm_sfence();
+}
+
+__attribute__((target("avx512f"))) static int
+check_avx512(const void *dst, size_t len, uint64_t nonce,
+             std::vector<page_range_t> *corrupted) {
+  const stamp_keys_t key_lanes = stamp_keys(nonce);
+  const __m256i keys =
+      _mm256_load_si256(reinterpret_cast<const __m256i *>(key_lanes.lanes));
+  const uintptr_t end = end_byte(dst, len);
+  int ret{0};
+  for (uintptr_t pp = first_page(dst); pp + STAMP_SIZE <= end;
+       pp += PAGE_SIZE) {
+    if (pp + PREFETCH_DISTANCE < end) {
+      _mm_prefetch(reinterpret_cast<const char *>(pp + PREFETCH_DISTANCE),
+                   _MM_HINT_NTA);
+    }
+    // masked load never touches bytes beyond the stamp
+    const __m512i stamp =
+        _mm512_maskz_load_epi64(STAMP_LANES, reinterpret_cast<void *>(pp));
+    if (_mm512_mask_cmpeq_epi64_mask(STAMP_LANES, stamp,
+                                     stamp_of_page_avx512(keys, pp)) ==
+        STAMP_LANES) {
+      ret = 1;
+      if (corrupted) {
+        add_page_range(*corrupted, pp, end);
+      }
+    }
+  }
+  return ret;
+}
+
+static constexpr stamp_kernel_t KERNELS[]{
+    {"scalar", stamp_scalar, check_scalar},
+    {"avx2", stamp_avx2, check_avx2},
+    {"avx512", stamp_avx512, check_avx512},
+};
+
+static bool is_supported(const stamp_kernel_t &kernel) {
+  // may run from static initializers before libgcc initialized the CPU model
+  __builtin_cpu_init();
+  if (kernel.stamp == stamp_avx2) {
+    return __builtin_cpu_supports("avx2");
+  }
+  if (kernel.stamp == stamp_avx512) {
+    return __builtin_cpu_supports("avx512f");
+  }
+  return true;
+}
+
+size_t available_stamp_kernels(const stamp_kernel_t **kernels, size_t max) {
+  size_t count{0};
+  for (const auto &kernel : KERNELS) {
+    if (count < max && is_supported(kernel)) {
+      kernels[count++] = &kernel;
+    }
+  }
+  return count;
+}
+
+const stamp_kernel_t &select_stamp_kernel(std::string_view name) {
+  const stamp_kernel_t *selected{&KERNELS[0]};
+  for (const auto &kernel : KERNELS) {
+    if (!is_supported(kernel)) {
+      continue;
+    }
+    if (name == kernel.name) {
+      return kernel;
+    }
+    selected = &kernel;
+  }
+  return *selected;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+/*
+ * Page stamping kernels used to detect pages left out by a DMA transfer.
+ *
+ * stamp() writes a 32-byte pattern to the start of each page that lies
+ * entirely within [dst, dst + len). check() returns non-zero if any of these
+ * pages still carries the pattern, i.e. was not overwritten by the transfer.
+ * If `corrupted` is given, check() also appends the affected pages to it.
+ * All kernels are interchangeable: a buffer stamped by one kernel can be
+ * checked by any other.
+ *
+ * The pattern of a page is derived from a per-transfer nonce and the page's
+ * address. Data that legitimately contains the stamp of one transfer, e.g. a
+ * host buffer with stale stamps written back to the device, therefore does
+ * not contain the stamp of the re-read, which uses a new nonce.
+ */
+
+constexpr size_t PAGE_SIZE{4096};
+constexpr size_t STAMP_SIZE{32};
+
+// [begin, end) in host addresses
+typedef struct {
+  uintptr_t begin;
+  uintptr_t end;
+} page_range_t;
+
+typedef struct {
+  const char *name;
+  void (*stamp)(void *dst, size_t len, uint64_t nonce);
+  int (*check)(const void *dst, size_t len, uint64_t nonce,
+               std::vector<page_range_t> *corrupted);
+} stamp_kernel_t;
+
+// Appends the page starting at `page` but not extending beyond `end` to
+// `ranges`, merging it with the last range if they are adjacent.
+inline void add_page_range(std::vector<page_range_t> &ranges, uintptr_t page,
+                           uintptr_t end) {
+  const uintptr_t page_end = std::min<uintptr_t>(page + PAGE_SIZE, end);
+  if (!ranges.empty() && ranges.back().end == page) {
+    ranges.back().end = page_end;
+  } else {
+    ranges.push_back({page, page_end});
+  }
+}
+
+// Returns a nonce not returned before in this process.
+uint64_t new_stamp_nonce();
+
+// Kernels supported by the executing CPU, ordered from slowest to fastest.
+// The scalar kernel is always available and always first.
+size_t available_stamp_kernels(const stamp_kernel_t **kernels, size_t max);
+
+// Returns the kernel called `name` if given and supported, otherwise the
+// fastest supported kernel.
+const stamp_kernel_t &select_stamp_kernel(std::string_view name = {});
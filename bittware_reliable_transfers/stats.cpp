@@ -0,0 +1,206 @@
+#include "stats.hpp"
+
+#include <cstdlib>
+#include <fcntl.h>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static std::string segment_name() {
+  return STATS_SHM_PREFIX + std::to_string(getpid());
+}
+
+static const char *const SIZE_UNITS[]{"B", "KiB", "MiB", "GiB", "TiB"};
+
+static void print_size(std::ostream &out, uint64_t bytes) {
+  double size = static_cast<double>(bytes);
+  size_t unit = 0;
+  while (size >= 1024 && unit + 1 < std::size(SIZE_UNITS)) {
+    size /= 1024;
+    unit++;
+  }
+  out << std::setprecision(unit ? 2 : 0) << std::fixed << size << " "
+      << SIZE_UNITS[unit];
+}
+
+static void print_histogram(std::ostream &out, const char *name,
+                            const std::atomic<uint64_t> *buckets) {
+  out << "  " << name << ":";
+  for (int i = 0; i < STATS_SIZE_BUCKETS; i++) {
+    if (const uint64_t count = buckets[i].load(std::memory_order_relaxed)) {
+      out << " " << (1 << (i % 10)) << " " << SIZE_UNITS[i / 10] << ": "
+          << count;
+    }
+  }
+  out << "\n";
+}
+
+static void print_shared_mem_stats(std::ostream &out, int handle,
+                                   const shared_mem_stats_t &s) {
+  const uint64_t hits = s.hits.load(std::memory_order_relaxed);
+  const uint64_t misses = s.misses.load(std::memory_order_relaxed);
+  if (!hits && !misses) {
+    return;
+  }
+  const double miss_ms =
+      static_cast<double>(s.miss_ns.load(std::memory_order_relaxed)) / 1e6;
+
+  out << "PC2 shared memory statistics for device " << handle
+      << ":\n  allocations: " << hits + misses << ", cache hits: " << hits
+      << " (";
+  print_size(out, s.hit_bytes.load(std::memory_order_relaxed));
+  out << "), misses: " << misses << " (";
+  print_size(out, s.miss_bytes.load(std::memory_order_relaxed));
+  out << ")\n  BSP allocations: " << std::setprecision(3) << std::fixed
+      << miss_ms << " ms, saved by hits: ~"
+      << (misses ? miss_ms * static_cast<double>(hits) /
+                       static_cast<double>(misses)
+                 : 0.0)
+      << " ms\n  cached: ";
+  print_size(out, s.cached_bytes.load(std::memory_order_relaxed));
+  out << ", trimmed: ";
+  print_size(out, s.trimmed_bytes.load(std::memory_order_relaxed));
+  out << "\n";
+}
+
+void print_stats(const stats_segment_t &stats, std::ostream &out) {
+  for (int handle = 0; handle < STATS_MAX_HANDLES; handle++) {
+    for (int interface = 0; interface < STATS_MAX_INTERFACES; interface++) {
+      const interface_stats_t &s = stats.devices[handle].interfaces[interface];
+      const uint64_t reads = s.reads.load(std::memory_order_relaxed);
+      const uint64_t writes = s.writes.load(std::memory_order_relaxed);
+      if (!reads && !writes) {
+        continue;
+      }
+
+      out << "PC2 transfer statistics for device " << handle << ", interface "
+          << interface << ":\n  reads: " << reads << " (";
+      print_size(out, s.read_bytes.load(std::memory_order_relaxed));
+      out << "), writes: " << writes << " (";
+      print_size(out, s.write_bytes.load(std::memory_order_relaxed));
+      out << ")\n";
+      if (const uint64_t remote =
+              s.remote_bytes.load(std::memory_order_relaxed)) {
+        out << "  on remote NUMA node: ";
+        print_size(out, remote);
+        out << "\n";
+      }
+
+      // only gmem reads are stamped
+      const uint64_t stamp_ns = s.stamp_ns.load(std::memory_order_relaxed);
+      const uint64_t corruptions =
+          s.corruptions.load(std::memory_order_relaxed);
+      const uint64_t unverified =
+          s.unverified_reads.load(std::memory_order_relaxed);
+      if (stamp_ns || corruptions || unverified) {
+        out << "  stamping: " << std::setprecision(3) << std::fixed
+            << static_cast<double>(stamp_ns) / 1e6 << " ms, checking: "
+            << static_cast<double>(
+                   s.check_ns.load(std::memory_order_relaxed)) /
+                   1e6
+            << " ms, transfers: "
+            << static_cast<double>(
+                   s.transfer_ns.load(std::memory_order_relaxed)) /
+                   1e6
+            << " ms, unverified reads: "
+            << s.unverified_reads.load(std::memory_order_relaxed)
+            << ", bounced reads: "
+            << s.bounced_reads.load(std::memory_order_relaxed)
+            << "\n  corruptions: " << corruptions << " (";
+        print_size(out, s.reread_bytes.load(std::memory_order_relaxed));
+        out << " re-read, " << s.unrepaired.load(std::memory_order_relaxed)
+            << " unrepaired)\n";
+      }
+      if (reads) {
+        print_histogram(out, "read sizes", s.read_sizes);
+      }
+      if (writes) {
+        print_histogram(out, "write sizes", s.write_sizes);
+      }
+    }
+    print_shared_mem_stats(out, handle, stats.devices[handle].shared_mem);
+  }
+}
+
+/*
+ * The segment is never unmapped, validation workers may still update it
+ * during process teardown. Only its name is removed at exit.
+ */
+class stats_publisher_t {
+  bool shared{false};
+  bool summary{true};
+
+public:
+  stats_segment_t *segment{};
+
+  stats_publisher_t() {
+    // BITTFIX_STATS=0 keeps the counters private and silent
+    const char *enabled = getenv("BITTFIX_STATS");
+    if (enabled && std::string{enabled} == "0") {
+      summary = false;
+    } else {
+      const int fd = shm_open(segment_name().c_str(),
+                              O_RDWR | O_CREAT | O_TRUNC, 0600);
+      if (fd >= 0 && ftruncate(fd, sizeof(stats_segment_t)) == 0) {
+        void *mem = mmap(nullptr, sizeof(stats_segment_t),
+                         PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mem != MAP_FAILED) {
+          segment = static_cast<stats_segment_t *>(mem);
+          shared = true;
+        }
+      }
+      if (fd >= 0) {
+        close(fd);
+      }
+      if (!shared) {
+        shm_unlink(segment_name().c_str());
+        std::cerr << "PC2 WARNING: Could not create shared memory segment for "
+                     "transfer statistics.\n";
+      }
+    }
+
+    if (!segment) {
+      static stats_segment_t private_segment{};
+      segment = &private_segment;
+    }
+    segment->pid = getpid();
+    segment->version = STATS_VERSION;
+    // published last, bittfix_stat ignores segments without it
+    __atomic_store_n(&segment->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+  }
+
+  ~stats_publisher_t() {
+    // forked children inherit the segment, but it is not theirs to report
+    if (segment->pid != getpid()) {
+      return;
+    }
+    if (shared) {
+      shm_unlink(segment_name().c_str());
+    }
+    if (summary) {
+      print_stats(*segment, std::cerr);
+    }
+  }
+};
+
+static device_stats_t *get_device_stats(int handle) {
+  static stats_publisher_t publisher{};
+  if (handle < 0 || handle >= STATS_MAX_HANDLES) {
+    handle = STATS_MAX_HANDLES - 1;
+  }
+  return &publisher.segment->devices[handle];
+}
+
+interface_stats_t *get_interface_stats(int handle, int interface) {
+  if (interface < 0 || interface >= STATS_MAX_INTERFACES) {
+    interface = STATS_MAX_INTERFACES - 1;
+  }
+  return &get_device_stats(handle)->interfaces[interface];
+}
+
+shared_mem_stats_t *get_shared_mem_stats(int handle) {
+  return &get_device_stats(handle)->shared_mem;
+}
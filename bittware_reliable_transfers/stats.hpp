@@ -0,0 +1,96 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+
+/*
+ * Transfer statistics per device handle and interface. The counters live in
+ * a shared memory segment /dev/shm/bittfix-stats.<pid>, so bittfix_stat can
+ * watch them while the application is running, and a summary is printed to
+ * stderr at exit. All counters are updated with relaxed atomic adds. The
+ * layout below is shared with bittfix_stat and versioned by STATS_VERSION.
+ */
+
+constexpr uint64_t STATS_MAGIC{0x5354415458494642ull}; // "BFIXSTAT"
+constexpr uint32_t STATS_VERSION{5};
+constexpr const char *STATS_SHM_PREFIX{"/bittfix-stats."};
+
+// Handles beyond the last one and interfaces beyond the last one are counted
+// in the last entry.
+constexpr int STATS_MAX_HANDLES{64};
+constexpr int STATS_MAX_INTERFACES{8};
+// Transfer sizes are counted in power-of-two buckets: [2^i, 2^(i+1))
+constexpr int STATS_SIZE_BUCKETS{48};
+
+typedef struct {
+  std::atomic<uint64_t> reads;
+  std::atomic<uint64_t> read_bytes;
+  std::atomic<uint64_t> writes;
+  std::atomic<uint64_t> write_bytes;
+  // time spent stamping and checking gmem reads, including page population
+  // and copying bounced reads out
+  std::atomic<uint64_t> stamp_ns;
+  std::atomic<uint64_t> check_ns;
+  // time verified gmem reads took in the BSP
+  std::atomic<uint64_t> transfer_ns;
+  // gmem reads skipped by the verification policy
+  std::atomic<uint64_t> unverified_reads;
+  // gmem reads staged in a bounce buffer
+  std::atomic<uint64_t> bounced_reads;
+  // gmem reads and writes of host buffers on another NUMA node than the
+  // device
+  std::atomic<uint64_t> remote_bytes;
+  // reads with pages that still carried the stamp after the transfer
+  std::atomic<uint64_t> corruptions;
+  std::atomic<uint64_t> reread_bytes;
+  // corruptions that persisted through all re-reads
+  std::atomic<uint64_t> unrepaired;
+  std::atomic<uint64_t> read_sizes[STATS_SIZE_BUCKETS];
+  std::atomic<uint64_t> write_sizes[STATS_SIZE_BUCKETS];
+} interface_stats_t;
+
+// aocl_mmd_shared_mem_alloc calls served by the shared memory cache (hits) and
+// by the BSP (misses)
+typedef struct {
+  std::atomic<uint64_t> hits;
+  std::atomic<uint64_t> hit_bytes;
+  std::atomic<uint64_t> misses;
+  std::atomic<uint64_t> miss_bytes;
+  // time the misses took in the BSP
+  std::atomic<uint64_t> miss_ns;
+  // bytes currently held by the cache
+  std::atomic<uint64_t> cached_bytes;
+  // bytes returned to the BSP to stay below the cap or after idling
+  std::atomic<uint64_t> trimmed_bytes;
+} shared_mem_stats_t;
+
+typedef struct {
+  interface_stats_t interfaces[STATS_MAX_INTERFACES];
+  shared_mem_stats_t shared_mem;
+} device_stats_t;
+
+typedef struct {
+  uint64_t magic;
+  uint32_t version;
+  int32_t pid;
+  device_stats_t devices[STATS_MAX_HANDLES];
+} stats_segment_t;
+
+// Never return nullptr. The segment is created on the first call.
+interface_stats_t *get_interface_stats(int handle, int interface);
+shared_mem_stats_t *get_shared_mem_stats(int handle);
+
+static inline void stats_add(std::atomic<uint64_t> &counter, uint64_t value) {
+  counter.fetch_add(value, std::memory_order_relaxed);
+}
+
+static inline int stats_size_bucket(size_t len) {
+  const int bucket = len ? 63 - __builtin_clzll(len) : 0;
+  return bucket < STATS_SIZE_BUCKETS ? bucket : STATS_SIZE_BUCKETS - 1;
+}
+
+// Prints the counters of all interfaces that saw any transfer and of all
+// devices that allocated shared memory.
+void print_stats(const stats_segment_t &stats, std::ostream &out);
@@ -0,0 +1,166 @@
+#include "trace.hpp"
+
+#include <atomic>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <string>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+constexpr uint64_t DEFAULT_TRACE_EVENTS{1 << 16};
+
+typedef struct {
+  uint64_t begin_ns, end_ns;
+  uint64_t size;
+  const void *op;
+  const char *name;
+  int32_t handle, interface;
+} trace_event_t;
+
+typedef struct trace_ring_s {
+  struct trace_ring_s *next;
+  pid_t tid;
+  // total number of events recorded, the ring holds the last `capacity`
+  std::atomic<uint64_t> head;
+  trace_event_t *events;
+} trace_ring_t;
+
+std::atomic<bool> trace_enabled{false};
+static uint64_t ring_capacity{DEFAULT_TRACE_EVENTS};
+static std::atomic<trace_ring_t *> rings{nullptr};
+
+uint64_t trace_now_ns() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return static_cast<uint64_t>(now.tv_sec) * 1000000000ull +
+         static_cast<uint64_t>(now.tv_nsec);
+}
+
+// Ring of the calling thread, created on its first event. Constant
+// initialized, so looking it up runs no initializer, but the first lookup
+// in a thread may still allocate its TLS block, see trace.hpp.
+static __thread trace_ring_t *thread_ring{nullptr};
+// set once creating the ring of the calling thread failed
+static __thread bool ring_failed{false};
+
+// Creates the ring of the calling thread. Only uses async-signal-safe calls.
+static trace_ring_t *create_ring() {
+  const size_t size =
+      sizeof(trace_ring_t) + ring_capacity * sizeof(trace_event_t);
+  void *mem = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (mem == MAP_FAILED) {
+    return nullptr;
+  }
+  trace_ring_t *ring = new (mem) trace_ring_t{};
+  ring->tid = static_cast<pid_t>(syscall(SYS_gettid));
+  ring->events = reinterpret_cast<trace_event_t *>(ring + 1);
+
+  ring->next = rings.load(std::memory_order_relaxed);
+  while (!rings.compare_exchange_weak(ring->next, ring,
+                                      std::memory_order_release)) {
+  }
+  return ring;
+}
+
+void trace_record(const char *name, int handle, int interface, uint64_t size,
+                  const void *op, uint64_t begin_ns, uint64_t end_ns) {
+  trace_ring_t *ring = thread_ring;
+  if (!ring) {
+    if (ring_failed) {
+      return;
+    }
+    ring = thread_ring = create_ring();
+    if (!ring) {
+      ring_failed = true;
+      return;
+    }
+  }
+  // A callback in signal context may interrupt a record of the same thread.
+  const uint64_t idx = ring->head.fetch_add(1, std::memory_order_relaxed);
+  ring->events[idx & (ring_capacity - 1)] = {begin_ns, end_ns, size,
+                                             op,       name,   handle,
+                                             interface};
+}
+
+static void write_event(std::ostream &out, const trace_event_t &event,
+                        pid_t pid, pid_t tid) {
+  out << "{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":" << pid
+      << ",\"tid\":" << tid << ",\"ts\":"
+      << static_cast<double>(event.begin_ns) / 1e3
+      << ",\"dur\":" << static_cast<double>(event.end_ns - event.begin_ns) / 1e3
+      << ",\"args\":{\"handle\":" << event.handle;
+  if (event.interface >= 0) {
+    out << ",\"interface\":" << event.interface;
+  }
+  if (event.size) {
+    out << ",\"size\":" << event.size;
+  }
+  if (event.op) {
+    out << ",\"op\":\"" << event.op << "\"";
+  }
+  out << "}}";
+}
+
+class trace_writer_t {
+  std::string path{};
+
+public:
+  trace_writer_t() {
+    const char *trace = getenv("BITTFIX_TRACE");
+    if (!trace || !*trace) {
+      return;
+    }
+    path = trace;
+    const size_t pid = path.find("%p");
+    if (pid != std::string::npos) {
+      path.replace(pid, 2, std::to_string(getpid()));
+    }
+
+    if (const char *events = getenv("BITTFIX_TRACE_EVENTS")) {
+      // rounded up to a power of two
+      const uint64_t requested = std::strtoull(events, nullptr, 10);
+      ring_capacity = 1;
+      while (ring_capacity < requested) {
+        ring_capacity <<= 1;
+      }
+    }
+    trace_enabled.store(true);
+  }
+
+  ~trace_writer_t() {
+    if (!trace_enabled.exchange(false)) {
+      return;
+    }
+
+    std::ofstream out{path};
+    out << std::fixed << std::setprecision(3) << "{\"traceEvents\":[";
+    bool first{true};
+    const pid_t pid = getpid();
+    for (trace_ring_t *ring = rings.load(std::memory_order_acquire); ring;
+         ring = ring->next) {
+      const uint64_t head = ring->head.load(std::memory_order_relaxed);
+      const uint64_t begin = head > ring_capacity ? head - ring_capacity : 0;
+      for (uint64_t idx = begin; idx < head; idx++) {
+        out << (first ? "\n" : ",\n");
+        first = false;
+        write_event(out, ring->events[idx & (ring_capacity - 1)], pid,
+                    ring->tid);
+      }
+    }
+    out << "\n],\"displayTimeUnit\":\"ns\"}\n";
+
+    if (out) {
+      std::cerr << "PC2 MMD trace written to " << path << ".\n";
+    } else {
+      std::cerr << "PC2 WARNING: Could not write MMD trace to " << path
+                << ".\n";
+    }
+  }
+};
+static trace_writer_t trace_writer{};
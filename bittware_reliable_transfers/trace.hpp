@@ -0,0 +1,57 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Runtime tracing of MMD calls. If BITTFIX_TRACE names an output file, every
+ * MMD call and every status or interrupt callback is recorded with its start
+ * and end time, handle, interface, size and op into a ring buffer of the
+ * calling thread. At exit, the rings are written to that file as Chrome trace
+ * JSON, which chrome://tracing and Perfetto display as a timeline. A "%p" in
+ * the file name is replaced by the process id. Each ring keeps the last
+ * BITTFIX_TRACE_EVENTS events of its thread (default: 65536).
+ *
+ * Recording neither locks nor allocates after a thread's first event, so it
+ * is safe in callbacks delivered in signal context. The first event of a
+ * thread must not be recorded in signal context: the wrapper is loaded with
+ * dlopen, so the first access to its thread-local ring pointer may allocate
+ * in the dynamic linker. When tracing is disabled, a trace_scope_t costs a
+ * single predictable branch.
+ */
+
+extern std::atomic<bool> trace_enabled;
+
+uint64_t trace_now_ns();
+
+// `name` must be a string literal, `interface` is -1 if not applicable.
+void trace_record(const char *name, int handle, int interface, uint64_t size,
+                  const void *op, uint64_t begin_ns, uint64_t end_ns);
+
+// Records the lifetime of the scope as a single event.
+class trace_scope_t {
+  const char *name;
+  int handle, interface;
+  uint64_t size;
+  const void *op;
+  uint64_t begin_ns;
+
+public:
+  trace_scope_t(const char *name_, int handle_, int interface_ = -1,
+                uint64_t size_ = 0, const void *op_ = nullptr)
+      : name{name_}, handle{handle_}, interface{interface_}, size{size_},
+        op{op_}, begin_ns{trace_enabled.load(std::memory_order_relaxed)
+                              ? trace_now_ns()
+                              : 0} {}
+
+  ~trace_scope_t() {
+    if (begin_ns) {
+      trace_record(name, handle, interface, size, op, begin_ns,
+                   trace_now_ns());
+    }
+  }
+
+  trace_scope_t(const trace_scope_t &) = delete;
+  trace_scope_t &operator=(const trace_scope_t &) = delete;
+};
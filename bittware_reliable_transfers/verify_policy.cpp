@@ -0,0 +1,127 @@
+#include "verify_policy.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+static int64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// xorshift64, good enough to keep the sample uncorrelated with the access
+// pattern of the application
+static double random_fraction() {
+  thread_local uint64_t state =
+      static_cast<uint64_t>(now_ns()) ^ reinterpret_cast<uintptr_t>(&state);
+  state ^= state << 13;
+  state ^= state >> 7;
+  state ^= state << 17;
+  return static_cast<double>(state >> 11) / static_cast<double>(1ull << 53);
+}
+
+bool parse_verify_policy(const char *spec, verify_policy_t &policy) {
+  if (!strcmp(spec, "all")) {
+    policy.mode = VERIFY_ALL;
+    policy.fraction = 1;
+    return true;
+  }
+
+  static const struct {
+    const char *prefix;
+    verify_mode_t mode;
+    double scale;
+  } MODES[]{{"transfers:", VERIFY_TRANSFERS, 1},
+            {"bytes:", VERIFY_BYTES, 1},
+            {"overhead:", VERIFY_OVERHEAD, 0.01}};
+  for (const auto &mode : MODES) {
+    const size_t prefix_len = strlen(mode.prefix);
+    if (strncmp(spec, mode.prefix, prefix_len)) {
+      continue;
+    }
+    char *end;
+    const double value = std::strtod(spec + prefix_len, &end);
+    if (end == spec + prefix_len || *end || value <= 0) {
+      return false;
+    }
+    policy.mode = mode.mode;
+    policy.fraction = std::min(value * mode.scale, 1.0);
+    if (policy.mode != VERIFY_OVERHEAD && policy.fraction == 1) {
+      policy.mode = VERIFY_ALL;
+    }
+    return true;
+  }
+  return false;
+}
+
+std::string describe_verify_policy(const verify_policy_t &policy) {
+  std::ostringstream description{};
+  switch (policy.mode) {
+  case VERIFY_ALL:
+    return "all transfers";
+  case VERIFY_TRANSFERS:
+    description << policy.fraction * 100 << "% of transfers";
+    break;
+  case VERIFY_BYTES:
+    description << policy.fraction * 100 << "% of bytes";
+    break;
+  case VERIFY_OVERHEAD:
+    description << "transfers within " << policy.fraction * 100
+                << "% overhead";
+    break;
+  }
+  return description.str();
+}
+
+// Byte fraction that keeps stamping and checking within the overhead budget,
+// based on the reads verified so far.
+static double overhead_fraction(const verify_policy_t &policy,
+                                const interface_stats_t &stats) {
+  const auto verify_ns = static_cast<double>(
+      stats.stamp_ns.load(std::memory_order_relaxed) +
+      stats.check_ns.load(std::memory_order_relaxed));
+  const auto transfer_ns =
+      static_cast<double>(stats.transfer_ns.load(std::memory_order_relaxed));
+  if (transfer_ns == 0 || verify_ns <= policy.fraction * transfer_ns) {
+    return 1;
+  }
+  return policy.fraction * transfer_ns / verify_ns;
+}
+
+bool verify_sampler_t::should_verify(const verify_policy_t &policy,
+                                     size_t len,
+                                     const interface_stats_t &stats) {
+  if (policy.mode == VERIFY_ALL ||
+      escalated_until.load(std::memory_order_relaxed) > now_ns()) {
+    return true;
+  }
+
+  if (policy.mode == VERIFY_TRANSFERS) {
+    return random_fraction() < policy.fraction;
+  }
+
+  // Every read earns credit worth its share of the bytes to be verified and
+  // a read is verified once the credit covers all of its bytes.
+  const double fraction = policy.mode == VERIFY_BYTES
+                              ? policy.fraction
+                              : overhead_fraction(policy, stats);
+  const auto bytes = static_cast<int64_t>(len);
+  const auto earned = static_cast<int64_t>(fraction * static_cast<double>(len));
+  if (byte_credit.fetch_add(earned, std::memory_order_relaxed) + earned <
+      bytes) {
+    return false;
+  }
+  byte_credit.fetch_sub(bytes, std::memory_order_relaxed);
+  return true;
+}
+
+bool verify_sampler_t::escalate(const verify_policy_t &policy) {
+  const int64_t until =
+      now_ns() + std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     policy.escalation)
+                     .count();
+  return escalated_until.exchange(until, std::memory_order_relaxed) <
+         now_ns();
+}
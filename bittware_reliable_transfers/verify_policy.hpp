@@ -0,0 +1,56 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "stats.hpp"
+
+/*
+ * Decides which gmem reads are stamped and checked. By default, all of them
+ * are. The sampling modes verify only
+ *   transfers:<fraction>  a random fraction of all reads,
+ *   bytes:<fraction>      reads that make up a fraction of all read bytes,
+ *   overhead:<percent>    as many bytes as keep the time spent stamping and
+ *                         checking below a percentage of the transfer time.
+ * The overhead mode derives its byte fraction from the stamp, check and
+ * transfer times measured on the verified reads of each device. After a
+ * corruption was detected on a device, all of its reads are verified for
+ * the escalation period.
+ */
+
+typedef enum {
+  VERIFY_ALL,
+  VERIFY_TRANSFERS,
+  VERIFY_BYTES,
+  VERIFY_OVERHEAD
+} verify_mode_t;
+
+typedef struct {
+  verify_mode_t mode;
+  // fraction of transfers or bytes, or overhead budget relative to transfers
+  double fraction;
+  std::chrono::seconds escalation;
+} verify_policy_t;
+
+// Parses a BITTFIX_VERIFY value into `policy`, leaving the escalation period
+// untouched. Returns false if `spec` is malformed.
+bool parse_verify_policy(const char *spec, verify_policy_t &policy);
+
+std::string describe_verify_policy(const verify_policy_t &policy);
+
+// Sampling state of a single device.
+class verify_sampler_t {
+  std::atomic<int64_t> escalated_until{0};
+  std::atomic<int64_t> byte_credit{0};
+
+public:
+  // `stats` are those of the device's gmem interface.
+  bool should_verify(const verify_policy_t &policy, size_t len,
+                     const interface_stats_t &stats);
+
+  // Returns true if the device was not escalated before.
+  bool escalate(const verify_policy_t &policy);
+};
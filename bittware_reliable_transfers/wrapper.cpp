@@ -1,18 +1,41 @@
-#include <csignal>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
 #include <cstddef>
+#include <cstdlib>
 #include <cstring>
+#include <ctime>
 #include <dlfcn.h>
 #include <iomanip>
 #include <iostream>
-#include <map>
 #include <mutex>
-#include <pthread.h>
-#include <set>
+#include <new>
+#include <sched.h>
+#include <semaphore.h>
 #include <string_view>
-#include <sys/mman.h>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include <aocl_mmd.h>
 
+#include "bounce_pool.hpp"
+#include "capture.hpp"
+#include "completion_queue.hpp"
+#include "futex.hpp"
+#include "mpmc_queue.hpp"
+#include "numa.hpp"
+#include "op_pool.hpp"
+#include "page_workers.hpp"
+#include "program_cache.hpp"
+#include "residency.hpp"
+#include "shared_mem_cache.hpp"
+#include "stamping.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
+#include "verify_policy.hpp"
+
 #define xstr(s) str(s)
 #define str(s) #s
 
@@ -23,18 +46,52 @@
 constexpr bool DEBUG{false};
 constexpr auto libbitt_path{xstr(BSP)};
 
-constexpr unsigned char RANDOM_STRING[32]{
-    u'\xb1', u'\x53', u'\xdc', u'\x2d', u'\xd4', u'\x9b', u'\x7d', u'\x81',
-    u'\x5b', u'\x4c', u'\x63', u'\x81', u'\x5f', u'\xe6', u'\x51', u'\xf8',
-    u'\xd6', u'\x30', u'\x9d', u'\x8d', u'\x7f', u'\x8b', u'\x07', u'\xab',
-    u'\xad', u'\xff', u'\x65', u'\x74', u'\x1f', u'\x35', u'\xf7', u'\xcf'};
+/*
+ * Per-device state indexed by device handle. Entries are published atomically
+ * by aocl_mmd_open and aocl_mmd_set_status_handler, so looking them up on the
+ * read path needs neither a lock nor a syscall to mask signals. Each entry
+ * has its own cache line to keep devices from interfering with each other.
+ */
+constexpr int MAX_HANDLES{64};
+constexpr int NO_GMEM_INTERFACE{-1};
+
+typedef struct alignas(64) {
+  std::atomic<int> gmem_interface{NO_GMEM_INTERFACE};
+  std::atomic<aocl_mmd_status_handler_fn> status_handler{nullptr};
+  std::atomic<void *> user_data{nullptr};
+  std::atomic<completion_queue_t *> completions{nullptr};
+  // wrapped ops that still use this state, see aocl_mmd_close()
+  std::atomic<uint32_t> ops_in_flight{0};
+  std::atomic<bool> closing{false};
+  verify_sampler_t sampler{};
+  // name the device was opened with, identifies its program record
+  char device_name[64]{};
+  // -1 if unknown
+  std::atomic<int> numa_node{-1};
+  std::atomic<bool> remote_buffer_warned{false};
+  // only set while capturing
+  std::atomic<aocl_mmd_status_handler_fn> captured_status_handler{nullptr};
+  // only set while tracing
+  std::atomic<aocl_mmd_interrupt_handler_fn> interrupt_handler{nullptr};
+  std::atomic<aocl_mmd_device_interrupt_handler_fn> device_interrupt_handler{
+      nullptr};
+} handle_state_t;
+
+static handle_state_t handle_states[MAX_HANDLES]{};
+
+static handle_state_t *get_handle_state(int handle) {
+  if (handle < 0 || handle >= MAX_HANDLES) {
+    return nullptr;
+  }
+  return &handle_states[handle];
+}
+
+// maximum number of wrapped non-blocking reads in flight at the same time
+constexpr uint32_t MAX_WRAPPED_OPS{1 << 20};
+static op_pool_t op_pool{MAX_WRAPPED_OPS};
 
-static std::map<int, int> gmem_interfaces{};
-static std::mutex gmem_interfaces_lock{};
-static std::map<int, aocl_mmd_status_handler_fn> registered_status_handlers{};
-static std::mutex registered_status_handlers_lock{};
-static std::set<void *> known_op_wrappings{};
-static std::mutex known_op_wrappings_lock{};
+// smaller transfers are not worth a syscall to locate their host buffer
+constexpr size_t MIN_NUMA_CHECK_SIZE{1 << 20};
 
 template <typename T>
 constexpr void check_symbol(T ptr, std::string_view name) {
@@ -207,37 +264,111 @@ static const libbitt_t libbitt{};
 class env_t {
 public:
   bool use_mlock{false};
+  const stamp_kernel_t *kernel{};
+  unsigned long max_retries{8};
+  unsigned long verify_threads{2};
+  // 0 disables chunking, otherwise a multiple of PAGE_SIZE
+  size_t chunk_size{0};
+  unsigned long stamp_workers{3};
+  size_t parallel_min_size{64 << 20};
+  bool numa_placement{true};
+  std::string sysfs_root{"/sys"};
+  bool program_cache{false};
+  bool force_program{false};
+  // 0 disables bounce buffers
+  unsigned long bounce_buffers{0};
+  size_t bounce_size{16 << 20};
+  shared_mem_cache_config_t shared_mem_cache{0, 64 << 20,
+                                             std::chrono::seconds{60}};
+  verify_policy_t verify_policy{VERIFY_ALL, 1, std::chrono::seconds{600}};
   env_t() {
     if (getenv("BITTFIX_MLOCK")) {
       use_mlock = true;
     }
 
-    std::cerr << "PC2 Bittware 520n reliable data transfer patch active. mlock "
-                 "all pages "
-              << (use_mlock ? "" : "not ") << "activated.\n";
-  }
-};
-static const env_t env{};
+    if (const char *retries = getenv("BITTFIX_MAX_RETRIES")) {
+      max_retries = std::strtoul(retries, nullptr, 10);
+    }
 
-typedef struct {
-  aocl_mmd_op_t op;
-  size_t len;
-  void *dst;
-  int interface;
-  size_t offset;
-  bool obsolete;
-} wrapped_aocl_mmd_op_t;
+    if (const char *threads = getenv("BITTFIX_VERIFY_THREADS")) {
+      verify_threads = std::strtoul(threads, nullptr, 10);
+    }
 
-class signal_guard {
-  sigset_t new_mask, old_mask;
+    if (const char *chunk = getenv("BITTFIX_CHUNK_SIZE")) {
+      chunk_size = std::strtoul(chunk, nullptr, 10);
+      chunk_size = (chunk_size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    }
 
-public:
-  signal_guard() {
-    sigfillset(&new_mask);
-    pthread_sigmask(SIG_SETMASK, &new_mask, &old_mask);
+    if (const char *workers = getenv("BITTFIX_STAMP_WORKERS")) {
+      stamp_workers = std::strtoul(workers, nullptr, 10);
+    }
+
+    if (const char *min_size = getenv("BITTFIX_STAMP_WORKERS_MIN_SIZE")) {
+      parallel_min_size = std::strtoul(min_size, nullptr, 10);
+    }
+
+    const char *numa = getenv("BITTFIX_NUMA");
+    if (numa && std::string{numa} == "0") {
+      numa_placement = false;
+    }
+
+    if (const char *root = getenv("BITTFIX_SYSFS_ROOT")) {
+      sysfs_root = root;
+    }
+
+    if (const char *buffers = getenv("BITTFIX_BOUNCE_BUFFERS")) {
+      bounce_buffers = std::strtoul(buffers, nullptr, 10);
+    }
+
+    if (const char *size = getenv("BITTFIX_BOUNCE_SIZE")) {
+      bounce_size = std::strtoul(size, nullptr, 10);
+      bounce_size = (bounce_size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    }
+
+    if (const char *cache = getenv("BITTFIX_SHM_CACHE")) {
+      shared_mem_cache.max_cached_bytes = std::strtoul(cache, nullptr, 10);
+    }
+
+    if (const char *max_size = getenv("BITTFIX_SHM_CACHE_MAX_SIZE")) {
+      shared_mem_cache.max_size = std::strtoul(max_size, nullptr, 10);
+    }
+
+    if (const char *idle = getenv("BITTFIX_SHM_CACHE_IDLE")) {
+      shared_mem_cache.idle =
+          std::chrono::seconds{std::strtoul(idle, nullptr, 10)};
+    }
+
+    const char *program = getenv("BITTFIX_PROGRAM_CACHE");
+    if (program && std::string{program} != "0") {
+      program_cache = true;
+    }
+
+    if (getenv("BITTFIX_PROGRAM_FORCE")) {
+      force_program = true;
+    }
+
+    if (const char *escalation = getenv("BITTFIX_VERIFY_ESCALATION")) {
+      verify_policy.escalation =
+          std::chrono::seconds{std::strtoul(escalation, nullptr, 10)};
+    }
+
+    const char *verify = getenv("BITTFIX_VERIFY");
+    if (verify && !parse_verify_policy(verify, verify_policy)) {
+      std::cerr << "PC2 WARNING: Invalid BITTFIX_VERIFY value: " << verify
+                << ". Verifying all transfers.\n";
+    }
+
+    const char *simd = getenv("BITTFIX_SIMD");
+    kernel = &select_stamp_kernel(simd ? simd : "");
+
+    std::cerr << "PC2 Bittware 520n reliable data transfer patch active. mlock "
+                 "for prefaulting "
+              << (use_mlock ? "" : "not ") << "enforced. Using "
+              << kernel->name << " stamping. Verifying "
+              << describe_verify_policy(verify_policy) << ".\n";
   }
-  ~signal_guard() { sigprocmask(SIG_SETMASK, &old_mask, NULL); }
 };
+static const env_t env{};
 
 // Useful for debugging. Commented out as it's currently unused.
 /*
@@ -261,7 +392,31 @@ static void pretty_print(unsigned char *buf, size_t bufsize) {
 }
 */
 
-static void stamp_pages(void *dst, size_t len) {
+static void stamp_range(void *dst, size_t len, uint64_t nonce) {
+  // prefault all pages unless they are known to be resident
+  const bool known_resident = make_resident(dst, len, env.use_mlock);
+
+  const auto start = std::chrono::steady_clock::now();
+  env.kernel->stamp(dst, len, nonce);
+
+  if (known_resident) {
+    report_stamp_time(dst, len, std::chrono::steady_clock::now() - start);
+  }
+}
+
+static void stamp_part(void *dst, size_t len, size_t part, void *ctx) {
+  stamp_range(dst, len, *static_cast<const uint64_t *>(ctx));
+}
+
+static uint64_t ns_since(std::chrono::steady_clock::time_point start) {
+  return static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - start)
+          .count());
+}
+
+// Stamps [dst, dst + len) with a new nonce and returns it.
+static uint64_t stamp_pages(interface_stats_t *stats, void *dst, size_t len) {
   uintptr_t first_byte, last_byte, first_page, last_page;
   first_byte = reinterpret_cast<uintptr_t>(dst);
   last_byte = first_byte + len - 1;
@@ -272,28 +427,35 @@ static void stamp_pages(void *dst, size_t len) {
     std::cout << std::hex << first_byte << " (" << first_page << ") - "
               << last_byte << " (" << last_page << ")\n";
 
-  // prefault all pages
-  int err{0};
-  if (env.use_mlock) {
-    err = mlock(dst, len);
-  }
-
-  // for now only stamp first 32 byte of a page
-  // => first page will be skipped if not aligned
-  for (uintptr_t pp = first_page << 12; pp <= last_page << 12; pp += 4096) {
-    if (pp < first_byte || pp + 31 > last_byte) {
-      continue;
-    }
-    void *page_ptr = reinterpret_cast<void *>(pp);
-    std::memcpy(page_ptr, RANDOM_STRING, 32);
+  uint64_t nonce = new_stamp_nonce();
+  const auto start = std::chrono::steady_clock::now();
+  if (env.stamp_workers && len >= env.parallel_min_size) {
+    for_each_page_part(dst, len, stamp_part, &nonce);
+  } else {
+    stamp_range(dst, len, nonce);
   }
+  stats_add(stats->stamp_ns, ns_since(start));
+  return nonce;
+}
 
-  if (env.use_mlock && !err) {
-    munlock(dst, len);
+typedef struct {
+  std::vector<std::vector<page_range_t>> corrupted;
+  uint64_t nonce;
+  bool collect;
+  std::atomic<int> ret;
+} check_job_t;
+
+static void check_part(void *dst, size_t len, size_t part, void *ctx) {
+  check_job_t *job = static_cast<check_job_t *>(ctx);
+  if (env.kernel->check(dst, len, job->nonce,
+                        job->collect ? &job->corrupted[part] : nullptr)) {
+    job->ret.store(1, std::memory_order_relaxed);
   }
 }
 
-static int check_pages(void *dst, size_t len) {
+static int check_pages(interface_stats_t *stats, void *dst, size_t len,
+                       uint64_t nonce,
+                       std::vector<page_range_t> *corrupted = nullptr) {
   uintptr_t first_byte, last_byte, first_page, last_page;
   first_byte = reinterpret_cast<uintptr_t>(dst);
   last_byte = first_byte + len - 1;
@@ -304,113 +466,590 @@ static int check_pages(void *dst, size_t len) {
     std::cout << std::hex << first_byte << " (" << first_page << ") - "
               << last_byte << " (" << last_page << ")\n";
 
-  int ret{0};
+  const auto start = std::chrono::steady_clock::now();
+  if (!env.stamp_workers || len < env.parallel_min_size) {
+    const int ret = env.kernel->check(dst, len, nonce, corrupted);
+    stats_add(stats->check_ns, ns_since(start));
+    return ret;
+  }
+
+  check_job_t job{};
+  job.corrupted.resize(page_part_count(dst, len));
+  job.nonce = nonce;
+  job.collect = corrupted != nullptr;
+  for_each_page_part(dst, len, check_part, &job);
+
+  // ranges may continue across part boundaries
+  if (corrupted) {
+    for (const auto &part : job.corrupted) {
+      for (const auto &range : part) {
+        if (!corrupted->empty() && corrupted->back().end == range.begin) {
+          corrupted->back().end = range.end;
+        } else {
+          corrupted->push_back(range);
+        }
+      }
+    }
+  }
+  stats_add(stats->check_ns, ns_since(start));
+  return job.ret.load(std::memory_order_relaxed);
+}
+
+typedef struct {
+  const unsigned char *src;
+  uintptr_t dst;
+} copy_job_t;
+
+static void copy_part(void *dst, size_t len, size_t part, void *ctx) {
+  const copy_job_t *job = static_cast<const copy_job_t *>(ctx);
+  stream_copy(dst, job->src + (reinterpret_cast<uintptr_t>(dst) - job->dst),
+              len);
+}
+
+// Copies a verified bounce buffer out to the destination of its read.
+static void copy_out(interface_stats_t *stats, void *dst,
+                     const bounce_buffer_t *bounce, size_t len) {
+  const auto start = std::chrono::steady_clock::now();
+  // faulting in page by page would cost more than the copy itself
+  make_resident(dst, len, env.use_mlock);
+  if (env.stamp_workers && len >= env.parallel_min_size) {
+    copy_job_t job{static_cast<const unsigned char *>(bounce->data),
+                   reinterpret_cast<uintptr_t>(dst)};
+    for_each_page_part(dst, len, copy_part, &job);
+  } else {
+    stream_copy(dst, bounce->data, len);
+  }
+  stats_add(stats->check_ns, ns_since(start));
+}
+
+/*
+ * Re-reads the corrupted page ranges of a transfer of `dst` from `offset`
+ * until all stamps have vanished. Only the affected pages are transferred
+ * again, so the cost of a repair scales with the number of missing pages
+ * rather than the size of the transfer.
+ */
+static void repair_transfer(int handle, std::vector<page_range_t> &corrupted,
+                            void *dst, int interface, size_t offset) {
+  const uintptr_t first_byte = reinterpret_cast<uintptr_t>(dst);
+  interface_stats_t *stats = get_interface_stats(handle, interface);
+  stats_add(stats->corruptions, 1);
+
+  if (env.verify_policy.mode != VERIFY_ALL &&
+      get_handle_state(handle)->sampler.escalate(env.verify_policy)) {
+    std::cerr << "PC2 WARNING: Verifying all transfers of device " +
+                     std::to_string(handle) + " for the next " +
+                     std::to_string(env.verify_policy.escalation.count()) +
+                     " s.\n";
+  }
 
-  // for now only check first 32 byte of a page
-  // => first page will be skipped if not aligned
-  for (uintptr_t pp = first_page << 12; pp <= last_page << 12; pp += 4096) {
-    if (pp < first_byte || pp + 31 > last_byte) {
-      continue;
+  for (unsigned long retry = 0; retry < env.max_retries && !corrupted.empty();
+       retry++) {
+    size_t bytes{0};
+    for (const auto &range : corrupted) {
+      bytes += range.end - range.begin;
     }
-    const void *page_ptr = reinterpret_cast<void *>(pp);
-    ret |= !std::memcmp(page_ptr, RANDOM_STRING, 32);
+    // pretty_print((unsigned char *)(corrupted[0].begin), bytes);
+    // single write, validation workers may report concurrently
+    std::cerr << "!!! Incomplete data transfer detected. Re-reading " +
+                     std::to_string(bytes) + " bytes in " +
+                     std::to_string(corrupted.size()) +
+                     " page range(s). !!!\n";
+    stats_add(stats->reread_bytes, bytes);
+
+    std::vector<page_range_t> still_corrupted{};
+    for (const auto &range : corrupted) {
+      void *range_dst = reinterpret_cast<void *>(range.begin);
+      const size_t range_len = range.end - range.begin;
+      // a new nonce, data that matched the old stamp cannot match again
+      const uint64_t nonce = stamp_pages(stats, range_dst, range_len);
+      libbitt.aocl_mmd_read(handle, NULL, range_len, range_dst, interface,
+                            offset + (range.begin - first_byte));
+      check_pages(stats, range_dst, range_len, nonce, &still_corrupted);
+    }
+    corrupted.swap(still_corrupted);
+  }
+
+  if (!corrupted.empty()) {
+    stats_add(stats->unrepaired, 1);
+    std::cerr << "PC2 WARNING: Pages still missing after " << env.max_retries
+              << " re-reads. Transferred data is incomplete.\n";
   }
+}
 
+static int read_validated(int handle, size_t len, void *dst, int interface,
+                          size_t offset) {
+  interface_stats_t *stats = get_interface_stats(handle, interface);
+  const uint64_t nonce = stamp_pages(stats, dst, len);
+  const auto start = std::chrono::steady_clock::now();
+  int ret = libbitt.aocl_mmd_read(handle, NULL, len, dst, interface, offset);
+  stats_add(stats->transfer_ns, ns_since(start));
+  std::vector<page_range_t> corrupted{};
+  if (check_pages(stats, dst, len, nonce, &corrupted)) {
+    repair_transfer(handle, corrupted, dst, interface, offset);
+  }
   return ret;
 }
 
-static void gc() {
-  signal_guard sg{};
-  std::lock_guard<std::mutex> lg{known_op_wrappings_lock};
-  for (auto it = known_op_wrappings.begin(); it != known_op_wrappings.end();) {
+static wrapped_aocl_mmd_op_t *wrap_read(int handle, aocl_mmd_op_t op,
+                                        size_t len, void *dst, int interface,
+                                        size_t offset,
+                                        wrapped_aocl_mmd_op_t *parent) {
+  wrapped_aocl_mmd_op_t *wrapped_op = op_pool.acquire();
+  if (wrapped_op) {
+    get_handle_state(handle)->ops_in_flight.fetch_add(1);
+    wrapped_op->op = op;
+    wrapped_op->len = len;
+    wrapped_op->dst = dst;
+    wrapped_op->interface = interface;
+    wrapped_op->offset = offset;
+    wrapped_op->handle = handle;
+    wrapped_op->parent = parent;
+    wrapped_op->bounce = nullptr;
+  }
+  return wrapped_op;
+}
+
+// Called once an op taken by wrap_read() no longer uses the state of its
+// device. Only wakes a thread closing the device.
+static void end_op(int handle) {
+  handle_state_t *state = get_handle_state(handle);
+  if (state->ops_in_flight.fetch_sub(1) == 1 && state->closing.load()) {
+    futex_wake(state->ops_in_flight);
+  }
+}
+
+static void release_op(wrapped_aocl_mmd_op_t *wrapped_op) {
+  const int handle = wrapped_op->handle;
+  op_pool.release(wrapped_op);
+  end_op(handle);
+}
+
+/*
+ * Reads into a pre-stamped bounce buffer instead of `dst`, which is likely not
+ * resident. Blocking reads are verified and copied out right away,
+ * non-blocking ones by complete_wrapped_read().
+ */
+static int read_bounced(int handle, aocl_mmd_op_t op, bounce_buffer_t *bounce,
+                        size_t len, void *dst, int interface, size_t offset) {
+  interface_stats_t *stats = get_interface_stats(handle, interface);
+
+  if (op) {
     wrapped_aocl_mmd_op_t *wrapped_op =
-        static_cast<wrapped_aocl_mmd_op_t *>(*it);
-    if (wrapped_op->obsolete) {
-      it = known_op_wrappings.erase(it);
-      delete wrapped_op;
-    } else {
-      ++it;
+        wrap_read(handle, op, len, dst, interface, offset, nullptr);
+    if (!wrapped_op) {
+      release_bounce_buffer(bounce, true);
+      std::cerr << "PC2 WARNING: Too many non-blocking reads in flight. "
+                   "Transfer will not be validated.\n";
+      return libbitt.aocl_mmd_read(handle, op, len, dst, interface, offset);
     }
+    stats_add(stats->bounced_reads, 1);
+    wrapped_op->bounce = bounce;
+    wrapped_op->issued = std::chrono::steady_clock::now();
+    const int ret = libbitt.aocl_mmd_read(handle, wrapped_op, len,
+                                          bounce->data, interface, offset);
+    if (ret) { // never reported
+      release_bounce_buffer(bounce);
+      release_op(wrapped_op);
+    }
+    return ret;
   }
+
+  stats_add(stats->bounced_reads, 1);
+  const auto start = std::chrono::steady_clock::now();
+  int ret =
+      libbitt.aocl_mmd_read(handle, NULL, len, bounce->data, interface, offset);
+  stats_add(stats->transfer_ns, ns_since(start));
+  std::vector<page_range_t> corrupted{};
+  if (check_pages(stats, bounce->data, len, bounce->nonce, &corrupted)) {
+    repair_transfer(handle, corrupted, bounce->data, interface, offset);
+  }
+  copy_out(stats, dst, bounce, len);
+  release_bounce_buffer(bounce);
+  return ret;
 }
 
-static void wrapping_handler(int handle, void *user_data, aocl_mmd_op_t op,
-                             int status) {
-  if (DEBUG)
-    std::cout << "Custom status status handler called.\n";
+// Hands a complete application op to the original status handler: in BSP
+// order, or right away if it got no position in the completion order.
+static void deliver_completion(int handle, uint64_t completion,
+                               aocl_mmd_op_t op, int status) {
+  handle_state_t *state = get_handle_state(handle);
+  aocl_mmd_status_handler_fn fn =
+      state->status_handler.load(std::memory_order_acquire);
+  if (completion == completion_queue_t::UNORDERED) {
+    fn(handle, state->user_data.load(std::memory_order_acquire), op, status);
+  } else {
+    state->completions.load(std::memory_order_acquire)
+        ->complete(completion, handle, fn);
+  }
+}
+
+/*
+ * Chunked reads keep two reference counts on their parent op. Each chunk in
+ * flight and the issuing thread hold a reference on `unreported_chunks`.
+ * Once the last of them is gone, all chunks have been reported by the BSP and
+ * the application's op takes its place in the completion order. Each chunk
+ * still to be validated and the completion order placement hold a reference
+ * on `pending_chunks`. Once the last of them is gone, the application's op
+ * is complete.
+ */
+static void finish_chunk(wrapped_aocl_mmd_op_t *parent) {
+  if (parent->pending_chunks.fetch_sub(1) != 1) {
+    return;
+  }
+
+  if (!parent->op) {
+    // blocking read, the issuing thread waits for this and cleans up
+    parent->done.store(1);
+    futex_wake(parent->done);
+    return;
+  }
+
+  const int handle = parent->handle;
+  const uint64_t completion = parent->completion;
+  aocl_mmd_op_t op = parent->op;
+  const int status = parent->status.load();
+  op_pool.release(parent);
+  deliver_completion(handle, completion, op, status);
+  end_op(handle);
+}
+
+static void report_chunk(wrapped_aocl_mmd_op_t *parent, int status) {
+  if (status) {
+    parent->status.store(status);
+  }
+  if (parent->unreported_chunks.fetch_sub(1) != 1) {
+    return;
+  }
+
+  if (parent->op) {
+    handle_state_t *state = get_handle_state(parent->handle);
+    parent->completion =
+        state->completions.load(std::memory_order_acquire)
+            ->push(parent->op, state->user_data.load(std::memory_order_acquire),
+                   parent->status.load());
+  }
+  finish_chunk(parent);
+}
+
+/*
+ * Non-blocking reads are validated by a pool of worker threads instead of the
+ * BSP thread that reports their completion, so completions of other ops on
+ * the same device are not held up by it. The original status handler is
+ * invoked only after validation, in the order the BSP reported completions.
+ */
+constexpr size_t MAX_PENDING_VALIDATIONS{4096};
+static mpmc_queue_t<wrapped_aocl_mmd_op_t *, MAX_PENDING_VALIDATIONS>
+    validation_queue{};
+static sem_t validation_sem{};
+static std::once_flag validation_workers_started{};
+
+static void complete_wrapped_read(wrapped_aocl_mmd_op_t *wrapped_op) {
+  interface_stats_t *stats =
+      get_interface_stats(wrapped_op->handle, wrapped_op->interface);
+  bounce_buffer_t *bounce = wrapped_op->bounce;
+  void *target = bounce ? bounce->data : wrapped_op->dst;
+  const uint64_t nonce = bounce ? bounce->nonce : wrapped_op->nonce;
+  std::vector<page_range_t> corrupted{};
+  if (check_pages(stats, target, wrapped_op->len, nonce, &corrupted)) {
+    repair_transfer(wrapped_op->handle, corrupted, target,
+                    wrapped_op->interface, wrapped_op->offset);
+  }
+  if (bounce) {
+    copy_out(stats, wrapped_op->dst, bounce, wrapped_op->len);
+    release_bounce_buffer(bounce);
+  }
+
+  const int handle = wrapped_op->handle;
+  const uint64_t completion = wrapped_op->completion;
+  aocl_mmd_op_t op = wrapped_op->op;
+  const int status = wrapped_op->status.load();
+  wrapped_aocl_mmd_op_t *parent = wrapped_op->parent;
+  op_pool.release(wrapped_op);
+
+  if (parent) {
+    end_op(handle);
+    finish_chunk(parent);
+    return;
+  }
+  deliver_completion(handle, completion, op, status);
+  end_op(handle);
+}
 
-  // If this handler is called, we know that registered_status_handlers[handle]
-  // is set.
-  aocl_mmd_status_handler_fn orig_handler;
-  {
-    signal_guard sg{};
-    std::lock_guard<std::mutex> lg{registered_status_handlers_lock};
-    orig_handler = registered_status_handlers.at(handle);
+static void validation_worker() {
+  register_internal_thread();
+  for (;;) {
+    while (sem_wait(&validation_sem) && errno == EINTR) {
+    }
+    // Each post belongs to one element, which might still be in the making.
+    wrapped_aocl_mmd_op_t *wrapped_op;
+    while (!validation_queue.pop(wrapped_op)) {
+      sched_yield();
+    }
+    complete_wrapped_read(wrapped_op);
   }
+}
 
-  bool is_wrapped_read;
-  {
-    signal_guard sg{};
-    std::lock_guard<std::mutex> lg{known_op_wrappings_lock};
-    is_wrapped_read = known_op_wrappings.count(op);
+static void start_validation_workers() {
+  sem_init(&validation_sem, 0, 0);
+  for (unsigned long i = 0; i < env.verify_threads; i++) {
+    std::thread(validation_worker).detach();
   }
+}
 
-  if (is_wrapped_read) {
+static void wrapping_handler(int handle, void *user_data, aocl_mmd_op_t op,
+                             int status) {
+  if (DEBUG)
+    std::cout << "Custom status status handler called.\n";
+
+  // If this handler is called, we know that the state of this handle exists
+  // and its status handler and completion queue are set.
+  handle_state_t *state = get_handle_state(handle);
+  aocl_mmd_status_handler_fn orig_handler =
+      state->status_handler.load(std::memory_order_acquire);
+  completion_queue_t *completions =
+      state->completions.load(std::memory_order_acquire);
+
+  wrapped_aocl_mmd_op_t *wrapped_op = op_pool.lookup(op);
+  trace_scope_t trace{"status_handler", handle,
+                      wrapped_op ? wrapped_op->interface : -1,
+                      wrapped_op ? wrapped_op->len : 0,
+                      wrapped_op && wrapped_op->op ? wrapped_op->op : op};
+
+  if (wrapped_op) {
     if (DEBUG)
       std::cout << "Wrapped READ detected.\n";
 
-    wrapped_aocl_mmd_op_t *wrapped_op =
-        static_cast<wrapped_aocl_mmd_op_t *>(op);
-
-    int err = check_pages(wrapped_op->dst, wrapped_op->len);
-    if (err) {
-      // pretty_print((unsigned char *)(wrapped_op->dst), wrapped_op->len);
-      std::cerr << "!!! Incomplete data transfer detected. Re-issuing "
-                   "transfer. !!!\n";
-      aocl_mmd_read(handle, NULL, wrapped_op->len, wrapped_op->dst,
-                    wrapped_op->interface, wrapped_op->offset);
+    stats_add(get_interface_stats(handle, wrapped_op->interface)->transfer_ns,
+              ns_since(wrapped_op->issued));
+
+    if (wrapped_op->parent) {
+      report_chunk(wrapped_op->parent, status);
+    } else {
+      wrapped_op->status.store(status);
+      wrapped_op->completion =
+          completions->push(wrapped_op->op, user_data, status);
     }
 
-    orig_handler(handle, user_data, wrapped_op->op, status);
-    wrapped_op->obsolete = true;
+    // validate on this thread if no worker is available
+    if (env.verify_threads && validation_queue.push(wrapped_op)) {
+      sem_post(&validation_sem);
+    } else {
+      complete_wrapped_read(wrapped_op);
+    }
   } else {
-    orig_handler(handle, user_data, op, status);
+    const uint64_t completion = completions->push(op, user_data, status);
+    if (completion == completion_queue_t::UNORDERED) {
+      orig_handler(handle, user_data, op, status);
+    } else {
+      completions->complete(completion, handle, orig_handler);
+    }
+  }
+}
+
+/*
+ * Splits a large read into page-aligned chunks that are issued as internal
+ * non-blocking reads. Stamping a chunk overlaps with the transfer of the
+ * chunks before it, and each chunk is validated as soon as it arrives while
+ * the following ones are still in flight. The application's op completes
+ * once the last chunk is validated. If a chunk cannot be issued, the
+ * remainder of the transfer is read on the calling thread.
+ */
+static int read_chunked(wrapped_aocl_mmd_op_t *parent) {
+  const int handle = parent->handle;
+  const uintptr_t first_byte = reinterpret_cast<uintptr_t>(parent->dst);
+  const uintptr_t end = first_byte + parent->len;
+  interface_stats_t *stats = get_interface_stats(handle, parent->interface);
+
+  parent->unreported_chunks.store(1);
+  parent->pending_chunks.store(1);
+  parent->status.store(0);
+  parent->done.store(0);
+
+  uintptr_t begin = first_byte;
+  while (begin < end) {
+    const uintptr_t chunk_end = std::min<uintptr_t>(
+        (begin + env.chunk_size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1), end);
+    void *chunk_dst = reinterpret_cast<void *>(begin);
+    const size_t chunk_len = chunk_end - begin;
+    const size_t chunk_offset = parent->offset + (begin - first_byte);
+
+    wrapped_aocl_mmd_op_t *chunk =
+        wrap_read(handle, NULL, chunk_len, chunk_dst, parent->interface,
+                  chunk_offset, parent);
+    if (!chunk) {
+      break;
+    }
+
+    chunk->nonce = stamp_pages(stats, chunk_dst, chunk_len);
+    parent->unreported_chunks.fetch_add(1);
+    parent->pending_chunks.fetch_add(1);
+    chunk->issued = std::chrono::steady_clock::now();
+    if (libbitt.aocl_mmd_read(handle, chunk, chunk_len, chunk_dst,
+                              parent->interface, chunk_offset)) {
+      // the issuing thread still holds a reference, neither reaches zero
+      parent->unreported_chunks.fetch_sub(1);
+      parent->pending_chunks.fetch_sub(1);
+      release_op(chunk);
+      break;
+    }
+    begin = chunk_end;
+  }
+
+  if (begin < end) {
+    int ret = read_validated(handle, end - begin,
+                             reinterpret_cast<void *>(begin), parent->interface,
+                             parent->offset + (begin - first_byte));
+    if (ret) {
+      parent->status.store(ret);
+    }
+  }
+
+  const bool blocking = !parent->op;
+  report_chunk(parent, 0);
+  if (!blocking) {
+    return 0;
+  }
+
+  while (!parent->done.load()) {
+    futex_wait(parent->done, 0);
+  }
+  int ret = parent->status.load();
+  release_op(parent);
+  return ret;
+}
+
+/*
+ * Internal threads serve all devices. They may run on the CPUs of the NUMA
+ * nodes of all devices opened so far, which is a single node unless devices
+ * on several nodes are used. The bounce buffers are placed on the node of the
+ * first device opened.
+ */
+static void place_device(int handle, handle_state_t *state) {
+  char pcie_info[256]{};
+  size_t result_size;
+  if (libbitt.aocl_mmd_get_info(handle, AOCL_MMD_PCIE_INFO,
+                                sizeof(pcie_info) - 1, pcie_info,
+                                &result_size)) {
+    return;
+  }
+  const int node = pcie_numa_node(env.sysfs_root.c_str(), pcie_info);
+  if (DEBUG)
+    std::cout << "Device " << handle << " on NUMA node " << node << "\n";
+
+  cpu_set_t cpus;
+  if (numa_node_cpus(env.sysfs_root.c_str(), node, &cpus)) {
+    add_internal_thread_cpus(&cpus);
+  }
+  state->numa_node.store(node, std::memory_order_relaxed);
+}
+
+static std::once_flag stamp_workers_started{};
+
+static void start_stamp_workers() {
+  if (env.stamp_workers) {
+    start_page_workers(env.stamp_workers);
+  }
+}
+
+static std::once_flag bounce_pool_started{};
+
+static void start_bounce_buffers(int node) {
+  if (env.bounce_buffers) {
+    start_bounce_pool(env.bounce_buffers, env.bounce_size, env.kernel->stamp,
+                      node);
+  }
+}
+
+// Warns once per device about reads into and writes from host buffers on
+// another NUMA node, which cross the inter-socket link on every transfer.
+static void check_buffer_node(handle_state_t *state, interface_stats_t *stats,
+                              int handle, const void *buffer, size_t len) {
+  const int node = state->numa_node.load(std::memory_order_relaxed);
+  if (node < 0 || len < MIN_NUMA_CHECK_SIZE ||
+      !mostly_remote(buffer, len, node)) {
+    return;
+  }
+  stats_add(stats->remote_bytes, len);
+  if (!state->remote_buffer_warned.exchange(true, std::memory_order_relaxed)) {
+    std::cerr << "PC2 WARNING: Host buffer of a transfer with device "
+              << handle << " is on a remote NUMA node. The device is on node "
+              << node << ".\n";
   }
 }
 
 int aocl_mmd_open(const char *name) {
   if (DEBUG)
     std::cout << "aocl_mmd_open\n";
+  trace_scope_t trace{"aocl_mmd_open", -1};
+  capture_scope_t capture{CAPTURE_OPEN, -1};
 
   int device_handle = libbitt.aocl_mmd_open(name);
+  if (capture_record_t *record = capture.get()) {
+    record->handle = static_cast<int16_t>(device_handle);
+    std::memcpy(record->name, name,
+                name ? strnlen(name, sizeof(record->name)) : 0);
+  }
+
+  handle_state_t *opened = get_handle_state(device_handle);
+  if (opened && name) {
+    std::strncpy(opened->device_name, name, sizeof(opened->device_name) - 1);
+  }
 
   // determine global memory interface
   if (device_handle) {
+    handle_state_t *state = get_handle_state(device_handle);
     int ret, gmem_handle;
     size_t result_size;
     ret = aocl_mmd_get_info(device_handle, AOCL_MMD_MEMORY_INTERFACE,
                             sizeof(int), &gmem_handle, &result_size);
-    if (ret == 0) {
-      signal_guard sg{};
-      std::lock_guard<std::mutex> lg{gmem_interfaces_lock};
-      gmem_interfaces.insert_or_assign(device_handle, gmem_handle);
+    if (ret == 0 && state) {
+      if (env.numa_placement) {
+        place_device(device_handle, state);
+      }
+      std::call_once(stamp_workers_started, start_stamp_workers);
+      std::call_once(bounce_pool_started, start_bounce_buffers,
+                     state->numa_node.load(std::memory_order_relaxed));
+      state->gmem_interface.store(gmem_handle, std::memory_order_release);
+    } else if (ret == 0) {
+      std::cerr << "PC2 WARNING: Device handle " << device_handle
+                << " out of range. Transfers from this device will not be "
+                   "validated. Please contact PC2 support!\n";
     }
   }
 
   return device_handle;
 }
 
+static void capturing_status_handler(int handle, void *user_data,
+                                     aocl_mmd_op_t op, int status) {
+  capture_completion(handle, op, status);
+  get_handle_state(handle)->captured_status_handler.load(
+      std::memory_order_acquire)(handle, user_data, op, status);
+}
+
 int aocl_mmd_set_status_handler(int handle, aocl_mmd_status_handler_fn fn,
                                 void *user_data) {
 
   if (DEBUG)
     std::cout << "aocl_mmd_set_status_handler\n";
+  trace_scope_t trace{"aocl_mmd_set_status_handler", handle};
+  capture_scope_t capture{CAPTURE_SET_STATUS_HANDLER, handle};
 
-  {
-    signal_guard sg{};
-    std::lock_guard<std::mutex> lg{registered_status_handlers_lock};
-    registered_status_handlers.insert_or_assign(handle, fn);
+  handle_state_t *state = get_handle_state(handle);
+  if (!state) {
+    return libbitt.aocl_mmd_set_status_handler(handle, fn, user_data);
   }
+  std::call_once(validation_workers_started, start_validation_workers);
+  if (!state->completions.load(std::memory_order_acquire)) {
+    state->completions.store(new completion_queue_t{},
+                             std::memory_order_release);
+  }
+  state->user_data.store(user_data, std::memory_order_release);
+  if (fn && capture_enabled.load(std::memory_order_relaxed)) {
+    state->captured_status_handler.store(fn, std::memory_order_release);
+    fn = capturing_status_handler;
+  }
+  state->status_handler.store(fn, std::memory_order_release);
 
   return libbitt.aocl_mmd_set_status_handler(handle, wrapping_handler,
                                              user_data);
@@ -419,55 +1058,328 @@ int aocl_mmd_set_status_handler(int handle, aocl_mmd_status_handler_fn fn,
 int aocl_mmd_read(int handle, aocl_mmd_op_t op, size_t len, void *dst,
                   int interface, size_t offset) {
 
-  gc();
-
-  int gmem_interface;
-  {
-    signal_guard sg{};
-    std::lock_guard<std::mutex> lg{gmem_interfaces_lock};
-    gmem_interface = gmem_interfaces.at(handle);
-  }
+  trace_scope_t trace{"aocl_mmd_read", handle, interface, len, op};
+  capture_scope_t capture{CAPTURE_READ, handle, interface, op, len, offset,
+                          reinterpret_cast<uint64_t>(dst)};
+  handle_state_t *state = get_handle_state(handle);
+  int gmem_interface =
+      state ? state->gmem_interface.load(std::memory_order_acquire)
+            : NO_GMEM_INTERFACE;
 
   if (DEBUG)
     std::cout << "aocl_mmd_read on interface "
               << interface << " (gmem: " << gmem_interface << ")\n";
 
+  interface_stats_t *stats = get_interface_stats(handle, interface);
+  stats_add(stats->reads, 1);
+  stats_add(stats->read_bytes, len);
+  stats_add(stats->read_sizes[stats_size_bucket(len)], 1);
+
   if (interface != gmem_interface) {
     return libbitt.aocl_mmd_read(handle, op, len, dst, interface, offset);
   }
+  check_buffer_node(state, stats, handle, dst, len);
 
-  stamp_pages(dst, len);
+  if (!state->sampler.should_verify(env.verify_policy, len, *stats)) {
+    stats_add(stats->unverified_reads, 1);
+    return libbitt.aocl_mmd_read(handle, op, len, dst, interface, offset);
+  }
 
-  if (op) {
-    if (DEBUG)
-      std::cout << "Non-blocking call. Custom status handler will be called.\n";
+  // cold destinations that fit are staged instead of being faulted in
+  if (env.bounce_buffers && len <= env.bounce_size &&
+      !looks_resident(dst, len)) {
+    if (bounce_buffer_t *bounce = acquire_bounce_buffer()) {
+      return read_bounced(handle, op, bounce, len, dst, interface, offset);
+    }
+  }
 
-    auto wrapped_op =
-        new wrapped_aocl_mmd_op_t{op, len, dst, interface, offset, false};
-    {
-      signal_guard sg{};
-      std::lock_guard<std::mutex> lg{known_op_wrappings_lock};
-      known_op_wrappings.insert(wrapped_op);
+  // only possible if a status handler is installed to get the chunks back
+  if (env.chunk_size && len >= 2 * env.chunk_size &&
+      state->completions.load(std::memory_order_acquire)) {
+    wrapped_aocl_mmd_op_t *parent =
+        wrap_read(handle, op, len, dst, interface, offset, nullptr);
+    if (parent) {
+      return read_chunked(parent);
     }
-    return libbitt.aocl_mmd_read(handle, wrapped_op, len, dst, interface,
-                                 offset);
+  }
 
-  } else {
-    int ret = libbitt.aocl_mmd_read(handle, op, len, dst, interface, offset);
-    int err = check_pages(dst, len);
-    if (err) {
-      // pretty_print((unsigned char *)(dst), len);
-      std::cerr << "!!! Incomplete data transfer detected. Re-issuing "
-                   "transfer. !!!\n";
-      aocl_mmd_read(handle, NULL, len, dst, interface, offset);
+  if (!op) {
+    return read_validated(handle, len, dst, interface, offset);
+  }
+
+  wrapped_aocl_mmd_op_t *wrapped_op =
+      wrap_read(handle, op, len, dst, interface, offset, nullptr);
+  if (!wrapped_op) {
+    std::cerr << "PC2 WARNING: Too many non-blocking reads in flight. "
+                 "Transfer will not be validated.\n";
+    return libbitt.aocl_mmd_read(handle, op, len, dst, interface, offset);
+  }
+
+  if (DEBUG)
+    std::cout << "Non-blocking call. Custom status handler will be called.\n";
+
+  wrapped_op->nonce = stamp_pages(stats, dst, len);
+  wrapped_op->issued = std::chrono::steady_clock::now();
+  const int ret =
+      libbitt.aocl_mmd_read(handle, wrapped_op, len, dst, interface, offset);
+  if (ret) { // never reported
+    release_op(wrapped_op);
+  }
+  return ret;
+}
+
+int aocl_mmd_write(int handle, aocl_mmd_op_t op, size_t len, const void *src,
+                   int interface, size_t offset) {
+
+  if (DEBUG)
+    std::cout << "aocl_mmd_write\n";
+  trace_scope_t trace{"aocl_mmd_write", handle, interface, len, op};
+  capture_scope_t capture{CAPTURE_WRITE, handle, interface, op, len, offset,
+                          reinterpret_cast<uint64_t>(src)};
+
+  interface_stats_t *stats = get_interface_stats(handle, interface);
+  stats_add(stats->writes, 1);
+  stats_add(stats->write_bytes, len);
+  stats_add(stats->write_sizes[stats_size_bucket(len)], 1);
+
+  handle_state_t *state = get_handle_state(handle);
+  if (state &&
+      interface == state->gmem_interface.load(std::memory_order_acquire)) {
+    check_buffer_node(state, stats, handle, src, len);
+  }
+
+  return libbitt.aocl_mmd_write(handle, op, len, src, interface, offset);
+}
+
+static void tracing_interrupt_handler(int handle, void *user_data) {
+  trace_scope_t trace{"interrupt_handler", handle};
+  get_handle_state(handle)->interrupt_handler.load(std::memory_order_acquire)(
+      handle, user_data);
+}
+
+static void
+tracing_device_interrupt_handler(int handle, aocl_mmd_interrupt_info *data_in,
+                                 void *user_data) {
+  trace_scope_t trace{"device_interrupt_handler", handle};
+  get_handle_state(handle)->device_interrupt_handler.load(
+      std::memory_order_acquire)(handle, data_in, user_data);
+}
+
+int aocl_mmd_set_interrupt_handler(int handle, aocl_mmd_interrupt_handler_fn fn,
+                                   void *user_data) {
+
+  if (DEBUG)
+    std::cout << "aocl_mmd_set_interrupt_handler\n";
+  trace_scope_t trace{"aocl_mmd_set_interrupt_handler", handle};
+
+  handle_state_t *state = get_handle_state(handle);
+  if (!state || !fn || !trace_enabled.load(std::memory_order_relaxed)) {
+    return libbitt.aocl_mmd_set_interrupt_handler(handle, fn, user_data);
+  }
+  state->interrupt_handler.store(fn, std::memory_order_release);
+  return libbitt.aocl_mmd_set_interrupt_handler(
+      handle, tracing_interrupt_handler, user_data);
+}
+
+int aocl_mmd_set_device_interrupt_handler(
+    int handle, aocl_mmd_device_interrupt_handler_fn fn, void *user_data) {
+
+  if (DEBUG)
+    std::cout << "aocl_mmd_set_device_interrupt_handler\n";
+  trace_scope_t trace{"aocl_mmd_set_device_interrupt_handler", handle};
+
+  handle_state_t *state = get_handle_state(handle);
+  if (!state || !fn || !trace_enabled.load(std::memory_order_relaxed)) {
+    return libbitt.aocl_mmd_set_device_interrupt_handler(handle, fn,
+                                                         user_data);
+  }
+  state->device_interrupt_handler.store(fn, std::memory_order_release);
+  return libbitt.aocl_mmd_set_device_interrupt_handler(
+      handle, tracing_device_interrupt_handler, user_data);
+}
+
+static std::once_flag shared_mem_cache_started{};
+
+static void start_shared_mem_cache_once() {
+  std::call_once(shared_mem_cache_started, start_shared_mem_cache,
+                 env.shared_mem_cache, libbitt.aocl_mmd_shared_mem_alloc,
+                 libbitt.aocl_mmd_shared_mem_free);
+}
+
+void *aocl_mmd_shared_mem_alloc(int handle, size_t size,
+                                unsigned long long *device_ptr_out) {
+
+  if (DEBUG)
+    std::cout << "aocl_mmd_shared_mem_alloc\n";
+  trace_scope_t trace{"aocl_mmd_shared_mem_alloc", handle, -1, size};
+  capture_scope_t capture{CAPTURE_SHARED_MEM_ALLOC, handle, -1, nullptr, size};
+
+  start_shared_mem_cache_once();
+  void *host_ptr = cached_shared_mem_alloc(handle, size, device_ptr_out);
+  if (capture_record_t *record = capture.get()) {
+    record->args.host = reinterpret_cast<uint64_t>(host_ptr);
+  }
+  return host_ptr;
+}
+
+void aocl_mmd_shared_mem_free(int handle, void *host_ptr, size_t size) {
+
+  if (DEBUG)
+    std::cout << "aocl_mmd_shared_mem_free\n";
+  trace_scope_t trace{"aocl_mmd_shared_mem_free", handle, -1, size, host_ptr};
+  capture_scope_t capture{CAPTURE_SHARED_MEM_FREE, handle, -1, nullptr, size, 0,
+                          reinterpret_cast<uint64_t>(host_ptr)};
+
+  start_shared_mem_cache_once();
+  cached_shared_mem_free(handle, host_ptr, size);
+}
+
+/*
+ * Waits until no wrapped op of a device uses its state anymore and all its
+ * completions have been delivered. Gives up after CLOSE_TIMEOUT, in case the
+ * BSP dropped a completion or the device is wedged.
+ */
+constexpr auto CLOSE_TIMEOUT{std::chrono::seconds(10)};
+
+static bool wait_for_ops(handle_state_t *state,
+                         completion_queue_t *completions) {
+  constexpr timespec SLICE{0, 1000000};
+  state->closing.store(true);
+  const auto deadline = std::chrono::steady_clock::now() + CLOSE_TIMEOUT;
+  for (;;) {
+    const uint32_t in_flight = state->ops_in_flight.load();
+    if (!in_flight && (!completions || completions->drained())) {
+      return true;
     }
-    return ret;
+    if (std::chrono::steady_clock::now() >= deadline) {
+      state->closing.store(false);
+      return false;
+    }
+    // a wake before the flag was seen is caught by the next slice
+    if (in_flight) {
+      futex_wait(state->ops_in_flight, in_flight, &SLICE);
+    } else {
+      nanosleep(&SLICE, nullptr);
+    }
+  }
+}
+
+int aocl_mmd_close(int handle) {
+
+  if (DEBUG)
+    std::cout << "aocl_mmd_close\n";
+  trace_scope_t trace{"aocl_mmd_close", handle};
+  capture_scope_t capture{CAPTURE_CLOSE, handle};
+
+  // Reads still being validated complete through the handle's state, which
+  // must outlive them.
+  handle_state_t *state = get_handle_state(handle);
+  completion_queue_t *completions =
+      state ? state->completions.load(std::memory_order_acquire) : nullptr;
+  const bool drained = !state || wait_for_ops(state, completions);
+  if (!drained) {
+    std::cerr << "PC2 WARNING: Reads of device " << handle
+              << " did not complete in time. Its state is left behind.\n";
+  }
+
+  // cached blocks belong to the device
+  flush_shared_mem_cache(handle);
+  const int ret = libbitt.aocl_mmd_close(handle);
+
+  // the device may have been left in any state
+  if (ret && env.program_cache && state && state->device_name[0]) {
+    program_record_t{state->device_name}.invalidate();
+  }
+
+  // the BSP may hand out the same handle for the next device
+  if (!ret && state && drained) {
+    delete completions;
+    state->~handle_state_t();
+    new (state) handle_state_t{};
+  }
+  return ret;
+}
+
+/*
+ * Programs a device by calling `program` unless the node-wide record shows
+ * that it already holds the bitstream. The BSP may reopen the device under a
+ * new handle, which then inherits the device name.
+ */
+template <typename F>
+static int program_cached(int handle, const void *data, size_t size,
+                          F program) {
+  handle_state_t *state = get_handle_state(handle);
+  if (!env.program_cache || !state || !state->device_name[0]) {
+    return program();
+  }
+
+  const uint64_t hash = hash_bitstream(data, size);
+  program_record_t record{state->device_name};
+  if (!env.force_program && record.matches(hash, size)) {
+    std::cerr << "PC2 Device " << state->device_name
+              << " already holds this bitstream. Skipping reprogramming.\n";
+    return handle;
+  }
+
+  record.invalidate();
+  const int new_handle = program();
+  handle_state_t *new_state = get_handle_state(new_handle);
+  if (new_state) {
+    record.store(hash, size);
+    if (new_state != state) {
+      std::memcpy(new_state->device_name, state->device_name,
+                  sizeof(state->device_name));
+    }
+  }
+  return new_handle;
+}
+
+int aocl_mmd_program(int handle, void *user_data, size_t size,
+                     aocl_mmd_program_mode_t program_mode) {
+
+  if (DEBUG)
+    std::cout << "aocl_mmd_program\n";
+  trace_scope_t trace{"aocl_mmd_program", handle, -1, size};
+  capture_scope_t capture{CAPTURE_PROGRAM, handle, -1, nullptr, size};
+
+  const int new_handle = program_cached(handle, user_data, size, [&] {
+    return libbitt.aocl_mmd_program(handle, user_data, size, program_mode);
+  });
+  if (capture_record_t *record = capture.get()) {
+    record->args.offset = static_cast<uint64_t>(new_handle);
+  }
+  return new_handle;
+}
+
+/*
+ * Must not be implemented for MMD versions 18.1 and newer. Otherwise the
+ * following error is caused:
+
+ * mmd program_device: aocl_mmd_reprogram is deprecated! Program with
+ * aocl_mmd_program instead. Exit.
+ */
+#ifdef INCLUDE_AOCL_MMD_REPROGRAM
+int aocl_mmd_reprogram(int handle, void *user_data, size_t size) {
+
+  if (DEBUG)
+    std::cout << "aocl_mmd_reprogram\n";
+  trace_scope_t trace{"aocl_mmd_reprogram", handle, -1, size};
+  capture_scope_t capture{CAPTURE_PROGRAM, handle, -1, nullptr, size};
+
+  const int new_handle = program_cached(handle, user_data, size, [&] {
+    return libbitt.aocl_mmd_reprogram(handle, user_data, size);
+  });
+  if (capture_record_t *record = capture.get()) {
+    record->args.offset = static_cast<uint64_t>(new_handle);
   }
+  return new_handle;
 }
+#endif
 
 /*
  * From here on, the remaining MMD API is implemented doing a simple forwarding
- * of function calls. No custom logic should follow below this comment.
+ * of function calls. No custom logic apart from tracing and capturing should
+ * follow below this comment.
  */
 
 int aocl_mmd_get_offline_info(aocl_mmd_offline_info_t requested_info_id,
@@ -476,6 +1388,7 @@ int aocl_mmd_get_offline_info(aocl_mmd_offline_info_t requested_info_id,
 
   if (DEBUG)
     std::cout << "aocl_mmd_get_offline_info\n";
+  trace_scope_t trace{"aocl_mmd_get_offline_info", -1};
 
   return libbitt.aocl_mmd_get_offline_info(requested_info_id, param_value_size,
                                            param_value, param_size_ret);
@@ -487,68 +1400,39 @@ int aocl_mmd_get_info(int handle, aocl_mmd_info_t requested_info_id,
 
   if (DEBUG)
     std::cout << "aocl_mmd_get_info\n";
+  trace_scope_t trace{"aocl_mmd_get_info", handle};
 
   return libbitt.aocl_mmd_get_info(handle, requested_info_id, param_value_size,
                                    param_value, param_size_ret);
 }
 
-int aocl_mmd_close(int handle) {
-
-  if (DEBUG)
-    std::cout << "aocl_mmd_close\n";
-
-  return libbitt.aocl_mmd_close(handle);
-}
-
-int aocl_mmd_set_interrupt_handler(int handle, aocl_mmd_interrupt_handler_fn fn,
-                                   void *user_data) {
-
-  if (DEBUG)
-    std::cout << "aocl_mmd_set_interrupt_handler\n";
-
-  return libbitt.aocl_mmd_set_interrupt_handler(handle, fn, user_data);
-}
-
 int aocl_mmd_yield(int handle) {
 
   if (DEBUG)
     std::cout << "aocl_mmd_yield\n";
+  trace_scope_t trace{"aocl_mmd_yield", handle};
 
   return libbitt.aocl_mmd_yield(handle);
 }
 
-int aocl_mmd_write(int handle, aocl_mmd_op_t op, size_t len, const void *src,
-                   int interface, size_t offset) {
-
-  if (DEBUG)
-    std::cout << "aocl_mmd_write\n";
-
-  return libbitt.aocl_mmd_write(handle, op, len, src, interface, offset);
-}
-
 int aocl_mmd_copy(int handle, aocl_mmd_op_t op, size_t len, int intf,
                   size_t src_offset, size_t dst_offset) {
 
   if (DEBUG)
     std::cout << "aocl_mmd_copy\n";
+  trace_scope_t trace{"aocl_mmd_copy", handle, intf, len, op};
+  capture_scope_t capture{CAPTURE_COPY, handle, intf, op, len, src_offset,
+                          dst_offset};
 
   return libbitt.aocl_mmd_copy(handle, op, len, intf, src_offset, dst_offset);
 }
 
-int aocl_mmd_program(int handle, void *user_data, size_t size,
-                     aocl_mmd_program_mode_t program_mode) {
-
-  if (DEBUG)
-    std::cout << "aocl_mmd_program\n";
-
-  return libbitt.aocl_mmd_program(handle, user_data, size, program_mode);
-}
-
 int aocl_mmd_sch_status(const char *device_name, size_t channel_number,
                         unsigned int *param_value) {
 
   if (DEBUG)
     std::cout << "aocl_mmd_sch_status\n";
+  trace_scope_t trace{"aocl_mmd_sch_status", -1};
 
   return libbitt.aocl_mmd_sch_status(device_name, channel_number, param_value);
 }
@@ -558,6 +1442,7 @@ int aocl_mmd_sch_ctrl(const char *device_name, size_t channel_number,
 
   if (DEBUG)
     std::cout << "aocl_mmd_sch_ctrl\n";
+  trace_scope_t trace{"aocl_mmd_sch_ctrl", -1};
 
   return libbitt.aocl_mmd_sch_ctrl(device_name, channel_number, param_value);
 }
@@ -567,6 +1452,7 @@ int aocl_mmd_sch_perfctrl(const char *device_name, size_t channel_number,
 
   if (DEBUG)
     std::cout << "aocl_mmd_sch_perfctrl\n";
+  trace_scope_t trace{"aocl_mmd_sch_perfctrl", -1};
 
   return libbitt.aocl_mmd_sch_perfctrl(device_name, channel_number,
                                        param_value);
@@ -577,6 +1463,7 @@ int aocl_mmd_sch_rxperf(const char *device_name, size_t channel_number,
 
   if (DEBUG)
     std::cout << "aocl_mmd_sch_rxperf\n";
+  trace_scope_t trace{"aocl_mmd_sch_rxperf", -1};
 
   return libbitt.aocl_mmd_sch_rxperf(device_name, channel_number, param_value);
 }
@@ -586,6 +1473,7 @@ int aocl_mmd_sch_txperf(const char *device_name, size_t channel_number,
 
   if (DEBUG)
     std::cout << "aocl_mmd_sch_txperf\n";
+  trace_scope_t trace{"aocl_mmd_sch_txperf", -1};
 
   return libbitt.aocl_mmd_sch_txperf(device_name, channel_number, param_value);
 }
@@ -597,26 +1485,19 @@ int aocl_mmd_card_info(const char *device_name,
 
   if (DEBUG)
     std::cout << "aocl_mmd_card_info\n";
+  trace_scope_t trace{"aocl_mmd_card_info", -1};
 
   return libbitt.aocl_mmd_card_info(device_name, requested_info_id,
                                     param_value_size, param_value,
                                     param_size_ret);
 }
 
-int aocl_mmd_set_device_interrupt_handler(
-    int handle, aocl_mmd_device_interrupt_handler_fn fn, void *user_data) {
-
-  if (DEBUG)
-    std::cout << "aocl_mmd_set_device_interrupt_handler\n";
-
-  return libbitt.aocl_mmd_set_device_interrupt_handler(handle, fn, user_data);
-}
-
 int aocl_mmd_hostchannel_create(int handle, char *channel_name,
                                 size_t queue_depth, int direction) {
 
   if (DEBUG)
     std::cout << "aocl_mmd_hostchannel_create\n";
+  trace_scope_t trace{"aocl_mmd_hostchannel_create", handle, -1, queue_depth};
 
   return libbitt.aocl_mmd_hostchannel_create(handle, channel_name, queue_depth,
                                              direction);
@@ -626,6 +1507,7 @@ int aocl_mmd_hostchannel_destroy(int handle, int channel) {
 
   if (DEBUG)
     std::cout << "aocl_mmd_hostchannel_destroy\n";
+  trace_scope_t trace{"aocl_mmd_hostchannel_destroy", handle, channel};
 
   return libbitt.aocl_mmd_hostchannel_destroy(handle, channel);
 }
@@ -635,6 +1517,7 @@ void *aocl_mmd_hostchannel_get_buffer(int handle, int channel,
 
   if (DEBUG)
     std::cout << "aocl_mmd_hostchannel_get_buffer\n";
+  trace_scope_t trace{"aocl_mmd_hostchannel_get_buffer", handle, channel};
 
   return libbitt.aocl_mmd_hostchannel_get_buffer(handle, channel, buffer_size,
                                                  status);
@@ -645,41 +1528,9 @@ size_t aocl_mmd_hostchannel_ack_buffer(int handle, int channel,
 
   if (DEBUG)
     std::cout << "aocl_mmd_hostchannel_ack_buffer\n";
+  trace_scope_t trace{"aocl_mmd_hostchannel_ack_buffer",
+                      handle, channel, send_size};
 
   return libbitt.aocl_mmd_hostchannel_ack_buffer(handle, channel, send_size,
                                                  status);
 }
-
-void *aocl_mmd_shared_mem_alloc(int handle, size_t size,
-                                unsigned long long *device_ptr_out) {
-
-  if (DEBUG)
-    std::cout << "aocl_mmd_shared_mem_alloc\n";
-
-  return libbitt.aocl_mmd_shared_mem_alloc(handle, size, device_ptr_out);
-}
-
-void aocl_mmd_shared_mem_free(int handle, void *host_ptr, size_t size) {
-
-  if (DEBUG)
-    std::cout << "aocl_mmd_shared_mem_free\n";
-
-  return libbitt.aocl_mmd_shared_mem_free(handle, host_ptr, size);
-}
-
-/*
- * Must not be implemented for MMD versions 18.1 and newer. Otherwise the
- * following error is caused:
-
- * mmd program_device: aocl_mmd_reprogram is deprecated! Program with
- * aocl_mmd_program instead. Exit.
- */
-#ifdef INCLUDE_AOCL_MMD_REPROGRAM
-int aocl_mmd_reprogram(int handle, void *user_data, size_t size) {
-
-  if (DEBUG)
-    std::cout << "aocl_mmd_reprogram\n";
-
-  return libbitt.aocl_mmd_reprogram(handle, user_data, size);
-}
-#endif
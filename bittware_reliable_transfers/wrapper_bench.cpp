@@ -0,0 +1,419 @@
+/*
+ * Overhead benchmark of the wrapper against the mock MMD library.
+ *
+ * The benchmark links the wrapper, built with BSP pointing at the mock
+ * library, and loads the mock library a second time by name to call it
+ * directly. Both end up in the same mock instance, so every configuration is
+ * run back to back against the bare mock ("direct") and through the wrapper
+ * ("wrapped"). For each transfer size, blocking and non-blocking reads,
+ * fresh and reused buffers, and each thread count, it reports the read
+ * throughput, the median and 99th percentile latency of a read, and the
+ * throughput lost to the wrapper.
+ *
+ * The mock library is configured through its environment variables, e.g.
+ * MOCK_MMD_BANDWIDTH to simulate a PCIe link and MOCK_MMD_DROP_RATE to have
+ * the wrapper repair transfers. The wrapper reads its usual BITTFIX_*
+ * variables.
+ *
+ * With a drop rate, every read through the wrapper is checked against the
+ * mock's pattern, sampling the first and last bytes of each page, and the
+ * benchmark fails if any of them was not repaired. The wrapper reads its
+ * variables once at load time, so paths other than the default one are run
+ * in a copy of the benchmark with the variable that enables them set.
+ *
+ * Usage: wrapper_bench [-s MiB,...] [-t threads,...] [-d depth] [-b MiB]
+ *                      [-p path,...]
+ *   -s  transfer sizes (default: 1,16,256)
+ *   -t  thread counts (default: 1,2,4)
+ *   -d  non-blocking reads in flight per thread (default: 4)
+ *   -b  bytes read per configuration and backend (default: 1024)
+ *   -p  wrapper paths: default, chunked (1 MiB chunks) and bounced (4
+ *       staging buffers) (default: all with a drop rate, otherwise default)
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <dlfcn.h>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include <aocl_mmd.h>
+
+#include "mock_mmd.hpp"
+
+#define xstr(s) str(s)
+#define str(s) #s
+
+#ifndef MOCK_MMD
+#error "Cannot build without knowing the mock library. Set MOCK_MMD variable."
+#endif
+
+constexpr size_t MiB{1 << 20};
+
+using bench_clock = std::chrono::steady_clock;
+
+typedef struct {
+  const char *name;
+  decltype(aocl_mmd_open) *open;
+  decltype(aocl_mmd_set_status_handler) *set_status_handler;
+  decltype(aocl_mmd_read) *read;
+  // whether delivered data is checked
+  bool verified;
+} backend_t;
+
+typedef struct {
+  const char *name;
+  // enables the path in the wrapper, nullptr for the default path
+  const char *variable;
+  const char *value;
+} wrapper_path_t;
+
+static const wrapper_path_t wrapper_paths[] = {
+    {"default", nullptr, nullptr},
+    {"chunked", "BITTFIX_CHUNK_SIZE", "1048576"},
+    {"bounced", "BITTFIX_BOUNCE_BUFFERS", "4"},
+};
+
+// set in the copies of the benchmark that run another path
+constexpr const char *PATH_VARIABLE{"WRAPPER_BENCH_PATH"};
+
+typedef struct {
+  std::atomic<bool> done;
+  bench_clock::time_point issued;
+  bench_clock::time_point completed;
+} bench_op_t;
+
+typedef struct {
+  size_t size;
+  bool blocking;
+  bool fresh;
+  unsigned threads;
+  size_t depth;
+  size_t bytes;
+} bench_config_t;
+
+typedef struct {
+  double gib_per_s;
+  double p50_us, p99_us;
+} bench_result_t;
+
+static std::atomic<uint64_t> corrupted_reads{0};
+
+// Returns false if a page of `buf` does not start and end with the mock's
+// pattern, i.e. the wrapper left it unrepaired or filled it from the wrong
+// place.
+static bool delivered_intact(const void *buf, size_t size) {
+  constexpr size_t SAMPLE{8};
+  const unsigned char *bytes = static_cast<const unsigned char *>(buf);
+  for (size_t page = 0; page < size; page += MOCK_MMD_PATTERN_PAGE_SIZE) {
+    const size_t last =
+        std::min(page + MOCK_MMD_PATTERN_PAGE_SIZE, size) - SAMPLE;
+    for (size_t i = 0; i < SAMPLE; i++) {
+      if (bytes[page + i] != mock_mmd_pattern(page + i) ||
+          bytes[last + i] != mock_mmd_pattern(last + i)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+static void status_handler(int handle, void *user_data, aocl_mmd_op_t op,
+                           int status) {
+  bench_op_t *bench_op = static_cast<bench_op_t *>(op);
+  bench_op->completed = bench_clock::now();
+  bench_op->done.store(true, std::memory_order_release);
+}
+
+static void *map_buffer(size_t size) {
+  void *buf = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf == MAP_FAILED) {
+    std::cerr << "Could not allocate " << size << " bytes.\n";
+    exit(1);
+  }
+  return buf;
+}
+
+// Issues `reads` reads of one thread and returns their latencies in us.
+static std::vector<double> run_thread(const backend_t &backend, int handle,
+                                      const bench_config_t &config,
+                                      size_t reads) {
+  const size_t slots = config.blocking ? 1 : config.depth;
+  std::vector<void *> buffers(slots, nullptr);
+  std::vector<bench_op_t> ops(slots);
+  std::vector<double> latencies{};
+  latencies.reserve(reads);
+
+  auto retire = [&](size_t slot) {
+    bench_op_t &op = ops[slot];
+    while (!op.done.load(std::memory_order_acquire)) {
+      std::this_thread::yield();
+    }
+    latencies.push_back(
+        std::chrono::duration<double, std::micro>(op.completed - op.issued)
+            .count());
+    if (backend.verified && !delivered_intact(buffers[slot], config.size)) {
+      corrupted_reads.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (config.fresh) {
+      munmap(buffers[slot], config.size);
+      buffers[slot] = nullptr;
+    }
+  };
+
+  if (!config.fresh) {
+    for (auto &buf : buffers) {
+      buf = map_buffer(config.size);
+    }
+  }
+
+  for (size_t i = 0; i < reads; i++) {
+    const size_t slot = i % slots;
+    bench_op_t &op = ops[slot];
+    if (i >= slots && !config.blocking) {
+      retire(slot);
+    }
+    if (config.fresh) {
+      buffers[slot] = map_buffer(config.size);
+    }
+
+    op.done.store(false);
+    op.issued = bench_clock::now();
+    if (config.blocking) {
+      backend.read(handle, nullptr, config.size, buffers[slot],
+                   MOCK_MMD_GMEM_INTERFACE, 0);
+      op.completed = bench_clock::now();
+      op.done.store(true);
+      retire(slot);
+    } else {
+      backend.read(handle, &op, config.size, buffers[slot],
+                   MOCK_MMD_GMEM_INTERFACE, 0);
+    }
+  }
+
+  if (!config.blocking) {
+    for (size_t i = reads > slots ? reads - slots : 0; i < reads; i++) {
+      retire(i % slots);
+    }
+  }
+  if (!config.fresh) {
+    for (auto buf : buffers) {
+      munmap(buf, config.size);
+    }
+  }
+  return latencies;
+}
+
+static bench_result_t run(const backend_t &backend, int handle,
+                          const bench_config_t &config) {
+  backend.set_status_handler(handle, status_handler, nullptr);
+  const size_t reads = std::max<size_t>(
+      config.bytes / config.size / config.threads, 2 * config.depth);
+
+  std::vector<std::vector<double>> latencies(config.threads);
+  std::vector<std::thread> threads{};
+  const auto start = bench_clock::now();
+  for (unsigned t = 0; t < config.threads; t++) {
+    threads.emplace_back([&, t] {
+      latencies[t] = run_thread(backend, handle, config, reads);
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  const double seconds =
+      std::chrono::duration<double>(bench_clock::now() - start).count();
+
+  std::vector<double> all{};
+  for (const auto &thread_latencies : latencies) {
+    all.insert(all.end(), thread_latencies.begin(), thread_latencies.end());
+  }
+  std::sort(all.begin(), all.end());
+
+  bench_result_t result{};
+  result.gib_per_s =
+      static_cast<double>(reads * config.threads * config.size) / seconds /
+      static_cast<double>(1 << 30);
+  result.p50_us = all[all.size() / 2];
+  result.p99_us = all[all.size() * 99 / 100];
+  return result;
+}
+
+static std::vector<unsigned long> parse_list(const char *list) {
+  std::vector<unsigned long> values{};
+  std::istringstream entries{list};
+  std::string entry;
+  while (std::getline(entries, entry, ',')) {
+    if (const unsigned long value = std::strtoul(entry.c_str(), nullptr, 10)) {
+      values.push_back(value);
+    }
+  }
+  return values;
+}
+
+// Runs the benchmark on the path the wrapper was loaded with. Returns false
+// if a read through the wrapper delivered corrupted data.
+static bool run_default_path(const std::vector<unsigned long> &sizes,
+                             const std::vector<unsigned long> &thread_counts,
+                             size_t depth, size_t bytes, bool verify) {
+  void *mock = dlopen(xstr(MOCK_MMD), RTLD_NOW | RTLD_LOCAL);
+  if (!mock) {
+    std::cerr << "Could not load " << xstr(MOCK_MMD) << ": " << dlerror()
+              << "\n";
+    return false;
+  }
+  const backend_t direct{
+      "direct",
+      reinterpret_cast<decltype(aocl_mmd_open) *>(dlsym(mock, "aocl_mmd_open")),
+      reinterpret_cast<decltype(aocl_mmd_set_status_handler) *>(
+          dlsym(mock, "aocl_mmd_set_status_handler")),
+      reinterpret_cast<decltype(aocl_mmd_read) *>(
+          dlsym(mock, "aocl_mmd_read")),
+      false};
+  const backend_t wrapped{"wrapped", aocl_mmd_open,
+                          aocl_mmd_set_status_handler, aocl_mmd_read, verify};
+
+  // opening through the wrapper lets it learn the gmem interface
+  const int handle = wrapped.open("acl0");
+  if (handle < 0 || direct.open("acl0") != handle) {
+    std::cerr << "Could not open mock device.\n";
+    return false;
+  }
+
+  std::cout << std::setw(9) << "size" << std::setw(13) << "mode"
+            << std::setw(8) << "buffers" << std::setw(8) << "threads"
+            << std::setw(22) << "GiB/s direct/wrapped" << std::setw(10)
+            << "overhead" << std::setw(24) << "p50 us direct/wrapped"
+            << std::setw(24) << "p99 us direct/wrapped" << "\n";
+  std::cout << std::fixed;
+
+  for (const auto size : sizes) {
+    for (const bool blocking : {true, false}) {
+      for (const bool fresh : {false, true}) {
+        for (const auto threads : thread_counts) {
+          const bench_config_t config{size * MiB,
+                                      blocking,
+                                      fresh,
+                                      static_cast<unsigned>(threads),
+                                      depth,
+                                      bytes};
+          const bench_result_t d = run(direct, handle, config);
+          const bench_result_t w = run(wrapped, handle, config);
+          std::cout << std::setw(5) << size << " MiB" << std::setw(13)
+                    << (blocking ? "blocking" : "non-blocking") << std::setw(8)
+                    << (fresh ? "fresh" : "reused") << std::setw(8) << threads
+                    << std::setprecision(2) << std::setw(13) << d.gib_per_s
+                    << " / " << std::setw(6) << w.gib_per_s << std::setw(9)
+                    << (1 - w.gib_per_s / d.gib_per_s) * 100 << "%"
+                    << std::setprecision(0) << std::setw(15) << d.p50_us
+                    << " / " << std::setw(6) << w.p50_us << std::setw(15)
+                    << d.p99_us << " / " << std::setw(6) << w.p99_us << "\n";
+        }
+      }
+    }
+  }
+
+  const auto dropped_pages =
+      reinterpret_cast<decltype(mock_mmd_dropped_pages) *>(
+          dlsym(mock, "mock_mmd_dropped_pages"));
+  std::cout << "Pages dropped by the mock: " << dropped_pages() << "\n";
+  if (verify) {
+    std::cout << "Reads through the wrapper with corrupted data: "
+              << corrupted_reads.load() << "\n";
+  }
+  return !corrupted_reads.load();
+}
+
+// Runs the benchmark again with `path` enabled in the wrapper. Returns true
+// if it succeeded.
+static bool run_path(const wrapper_path_t &path, char **argv) {
+  std::cout << "\nWrapper path: " << path.name << " (" << path.variable << "="
+            << path.value << ")\n"
+            << std::flush;
+  const pid_t pid = fork();
+  if (pid == 0) {
+    setenv(path.variable, path.value, 1);
+    setenv(PATH_VARIABLE, path.name, 1);
+    execv("/proc/self/exe", argv);
+    std::cerr << "Could not run the benchmark again.\n";
+    _exit(1);
+  }
+  int status{0};
+  return pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+         WEXITSTATUS(status) == 0;
+}
+
+int main(int argc, char **argv) {
+  std::vector<unsigned long> sizes{1, 16, 256};
+  std::vector<unsigned long> thread_counts{1, 2, 4};
+  size_t depth{4};
+  size_t bytes{1024 * MiB};
+  const char *drop_rate = getenv("MOCK_MMD_DROP_RATE");
+  const bool verify = drop_rate && std::strtod(drop_rate, nullptr) > 0;
+  std::string paths{verify ? "default,chunked,bounced" : "default"};
+  bool usage = argc % 2 == 0;
+  for (int i = 1; !usage && i + 1 < argc; i += 2) {
+    if (!strcmp(argv[i], "-p")) {
+      paths = argv[i + 1];
+    } else if (!strcmp(argv[i], "-s")) {
+      sizes = parse_list(argv[i + 1]);
+    } else if (!strcmp(argv[i], "-t")) {
+      thread_counts = parse_list(argv[i + 1]);
+    } else if (!strcmp(argv[i], "-d")) {
+      depth = std::max(1ul, std::strtoul(argv[i + 1], nullptr, 10));
+    } else if (!strcmp(argv[i], "-b")) {
+      bytes = std::strtoul(argv[i + 1], nullptr, 10) * MiB;
+    } else {
+      usage = true;
+    }
+  }
+  if (usage || sizes.empty() || thread_counts.empty() || !bytes) {
+    std::cerr << "Usage: " << argv[0]
+              << " [-s MiB,...] [-t threads,...] [-d depth] [-b MiB]"
+                 " [-p path,...]\n";
+    return 1;
+  }
+
+  // a copy only runs its own path
+  const char *own_path = getenv(PATH_VARIABLE);
+  bool run_default = own_path != nullptr;
+  std::vector<const wrapper_path_t *> other_paths{};
+  std::istringstream entries{paths};
+  std::string entry;
+  while (!own_path && std::getline(entries, entry, ',')) {
+    const wrapper_path_t *path = nullptr;
+    for (const auto &candidate : wrapper_paths) {
+      if (entry == candidate.name) {
+        path = &candidate;
+      }
+    }
+    if (!path) {
+      std::cerr << "Unknown wrapper path " << entry << ".\n";
+      return 1;
+    }
+    if (path->variable) {
+      other_paths.push_back(path);
+    } else {
+      run_default = true;
+    }
+  }
+
+  bool passed = !run_default ||
+                run_default_path(sizes, thread_counts, depth, bytes, verify);
+  for (const auto *path : other_paths) {
+    passed &= run_path(*path, argv);
+  }
+  return passed ? 0 : 1;
+}
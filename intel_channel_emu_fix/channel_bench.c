@@ -0,0 +1,297 @@
+/*
+ * Throughput and latency benchmark of emulated I/O channels, driving the
+ * kernels of the stand-in emulator library (standin.c). Run it with
+ * wrapper.so preloaded, see `make bench`.
+ *
+ * Each run connects producer and consumer kernels, one thread each, through
+ * channel files in a temporary directory:
+ *   pairs   `c` producers, each feeding its own consumer
+ *   fanin   `c` producers feeding one consumer that polls all channels
+ *           with non-blocking reads
+ *   fanout  one producer feeding `c` consumers in turn
+ *   idle    like fanin, but the consumer also polls a channel that never
+ *           gets any data
+ *   slow    like pairs, but each producer sends an element every 10 ms, so
+ *           the consumers' blocking reads mostly wait on an idle channel
+ * Every producer sends `n` elements per channel (at most 50 for slow), each
+ * stamped with its send time. For each pattern, channel count and element
+ * size, the benchmark reports the elements per second over all channels, the
+ * median and 99th percentile latency from writing an element to reading it,
+ * and the CPU time of all consumers.
+ *
+ * Usage: channel_bench [-p pattern,...] [-c channels,...] [-s bytes,...]
+ *                      [-n elements]
+ *   -p  patterns (default: pairs,fanin,fanout,idle,slow)
+ *   -c  channel counts (default: 1,4)
+ *   -s  element sizes, at least 16 (default: 16,64,1024)
+ *   -n  elements per channel (default: 100000)
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_LIST 16
+#define MAX_CHANNELS 64
+#define SLOW_ELEMENTS 50
+#define SLOW_INTERVAL_NS 10000000
+
+// from libOclCpuBackEnd_emu.so (standin.c)
+FILE *emu_channel_open(const char *path, bool write);
+void emu_channel_close(FILE *channel);
+void emu_write_channel(FILE *channel, const void *data, size_t size);
+bool emu_read_channel_nb(FILE *channel, void *data, size_t size);
+void emu_read_channel(FILE *channel, void *data, size_t size);
+
+typedef enum {
+  PATTERN_PAIRS,
+  PATTERN_FANIN,
+  PATTERN_FANOUT,
+  PATTERN_IDLE,
+  PATTERN_SLOW,
+} pattern_t;
+
+#define PATTERN_COUNT 5
+
+static const char *pattern_names[] = {"pairs", "fanin", "fanout", "idle",
+                                      "slow"};
+
+typedef struct {
+  uint64_t sequence;
+  uint64_t sent_ns;
+} element_header_t;
+
+// A kernel and the channels it writes or reads in turn.
+typedef struct {
+  FILE **channels;
+  int channel_count;
+  size_t element_size;
+  size_t elements;
+  // consumers only, one per element
+  uint64_t *latencies;
+  bool polling;
+  // producers only, pause between elements
+  uint64_t interval_ns;
+  bool ok;
+  uint64_t cpu_ns;
+} kernel_t;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *produce(void *arg) {
+  kernel_t *kernel = arg;
+  unsigned char *element = calloc(1, kernel->element_size);
+  for (size_t i = 0; i < kernel->elements; i++) {
+    if (kernel->interval_ns) {
+      const struct timespec pause = {kernel->interval_ns / 1000000000,
+                                     kernel->interval_ns % 1000000000};
+      nanosleep(&pause, NULL);
+    }
+    const element_header_t header = {i / kernel->channel_count, now_ns()};
+    memcpy(element, &header, sizeof(header));
+    emu_write_channel(kernel->channels[i % kernel->channel_count], element,
+                      kernel->element_size);
+  }
+  free(element);
+  return NULL;
+}
+
+static void *consume(void *arg) {
+  kernel_t *kernel = arg;
+  unsigned char *element = malloc(kernel->element_size);
+  uint64_t expected[MAX_CHANNELS + 1] = {0};
+  kernel->ok = true;
+  int next = 0;
+  for (size_t i = 0; i < kernel->elements;) {
+    const int channel = next;
+    next = (next + 1) % kernel->channel_count;
+    if (kernel->polling) {
+      if (!emu_read_channel_nb(kernel->channels[channel], element,
+                               kernel->element_size)) {
+        continue;
+      }
+    } else {
+      emu_read_channel(kernel->channels[channel], element,
+                       kernel->element_size);
+    }
+    element_header_t header;
+    memcpy(&header, element, sizeof(header));
+    kernel->latencies[i++] = now_ns() - header.sent_ns;
+    kernel->ok &= header.sequence == expected[channel]++;
+  }
+  struct timespec cpu;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+  kernel->cpu_ns = (uint64_t)cpu.tv_sec * 1000000000 + cpu.tv_nsec;
+  free(element);
+  return NULL;
+}
+
+static int compare_u64(const void *a, const void *b) {
+  const uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static bool run(const char *directory, int run_id, pattern_t pattern,
+                int channel_count, size_t element_size, size_t elements) {
+  FILE *writers[MAX_CHANNELS + 1], *readers[MAX_CHANNELS + 1];
+  char paths[MAX_CHANNELS + 1][256];
+  // the idle channel comes last and has no producer
+  const int opened = channel_count + (pattern == PATTERN_IDLE);
+  // writers first, so that the files exist when readers open them
+  for (int i = 0; i < opened; i++) {
+    snprintf(paths[i], sizeof(paths[i]), "%s/run%d_ch%d", directory, run_id,
+             i);
+    writers[i] = emu_channel_open(paths[i], true);
+  }
+  for (int i = 0; i < opened; i++) {
+    readers[i] = emu_channel_open(paths[i], false);
+    if (writers[i] == NULL || readers[i] == NULL) {
+      fprintf(stderr, "Could not open channel %s.\n", paths[i]);
+      return false;
+    }
+  }
+
+  if (pattern == PATTERN_SLOW && elements > SLOW_ELEMENTS) {
+    elements = SLOW_ELEMENTS;
+  }
+  const uint64_t interval_ns = pattern == PATTERN_SLOW ? SLOW_INTERVAL_NS : 0;
+  const size_t total = elements * channel_count;
+  uint64_t *latencies = malloc(total * sizeof(uint64_t));
+  kernel_t producers[MAX_CHANNELS], consumers[MAX_CHANNELS];
+  int producer_count = 0, consumer_count = 0;
+  for (int i = 0; i < channel_count; i++) {
+    if (pattern != PATTERN_FANOUT || i == 0) {
+      const bool all = pattern == PATTERN_FANOUT;
+      producers[producer_count++] = (kernel_t){
+          all ? writers : &writers[i], all ? channel_count : 1, element_size,
+          all ? total : elements, NULL, false, interval_ns, true, 0};
+    }
+    if ((pattern != PATTERN_FANIN && pattern != PATTERN_IDLE) || i == 0) {
+      const bool all = pattern == PATTERN_FANIN || pattern == PATTERN_IDLE;
+      consumers[consumer_count] = (kernel_t){
+          all ? readers : &readers[i], all ? opened : 1, element_size,
+          all ? total : elements, &latencies[consumer_count * elements], all,
+          0, true, 0};
+      consumer_count++;
+    }
+  }
+
+  pthread_t threads[2 * MAX_CHANNELS];
+  const uint64_t start = now_ns();
+  for (int i = 0; i < consumer_count; i++) {
+    pthread_create(&threads[i], NULL, consume, &consumers[i]);
+  }
+  for (int i = 0; i < producer_count; i++) {
+    pthread_create(&threads[consumer_count + i], NULL, produce,
+                   &producers[i]);
+  }
+  for (int i = 0; i < consumer_count + producer_count; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  const double seconds = (now_ns() - start) / 1e9;
+
+  bool ok = true;
+  uint64_t cpu_ns = 0;
+  for (int i = 0; i < consumer_count; i++) {
+    ok &= consumers[i].ok;
+    cpu_ns += consumers[i].cpu_ns;
+  }
+  for (int i = 0; i < opened; i++) {
+    emu_channel_close(writers[i]);
+    emu_channel_close(readers[i]);
+    unlink(paths[i]);
+  }
+  if (!ok) {
+    fprintf(stderr, "Elements arrived out of order.\n");
+    free(latencies);
+    return false;
+  }
+
+  qsort(latencies, total, sizeof(uint64_t), compare_u64);
+  printf("%8s %9d %9zu %14.0f %10.1f %10.1f %10.1f %10.1f\n",
+         pattern_names[pattern], channel_count, element_size, total / seconds,
+         total * element_size / seconds / 1e6, latencies[total / 2] / 1e3,
+         latencies[total * 99 / 100] / 1e3, cpu_ns / 1e6);
+  free(latencies);
+  return true;
+}
+
+static int parse_list(const char *list, unsigned long *values) {
+  int count = 0;
+  const char *entry = list;
+  while (*entry && count < MAX_LIST) {
+    values[count++] = strtoul(entry, NULL, 10);
+    entry += strcspn(entry, ",");
+    entry += *entry == ',';
+  }
+  return count;
+}
+
+int main(int argc, char **argv) {
+  bool patterns[PATTERN_COUNT] = {true, true, true, true, true};
+  unsigned long channel_counts[MAX_LIST] = {1, 4};
+  unsigned long sizes[MAX_LIST] = {16, 64, 1024};
+  int channel_count_count = 2, size_count = 3;
+  size_t elements = 100000;
+  bool usage = argc % 2 == 0;
+  for (int i = 1; !usage && i + 1 < argc; i += 2) {
+    if (!strcmp(argv[i], "-p")) {
+      for (int j = 0; j < PATTERN_COUNT; j++) {
+        const char *found = strstr(argv[i + 1], pattern_names[j]);
+        patterns[j] = found != NULL;
+      }
+    } else if (!strcmp(argv[i], "-c")) {
+      channel_count_count = parse_list(argv[i + 1], channel_counts);
+    } else if (!strcmp(argv[i], "-s")) {
+      size_count = parse_list(argv[i + 1], sizes);
+    } else if (!strcmp(argv[i], "-n")) {
+      elements = strtoul(argv[i + 1], NULL, 10);
+    } else {
+      usage = true;
+    }
+  }
+  for (int i = 0; i < channel_count_count; i++) {
+    usage |= channel_counts[i] < 1 || channel_counts[i] > MAX_CHANNELS;
+  }
+  for (int i = 0; i < size_count; i++) {
+    usage |= sizes[i] < sizeof(element_header_t);
+  }
+  if (usage || !elements) {
+    fprintf(stderr,
+            "Usage: %s [-p pattern,...] [-c channels,...] [-s bytes,...] "
+            "[-n elements]\n",
+            argv[0]);
+    return 1;
+  }
+
+  char directory[] = "/tmp/channel_bench.XXXXXX";
+  if (mkdtemp(directory) == NULL) {
+    perror("Could not create a directory for the channel files");
+    return 1;
+  }
+
+  printf("%8s %9s %9s %14s %10s %10s %10s %10s\n", "pattern", "channels",
+         "bytes", "elements/s", "MB/s", "p50 us", "p99 us", "cpu ms");
+  int run_id = 0;
+  bool ok = true;
+  for (int p = 0; p < PATTERN_COUNT && ok; p++) {
+    for (int c = 0; c < channel_count_count && patterns[p] && ok; c++) {
+      for (int s = 0; s < size_count && ok; s++) {
+        ok = run(directory, run_id++, p, channel_counts[c], sizes[s],
+                 elements);
+      }
+    }
+  }
+  rmdir(directory);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,545 @@
+#define _GNU_SOURCE
+#include "channels.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "profile.h"
+#include "ring.h"
+#include "streams.h"
+
+#define MAX_CHANNELS 1024
+#define MAX_SYMLINKS 40
+
+typedef struct channel_end channel_end_t;
+
+typedef struct {
+  char path[PATH_MAX];
+  channel_end_t *reader, *writer;
+  // set once both ends were open, until both are closed again
+  atomic_bool joined;
+  // set once the writer moved away from the file
+  atomic_bool switched;
+  // where the ends meet while joined: the ring, or if the transport is off,
+  // the file `moved`, which is "" otherwise
+  ring_t ring;
+  char moved[PATH_MAX];
+  // where the last reader of `moved` stopped
+  off_t moved_position;
+  channel_profile_t *profile;
+} channel_t;
+
+// The cookie of a channel stream.
+struct channel_end {
+  channel_t *channel;
+  bool writer;
+  // the channel file, then the one the channel moved to, -1 on the ring
+  int fd;
+  // set once this end left the channel file
+  bool moved;
+  // readers only
+  file_watch_t watch;
+  // bytes passed through this end
+  off64_t position;
+  wait_policy_t wait;
+};
+
+typedef struct {
+  bool enabled;
+  size_t ring_size;
+  const char *patterns;
+  // NULL if joined channels stay in their file when the transport is off
+  const char *shm_dir;
+} config_t;
+
+static config_t config;
+static pthread_once_t configured = PTHREAD_ONCE_INIT;
+
+// Channels live until the process exits, they may still hold unread data.
+static pthread_mutex_t channels_lock = PTHREAD_MUTEX_INITIALIZER;
+static channel_t *channels[MAX_CHANNELS];
+static int channel_count;
+// holds the files of this run in shm_dir, created on first use
+static char run_dir[PATH_MAX];
+
+static void configure(void) {
+  const char *enabled = getenv("CHANFIX_RING");
+  const char *ring_size = getenv("CHANFIX_RING_SIZE");
+  config.enabled = enabled == NULL || strcmp(enabled, "0") != 0;
+  config.ring_size = ring_size ? strtoul(ring_size, NULL, 10) : 262144;
+  const long page_size = sysconf(_SC_PAGESIZE);
+  if (config.ring_size < (size_t)page_size) {
+    config.ring_size = page_size;
+  }
+  config.patterns = getenv("CHANFIX_CHANNELS");
+  const char *shm = getenv("CHANFIX_SHM");
+  const char *shm_dir = getenv("CHANFIX_SHM_DIR");
+  if (shm == NULL || strcmp(shm, "0") != 0) {
+    config.shm_dir = shm_dir ? shm_dir : "/dev/shm";
+  }
+}
+
+bool channel_path(const char *path, char *out) {
+  char current[PATH_MAX];
+  if (strlen(path) >= sizeof(current)) { // err
+    return false;
+  }
+  strcpy(current, path);
+  for (int i = 0; i < MAX_SYMLINKS; i++) {
+    char target[PATH_MAX];
+    const ssize_t len = readlink(current, target, sizeof(target) - 1);
+    if (len < 0) {
+      break;
+    }
+    target[len] = '\0';
+    if (target[0] == '/') {
+      strcpy(current, target);
+    } else {
+      char directory[PATH_MAX];
+      strcpy(directory, current);
+      char joined[2 * PATH_MAX];
+      snprintf(joined, sizeof(joined), "%s/%s", dirname(directory), target);
+      if (strlen(joined) >= sizeof(current)) { // err
+        return false;
+      }
+      strcpy(current, joined);
+    }
+  }
+
+  char directory[PATH_MAX], name[PATH_MAX], resolved[PATH_MAX];
+  strcpy(directory, current);
+  strcpy(name, current);
+  if (realpath(dirname(directory), resolved) == NULL) { // err
+    return false;
+  }
+  const char *base = basename(name);
+  return snprintf(out, PATH_MAX, "%s/%s", strcmp(resolved, "/") ? resolved : "",
+                  base) < PATH_MAX;
+}
+
+static bool matches_patterns(const char *path) {
+  if (config.patterns == NULL) {
+    return true;
+  }
+  char name[PATH_MAX];
+  strcpy(name, path);
+  const char *base = basename(name);
+  const char *pattern = config.patterns;
+  while (*pattern) {
+    const size_t len = strcspn(pattern, ",");
+    char single[PATH_MAX];
+    if (len < sizeof(single)) {
+      memcpy(single, pattern, len);
+      single[len] = '\0';
+      if (fnmatch(single, base, 0) == 0) {
+        return true;
+      }
+    }
+    pattern += len + (pattern[len] == ',');
+  }
+  return false;
+}
+
+// Must be called with channels_lock held.
+static channel_t *find_channel(const char *path) {
+  for (int i = 0; i < channel_count; i++) {
+    if (strcmp(channels[i]->path, path) == 0) {
+      return channels[i];
+    }
+  }
+  return NULL;
+}
+
+// Must be called with channels_lock held.
+static channel_t *create_channel(const char *path) {
+  if (channel_count == MAX_CHANNELS) { // err
+    return NULL;
+  }
+  // the ring's members are aligned to cache lines
+  channel_t *channel = aligned_alloc(_Alignof(channel_t), sizeof(channel_t));
+  if (channel == NULL) { // err
+    return NULL;
+  }
+  memset(channel, 0, sizeof(channel_t));
+  strcpy(channel->path, path);
+  atomic_init(&channel->joined, false);
+  atomic_init(&channel->switched, false);
+  channel->profile = profile_channel(path, true);
+  channels[channel_count++] = channel;
+  return channel;
+}
+
+static void remove_moved_files(void) {
+  pthread_mutex_lock(&channels_lock);
+  for (int i = 0; i < channel_count; i++) {
+    if (channels[i]->moved[0]) {
+      unlink(channels[i]->moved);
+    }
+  }
+  rmdir(run_dir);
+  pthread_mutex_unlock(&channels_lock);
+}
+
+// FNV-1a, to keep names within NAME_MAX however deep the channel lies
+static uint64_t hash_path(const char *path) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (; *path; path++) {
+    hash = (hash ^ (unsigned char)*path) * 0x100000001b3ull;
+  }
+  return hash;
+}
+
+// Must be called with channels_lock held. Creates `moved` in a directory
+// only this user can enter, so no other file can take its place.
+static bool create_moved_file(channel_t *channel) {
+  char name[PATH_MAX];
+  if (run_dir[0] == '\0') {
+    if (snprintf(name, sizeof(name), "%s/chanfix.XXXXXX", config.shm_dir) >=
+            (int)sizeof(name) ||
+        mkdtemp(name) == NULL) { // err
+      fprintf(stderr,
+              "PC2 WARNING: Could not create a directory in %s, using "
+              "channel files.\n",
+              config.shm_dir);
+      return false;
+    }
+    strcpy(run_dir, name);
+    atexit(remove_moved_files);
+  }
+  strcpy(name, channel->path);
+  int fd = -1;
+  if (snprintf(channel->moved, PATH_MAX, "%s/%016llx.%.64s", run_dir,
+               (unsigned long long)hash_path(channel->path),
+               basename(name)) < PATH_MAX) {
+    fd = open(channel->moved,
+              O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+  }
+  if (fd < 0) { // err
+    fprintf(stderr, "PC2 WARNING: Could not move channel %s to %s.\n",
+            channel->path, run_dir);
+    channel->moved[0] = '\0';
+    return false;
+  }
+  close(fd);
+  channel->moved_position = 0;
+  return true;
+}
+
+// Must be called with channels_lock held. Frees what the ends met in.
+static void part_channel(channel_t *channel) {
+  if (channel->moved[0]) {
+    unlink(channel->moved);
+    channel->moved[0] = '\0';
+  } else {
+    ring_destroy(&channel->ring);
+  }
+}
+
+// Opens the file the channel moved to for an end. Readers continue where the
+// last one stopped.
+static int open_moved(channel_t *channel, bool writer) {
+  if (writer) {
+    return open(channel->moved, O_WRONLY | O_APPEND | O_NOFOLLOW | O_CLOEXEC);
+  }
+  const int fd = open(channel->moved, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd >= 0 &&
+      lseek(fd, channel->moved_position, SEEK_SET) < 0) { // err
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Opens the channel file like fopen with `mode` would.
+static int open_file(const char *pathname, const char *mode) {
+  int flags = mode[0] == 'r'   ? O_RDONLY
+              : mode[0] == 'w' ? O_WRONLY | O_CREAT | O_TRUNC
+                               : O_WRONLY | O_CREAT | O_APPEND;
+  if (strchr(mode, 'x')) {
+    flags |= O_EXCL;
+  }
+  if (strchr(mode, 'e')) {
+    flags |= O_CLOEXEC;
+  }
+  return open(pathname, flags, 0666);
+}
+
+static ssize_t read_fd(int fd, char *buf, size_t size) {
+  ssize_t done;
+  while ((done = read(fd, buf, size)) < 0 && errno == EINTR) {
+  }
+  return done;
+}
+
+// Leaves the drained channel file for where the writer moved.
+static void follow_writer(channel_end_t *end) {
+  channel_t *channel = end->channel;
+  close(end->fd);
+  file_watch_destroy(&end->watch);
+  end->moved = true;
+  end->fd = channel->moved[0] ? open_moved(channel, false) : -1;
+  if (end->fd >= 0) {
+    file_watch_init(&end->watch, channel->moved);
+  }
+}
+
+// Reads the channel file until the writer moved and the file is drained, then
+// follows the writer. Reads the file the channel moved to the same way.
+static ssize_t read_file(channel_end_t *end, char *buf, size_t size) {
+  ssize_t done = read_fd(end->fd, buf, size);
+  if (done) {
+    return done;
+  }
+  if (!end->moved &&
+      atomic_load_explicit(&end->channel->switched, memory_order_acquire)) {
+    // everything the writer wrote to the file is in there now
+    done = read_fd(end->fd, buf, size);
+    if (!done) {
+      follow_writer(end);
+    }
+    return done;
+  }
+  return file_watch_wait(&end->watch, end->fd, &end->wait)
+             ? read_fd(end->fd, buf, size)
+             : 0;
+}
+
+static ssize_t channel_read(void *cookie, char *buf, size_t size) {
+  channel_end_t *end = cookie;
+  ssize_t done = 0;
+  if (!end->moved) {
+    done = read_file(end, buf, size);
+  }
+  if (end->moved && end->channel->moved[0]) {
+    done = read_file(end, buf, size);
+  } else if (end->moved) {
+    done = ring_read(&end->channel->ring, buf, size, &end->wait);
+  }
+  if (done > 0) {
+    end->position += done;
+  }
+  return done;
+}
+
+static ssize_t write_fd(int fd, const char *buf, size_t size) {
+  size_t done = 0;
+  while (done < size) {
+    const ssize_t part = write(fd, buf + done, size - done);
+    if (part < 0 && errno != EINTR) { // err
+      return done ? (ssize_t)done : -1;
+    }
+    done += part > 0 ? part : 0;
+  }
+  return done;
+}
+
+static ssize_t channel_write(void *cookie, const char *buf, size_t size) {
+  channel_end_t *end = cookie;
+  channel_t *channel = end->channel;
+  if (!end->moved &&
+      atomic_load_explicit(&channel->joined, memory_order_acquire)) {
+    // the reader drains the file before it follows, set before the close
+    // wakes the reader
+    atomic_store_explicit(&channel->switched, true, memory_order_release);
+    close(end->fd);
+    end->moved = true;
+    end->fd = channel->moved[0] ? open_moved(channel, true) : -1;
+  }
+
+  ssize_t done;
+  if (!end->moved || channel->moved[0]) {
+    done = write_fd(end->fd, buf, size);
+  } else {
+    done = ring_write(&channel->ring, buf, size);
+    if ((size_t)done < size) { // err
+      errno = ENOMEM;
+      done = done ? done : -1;
+    }
+  }
+  if (done > 0) {
+    end->position += done;
+  }
+  return done;
+}
+
+// Only seeks that stay in place succeed, such as those that reset the end of
+// file indicator.
+static int channel_seek(void *cookie, off64_t *offset, int whence) {
+  channel_end_t *end = cookie;
+  if ((whence == SEEK_CUR && *offset == 0) ||
+      (whence == SEEK_SET && *offset == end->position)) {
+    *offset = end->position;
+    return 0;
+  }
+  errno = ESPIPE;
+  return -1;
+}
+
+static int channel_close(void *cookie) {
+  channel_end_t *end = cookie;
+  channel_t *channel = end->channel;
+  pthread_mutex_lock(&channels_lock);
+  const bool joined =
+      atomic_load_explicit(&channel->joined, memory_order_relaxed);
+  if (end->writer && joined) {
+    // nothing more is written to the file, set before the close wakes the
+    // reader
+    atomic_store_explicit(&channel->switched, true, memory_order_release);
+  }
+  if (end->fd >= 0) {
+    if (end->moved && !end->writer) {
+      channel->moved_position = lseek(end->fd, 0, SEEK_CUR);
+    }
+    close(end->fd);
+  }
+  file_watch_destroy(&end->watch);
+  if (end->writer) {
+    channel->writer = NULL;
+  } else {
+    channel->reader = NULL;
+  }
+  if (joined && channel->reader == NULL && channel->writer == NULL) {
+    part_channel(channel);
+    atomic_store_explicit(&channel->joined, false, memory_order_relaxed);
+    atomic_store_explicit(&channel->switched, false, memory_order_relaxed);
+  }
+  pthread_mutex_unlock(&channels_lock);
+  free(end);
+  return 0;
+}
+
+FILE *channel_open(const char *pathname, const char *mode) {
+  pthread_once(&configured, configure);
+  const bool writer = mode[0] == 'w' || mode[0] == 'a';
+  if ((!config.enabled && config.shm_dir == NULL) || strchr(mode, '+') ||
+      (!writer && mode[0] != 'r')) {
+    return NULL;
+  }
+
+  const int saved_errno = errno;
+  char path[PATH_MAX];
+  if (!channel_path(pathname, path) || !matches_patterns(path)) {
+    errno = saved_errno;
+    return NULL;
+  }
+
+  pthread_mutex_lock(&channels_lock);
+  channel_t *channel = find_channel(path);
+  if (!writer && (channel == NULL || channel->writer == NULL)) {
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size > 0) {
+      // missing, or a file prepared by the user
+      pthread_mutex_unlock(&channels_lock);
+      errno = saved_errno;
+      return NULL;
+    }
+  }
+  if (channel == NULL) {
+    channel = create_channel(path);
+  }
+  if (channel == NULL ||
+      (writer ? channel->writer : channel->reader) != NULL) {
+    fprintf(stderr,
+            "PC2 WARNING: Could not redirect channel %s, using its file.\n",
+            path);
+    pthread_mutex_unlock(&channels_lock);
+    errno = saved_errno;
+    return NULL;
+  }
+
+  // Both ends are in the emulator now, they meet in the ring, or in a file
+  // in shm_dir if the transport is off. Otherwise, the file is used until the
+  // other end opens.
+  const bool joined =
+      atomic_load_explicit(&channel->joined, memory_order_relaxed);
+  bool joining = joined || (writer ? channel->reader : channel->writer);
+  if (joining && !joined &&
+      !(config.enabled ? ring_init(&channel->ring, config.ring_size)
+                       : config.shm_dir != NULL &&
+                             create_moved_file(channel))) { // err, stay
+    joining = false;
+  }
+  // readers drain what the writer wrote to the file before it moved
+  const bool use_file =
+      !joining ||
+      (!writer && !atomic_load_explicit(&channel->switched,
+                                        memory_order_relaxed));
+  int fd = -1;
+  if (use_file || writer) {
+    fd = open_file(pathname, mode);
+    if (fd >= 0 && !use_file) {
+      // created or truncated as by fopen, but never written
+      close(fd);
+      fd = -1;
+    } else if (fd < 0) {
+      // fopen reports this again
+      if (joining && !joined) {
+        part_channel(channel);
+      }
+      pthread_mutex_unlock(&channels_lock);
+      errno = saved_errno;
+      return NULL;
+    }
+  }
+  if (!use_file && channel->moved[0]) {
+    fd = open_moved(channel, writer);
+  }
+
+  channel_end_t *end = malloc(sizeof(channel_end_t));
+  FILE *file = NULL;
+  if (end != NULL) {
+    *end = (channel_end_t){channel, writer, fd, !use_file, {-1, -1}, 0,
+                           {0, 0, false, 0}};
+    wait_policy_init(&end->wait);
+    const cookie_io_functions_t functions = {channel_read, channel_write,
+                                             channel_seek, channel_close};
+    file = fopencookie(end, writer ? "w" : "r", functions);
+  }
+  if (file == NULL) { // err
+    if (fd >= 0) {
+      close(fd);
+    }
+    if (joining && !joined) {
+      part_channel(channel);
+    }
+    free(end);
+    pthread_mutex_unlock(&channels_lock);
+    errno = saved_errno;
+    return NULL;
+  }
+  if (fd >= 0 && !writer) {
+    file_watch_init(&end->watch, use_file ? pathname : channel->moved);
+  }
+  if (writer) {
+    channel->writer = end;
+    // make every element visible to the reader right away
+    setvbuf(file, NULL, _IONBF, 0);
+  } else {
+    channel->reader = end;
+  }
+  if (joining) {
+    if (writer) {
+      // it never writes to the file
+      atomic_store_explicit(&channel->switched, true, memory_order_release);
+    }
+    atomic_store_explicit(&channel->joined, true, memory_order_release);
+  }
+  pthread_mutex_unlock(&channels_lock);
+  if (channel->profile != NULL) {
+    // counted per fread and fwrite, like channel files
+    stream_track(file, channel->profile, &end->wait);
+  }
+  errno = saved_errno;
+  return file;
+}
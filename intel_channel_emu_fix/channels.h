@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdio.h>
+
+/*
+ * In-memory transport for the files that back emulated I/O channels. Both
+ * ends of a channel run as threads of the emulating process, so instead of
+ * going through the file system, the emulator's FILE streams are replaced
+ * with fopencookie streams on a shared ring (see ring.h). The writing end is
+ * unbuffered, so every element is visible to the reader as soon as it is
+ * written, but writing it is a memcpy instead of a syscall.
+ *
+ * Channels are identified by their path with symbolic links resolved, so two
+ * names linked to the same file meet in the same channel. A channel only
+ * moves to the ring once the emulator opened both of its ends. Until then,
+ * the open end reads or writes the file, so the host can still consume the
+ * emulator's output files and feed files the emulator reads. When the other
+ * end opens, the reader drains what was written to the file so far, and the
+ * writer continues in the ring. Opens for reading (mode "r") are only
+ * redirected if the emulator writes the file or it is empty, so input files
+ * that the user prepared are still read from disk and missing files still
+ * fail to open. Each channel has at most one reader and one writer at a
+ * time. Further opens fall back to the file. The ring is unmapped once both
+ * ends are closed.
+ *
+ * A reader that finds its channel empty waits for data as described in
+ * wait.h before it sees the end of file, as it would with the file.
+ * CHANFIX_RING_SIZE sets the size of the ring's segments in bytes (default:
+ * 262144). CHANFIX_CHANNELS restricts channels to file names matching one of
+ * a comma-separated list of shell patterns. CHANFIX_RING=0 turns the
+ * transport off.
+ *
+ * With the transport off, channels whose ends are both open in the emulator
+ * move to a file in CHANFIX_SHM_DIR (default: /dev/shm) instead of the ring,
+ * so that their latency does not depend on the file system the emulation was
+ * started in. The files lie in a directory that mkdtemp creates for the run,
+ * and are removed once both ends are closed, and at exit. Files the host
+ * reads or writes, and those used through std::fstream, stay in place.
+ * CHANFIX_SHM=0 keeps joined channels in their file as well.
+ */
+
+// Returns a stream on the channel behind `pathname`, or NULL if the file
+// is not redirected.
+FILE *channel_open(const char *pathname, const char *mode);
+
+// Writes the name of the channel behind `pathname` to `path` (PATH_MAX
+// bytes): its path with symbolic links, also dangling ones, and its
+// directory resolved. The file itself does not have to exist.
+bool channel_path(const char *pathname, char *path);
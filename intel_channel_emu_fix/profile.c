@@ -0,0 +1,179 @@
+#define _GNU_SOURCE
+#include "profile.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_PROFILES 1024
+
+atomic_bool profile_enabled;
+
+static pthread_once_t configured = PTHREAD_ONCE_INIT;
+static char report_path[PATH_MAX];
+static uint64_t start_ns;
+// written to by the signal handler, read by the reporting thread
+static int report_pipe[2] = {-1, -1};
+
+// Profiles live until the process exits, so reports cover closed channels.
+static pthread_mutex_t profiles_lock = PTHREAD_MUTEX_INITIALIZER;
+static channel_profile_t *profiles[MAX_PROFILES];
+static int profile_count;
+// serializes reports from the reporting thread and at exit
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t profile_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int compare_wait(const void *a, const void *b) {
+  const uint64_t x = (*(channel_profile_t *const *)a)->read_wait_ns;
+  const uint64_t y = (*(channel_profile_t *const *)b)->read_wait_ns;
+  return (x < y) - (x > y);
+}
+
+static void write_report(void) {
+  channel_profile_t *sorted[MAX_PROFILES];
+  pthread_mutex_lock(&profiles_lock);
+  const int count = profile_count;
+  memcpy(sorted, profiles, count * sizeof(sorted[0]));
+  pthread_mutex_unlock(&profiles_lock);
+  qsort(sorted, count, sizeof(sorted[0]), compare_wait);
+
+  pthread_mutex_lock(&report_lock);
+  const bool to_stderr = strcmp(report_path, "-") == 0;
+  FILE *report = to_stderr ? stderr : fopen(report_path, "w");
+  if (report == NULL) { // err
+    fprintf(stderr, "PC2 WARNING: Could not write channel profile to %s.\n",
+            report_path);
+    pthread_mutex_unlock(&report_lock);
+    return;
+  }
+  fprintf(report, "# channel profile of process %d after %.3f s\n", getpid(),
+          (profile_now_ns() - start_ns) / 1e9);
+  fprintf(report, "%10s %10s %10s %12s %10s %10s %12s %-6s %s\n", "reads",
+          "empty", "MiB read", "ms waiting", "writes", "MiB", "ms writing",
+          "kind", "path");
+  for (int i = 0; i < count; i++) {
+    const channel_profile_t *p = sorted[i];
+    fprintf(report,
+            "%10lu %10lu %10.1f %12.1f %10lu %10.1f %12.1f %-6s %s\n",
+            (unsigned long)p->reads, (unsigned long)p->empty_reads,
+            p->read_bytes / 1048576.0, p->read_wait_ns / 1e6,
+            (unsigned long)p->writes, p->write_bytes / 1048576.0,
+            p->write_ns / 1e6, p->in_memory ? "memory" : "file", p->path);
+  }
+  if (to_stderr) {
+    fflush(report);
+  } else {
+    fclose(report);
+  }
+  pthread_mutex_unlock(&report_lock);
+}
+
+static void request_report(int signal) {
+  (void)signal;
+  const int saved_errno = errno;
+  const char byte = 0;
+  // async-signal-safe, the reporting thread does the rest
+  if (write(report_pipe[1], &byte, 1) < 0) {
+  }
+  errno = saved_errno;
+}
+
+static void *report_on_request(void *arg) {
+  (void)arg;
+  char byte;
+  for (;;) {
+    const ssize_t len = read(report_pipe[0], &byte, 1);
+    if (len > 0) {
+      write_report();
+    } else if (len == 0 || errno != EINTR) {
+      return NULL;
+    }
+  }
+}
+
+static void configure(void) {
+  const char *path = getenv("CHANFIX_PROFILE");
+  const char *signal_number = getenv("CHANFIX_PROFILE_SIGNAL");
+  if (path == NULL || !*path) {
+    return;
+  }
+  // replace "%p" by the process id
+  const char *pid_at = strstr(path, "%p");
+  if (pid_at != NULL) {
+    snprintf(report_path, sizeof(report_path), "%.*s%d%s",
+             (int)(pid_at - path), path, getpid(), pid_at + 2);
+  } else {
+    snprintf(report_path, sizeof(report_path), "%s", path);
+  }
+  start_ns = profile_now_ns();
+  atexit(write_report);
+
+  const int report_signal = signal_number ? atoi(signal_number) : SIGUSR1;
+  pthread_t reporter;
+  if (report_signal > 0 && pipe2(report_pipe, O_CLOEXEC) == 0 &&
+      pthread_create(&reporter, NULL, report_on_request, NULL) == 0) {
+    pthread_detach(reporter);
+    struct sigaction action = {0};
+    action.sa_handler = request_report;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(report_signal, &action, NULL);
+  } else if (report_signal > 0) { // err
+    fprintf(stderr, "PC2 WARNING: Channel profiles are only written at "
+                    "exit.\n");
+  }
+  atomic_store(&profile_enabled, true);
+}
+
+channel_profile_t *profile_channel(const char *path, bool in_memory) {
+  pthread_once(&configured, configure);
+  if (!atomic_load(&profile_enabled)) {
+    return NULL;
+  }
+  channel_profile_t *profile = NULL;
+  pthread_mutex_lock(&profiles_lock);
+  for (int i = 0; i < profile_count && profile == NULL; i++) {
+    if (profiles[i]->in_memory == in_memory &&
+        strcmp(profiles[i]->path, path) == 0) {
+      profile = profiles[i];
+    }
+  }
+  if (profile == NULL && profile_count < MAX_PROFILES) {
+    profile = calloc(1, sizeof(channel_profile_t));
+    if (profile != NULL) {
+      snprintf(profile->path, sizeof(profile->path), "%s", path);
+      profile->in_memory = in_memory;
+      profiles[profile_count++] = profile;
+    }
+  }
+  pthread_mutex_unlock(&profiles_lock);
+  return profile;
+}
+
+void profile_read(channel_profile_t *profile, size_t bytes, uint64_t wait_ns) {
+  atomic_fetch_add_explicit(&profile->reads, 1, memory_order_relaxed);
+  if (!bytes) {
+    atomic_fetch_add_explicit(&profile->empty_reads, 1, memory_order_relaxed);
+  }
+  atomic_fetch_add_explicit(&profile->read_bytes, bytes, memory_order_relaxed);
+  atomic_fetch_add_explicit(&profile->read_wait_ns, wait_ns,
+                            memory_order_relaxed);
+}
+
+void profile_write(channel_profile_t *profile, size_t bytes, uint64_t ns) {
+  atomic_fetch_add_explicit(&profile->writes, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&profile->write_bytes, bytes,
+                            memory_order_relaxed);
+  atomic_fetch_add_explicit(&profile->write_ns, ns, memory_order_relaxed);
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Per-channel traffic and stall profile. If CHANFIX_PROFILE names a report
+ * file ("-" for stderr, "%p" is replaced by the process id), every channel
+ * the emulator uses is counted by its path: reads, reads that found the
+ * channel empty, bytes read, time readers waited for data, writes, bytes
+ * written and time spent in writes. The report lists the channels by the
+ * time their readers waited, so the channels whose producers fall behind
+ * come first. It is written at exit and, for runs that hang, whenever the
+ * process receives CHANFIX_PROFILE_SIGNAL (default: SIGUSR1, 0 for none).
+ *
+ * Both in-memory channels and channel files are counted per fread and
+ * fwrite call. While profiling, fread and fwrite look up the stream, which
+ * costs a lock per call.
+ */
+
+typedef struct {
+  char path[PATH_MAX];
+  bool in_memory;
+  atomic_uint_fast64_t reads, empty_reads, read_bytes, read_wait_ns;
+  atomic_uint_fast64_t writes, write_bytes, write_ns;
+} channel_profile_t;
+
+extern atomic_bool profile_enabled;
+
+// Returns the profile of the channel named `path` (see channel_path),
+// created on first use, or NULL if profiling is off.
+channel_profile_t *profile_channel(const char *path, bool in_memory);
+
+void profile_read(channel_profile_t *profile, size_t bytes, uint64_t wait_ns);
+void profile_write(channel_profile_t *profile, size_t bytes, uint64_t ns);
+
+uint64_t profile_now_ns(void);
@@ -0,0 +1,185 @@
+#define _GNU_SOURCE
+#include "ring.h"
+
+#include <linux/futex.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+struct ring_segment {
+  // bytes published in `data`
+  atomic_size_t head;
+  // set once the segment is full
+  _Atomic(ring_segment_t *) next;
+  unsigned char data[];
+};
+
+static size_t capacity(const ring_t *ring) {
+  return ring->segment_size - sizeof(ring_segment_t);
+}
+
+static ring_segment_t *map_segment(ring_t *ring) {
+  ring_segment_t *segment =
+      atomic_exchange_explicit(&ring->spare, NULL, memory_order_acquire);
+  if (segment == NULL) {
+    segment = mmap(NULL, ring->segment_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (segment == MAP_FAILED) { // err
+      return NULL;
+    }
+  }
+  atomic_init(&segment->head, 0);
+  atomic_init(&segment->next, NULL);
+  return segment;
+}
+
+// Gives a drained segment back to the producer.
+static void recycle_segment(ring_t *ring, ring_segment_t *segment) {
+  ring_segment_t *old =
+      atomic_exchange_explicit(&ring->spare, segment, memory_order_acq_rel);
+  if (old != NULL) {
+    munmap(old, ring->segment_size);
+  }
+}
+
+bool ring_init(ring_t *ring, size_t segment_size) {
+  ring->segment_size = segment_size;
+  atomic_init(&ring->spare, NULL);
+  atomic_init(&ring->arrivals, 0);
+  atomic_init(&ring->waiting, false);
+  ring->write_segment = map_segment(ring);
+  ring->read_segment = ring->write_segment;
+  ring->read_offset = 0;
+  return ring->write_segment != NULL;
+}
+
+void ring_destroy(ring_t *ring) {
+  ring_segment_t *segment = ring->read_segment;
+  while (segment != NULL) {
+    ring_segment_t *next =
+        atomic_load_explicit(&segment->next, memory_order_acquire);
+    munmap(segment, ring->segment_size);
+    segment = next;
+  }
+  recycle_segment(ring, NULL);
+}
+
+size_t ring_write(ring_t *ring, const void *data, size_t len) {
+  const unsigned char *bytes = data;
+  size_t done = 0;
+  while (done < len) {
+    ring_segment_t *segment = ring->write_segment;
+    const size_t head =
+        atomic_load_explicit(&segment->head, memory_order_relaxed);
+    const size_t room = capacity(ring) - head;
+    // Writes that fit into a segment are published in one piece, so a reader
+    // never sees part of an element. The rest of the segment stays unused.
+    if (room == 0 || (len - done > room && len - done <= capacity(ring))) {
+      ring_segment_t *next = map_segment(ring);
+      if (next == NULL) { // err
+        break;
+      }
+      atomic_store_explicit(&segment->next, next, memory_order_release);
+      ring->write_segment = next;
+      continue;
+    }
+    const size_t part = len - done < room ? len - done : room;
+    memcpy(segment->data + head, bytes + done, part);
+    atomic_store_explicit(&segment->head, head + part, memory_order_release);
+    done += part;
+  }
+
+  // pairs with the fence in ring_read
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&ring->waiting, memory_order_relaxed)) {
+    atomic_fetch_add_explicit(&ring->arrivals, 1, memory_order_relaxed);
+    syscall(SYS_futex, &ring->arrivals, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+  }
+  return done;
+}
+
+static size_t read_available(ring_t *ring, unsigned char *bytes, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    ring_segment_t *segment = ring->read_segment;
+    size_t head = atomic_load_explicit(&segment->head, memory_order_acquire);
+    if (head == ring->read_offset) {
+      ring_segment_t *next =
+          atomic_load_explicit(&segment->next, memory_order_acquire);
+      if (next == NULL) {
+        break;
+      }
+      // the producer moved on, so the head is final now
+      head = atomic_load_explicit(&segment->head, memory_order_relaxed);
+      if (head == ring->read_offset) {
+        ring->read_segment = next;
+        ring->read_offset = 0;
+        recycle_segment(ring, segment);
+        continue;
+      }
+    }
+    const size_t part =
+        len - done < head - ring->read_offset ? len - done
+                                              : head - ring->read_offset;
+    memcpy(bytes + done, segment->data + ring->read_offset, part);
+    ring->read_offset += part;
+    done += part;
+  }
+  return done;
+}
+
+// Sleeps until the producer wakes the consumer or the policy's timeout.
+static size_t block(ring_t *ring, unsigned char *data, size_t len,
+                    wait_policy_t *policy) {
+  size_t done;
+  const unsigned arrivals =
+      atomic_load_explicit(&ring->arrivals, memory_order_relaxed);
+  atomic_store_explicit(&ring->waiting, true, memory_order_relaxed);
+  // pairs with the fence in ring_write
+  atomic_thread_fence(memory_order_seq_cst);
+  done = read_available(ring, data, len);
+  if (!done) {
+    const struct timespec timeout = {policy->block_ns / 1000000000,
+                                     policy->block_ns % 1000000000};
+    syscall(SYS_futex, &ring->arrivals, FUTEX_WAIT_PRIVATE, arrivals,
+            &timeout, NULL, 0);
+    done = read_available(ring, data, len);
+  }
+  atomic_store_explicit(&ring->waiting, false, memory_order_relaxed);
+  wait_policy_update(policy, done ? WAIT_WOKEN : WAIT_TIMED_OUT);
+  return done;
+}
+
+size_t ring_read(ring_t *ring, void *data, size_t len, wait_policy_t *policy) {
+  size_t done = read_available(ring, data, len);
+  if (policy == NULL) {
+    return done;
+  }
+  if (done) {
+    wait_policy_arrived(policy);
+    return done;
+  }
+  if (!wait_policy_should_wait(policy)) {
+    return 0;
+  }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (unsigned i = 0; i < policy->spins && !done; i++) {
+    cpu_relax();
+    done = read_available(ring, data, len);
+  }
+  if (done) {
+    wait_policy_update(policy, WAIT_SPUN);
+  } else {
+    done = block(ring, data, len, policy);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  policy->waited_ns += (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000 +
+                       end.tv_nsec - start.tv_nsec;
+  return done;
+}
+
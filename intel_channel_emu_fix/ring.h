@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "wait.h"
+
+/*
+ * Single-producer/single-consumer byte queue between two threads, made of
+ * anonymous mappings of `segment_size` bytes. The producer fills a segment
+ * and publishes its fill level with a release store. When a write does not
+ * fit, the producer links a new segment to it instead of waiting, so writes
+ * never block, just like appending to a file. A write that fits into an
+ * empty segment goes there whole, so the consumer never sees part of it. The consumer hands drained segments
+ * back for reuse, so in a steady state two segments alternate and stay in
+ * the cache.
+ *
+ * A consumer that finds the queue empty spins and then sleeps on a futex as
+ * its wait policy (see wait.h) says. Producers only wake it when it
+ * announced that it is waiting.
+ */
+
+typedef struct ring_segment ring_segment_t;
+
+typedef struct {
+  size_t segment_size;
+  // producer side
+  _Alignas(64) ring_segment_t *write_segment;
+  // consumer side
+  _Alignas(64) ring_segment_t *read_segment;
+  size_t read_offset;
+  // shared, a drained segment for the producer to reuse
+  _Alignas(64) _Atomic(ring_segment_t *) spare;
+  // futex word, bumped for a waiting consumer when data arrives
+  atomic_uint arrivals;
+  atomic_bool waiting;
+} ring_t;
+
+bool ring_init(ring_t *ring, size_t segment_size);
+
+// Unmaps all segments, discarding unread data. Neither side may use the
+// queue any more.
+void ring_destroy(ring_t *ring);
+
+// Returns the number of bytes written, less than `len` only if no segment
+// could be mapped.
+size_t ring_write(ring_t *ring, const void *data, size_t len);
+
+// Reads up to `len` bytes. Returns 0 only if the queue stayed empty for
+// as long as `policy` waits, or right away without a policy or if the
+// policy says the queue is idle.
+size_t ring_read(ring_t *ring, void *data, size_t len, wait_policy_t *policy);
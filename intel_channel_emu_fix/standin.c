@@ -0,0 +1,55 @@
+/*
+ * Stand-in for the I/O channel emulation of libOclCpuBackEnd_emu.so, built
+ * under that name so that wrapper.so treats it like the real emulator. Like
+ * the emulator, it moves channel elements through files opened with fopen,
+ * writing each element with fwrite and polling fread on the reading side.
+ * channel_bench drives its kernels.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+FILE *emu_channel_open(const char *path, bool write) {
+  FILE *channel = fopen(path, write ? "wb" : "rb");
+  if (channel == NULL) {
+    perror(path);
+  }
+  return channel;
+}
+
+void emu_channel_close(FILE *channel) { fclose(channel); }
+
+// write_channel_intel
+void emu_write_channel(FILE *channel, const void *data, size_t size) {
+  fwrite(data, size, 1, channel);
+}
+
+static size_t read_some(FILE *channel, char *data, size_t size) {
+  const size_t done = fread(data, 1, size, channel);
+  if (done < size) {
+    clearerr(channel);
+  }
+  return done;
+}
+
+// read_channel_nb_intel, false if no element was available
+bool emu_read_channel_nb(FILE *channel, void *data, size_t size) {
+  size_t done = read_some(channel, data, size);
+  if (!done) {
+    return false;
+  }
+  // the rest of a partially written element follows shortly
+  while (done < size) {
+    done += read_some(channel, (char *)data + done, size - done);
+  }
+  return true;
+}
+
+// read_channel_intel
+void emu_read_channel(FILE *channel, void *data, size_t size) {
+  size_t done = 0;
+  while (done < size) {
+    done += read_some(channel, (char *)data + done, size - done);
+  }
+}
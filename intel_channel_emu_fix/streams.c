@@ -0,0 +1,219 @@
+#define _GNU_SOURCE
+#include "streams.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "channels.h"
+#include "profile.h"
+#include "wait.h"
+
+#define MAX_STREAMS 1024
+
+typedef struct {
+  FILE *file;
+  // unwatched for writers
+  file_watch_t watch;
+  // points to `own_wait`, or to the policy of a channel stream's end
+  wait_policy_t *wait;
+  wait_policy_t own_wait;
+  channel_profile_t *profile;
+  // wait time already added to the profile
+  uint64_t profiled_wait_ns;
+} watched_stream_t;
+
+static pthread_mutex_t streams_lock = PTHREAD_MUTEX_INITIALIZER;
+static watched_stream_t *streams[MAX_STREAMS];
+static int stream_count;
+// lets reads and closes of other streams skip the lock
+static atomic_int watched;
+
+void file_watch_init(file_watch_t *watch, const char *pathname) {
+  watch->idle_position = -1;
+  watch->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  // a writer closes a channel file when it moves on, which ends the wait too
+  if (watch->inotify_fd >= 0 &&
+      inotify_add_watch(watch->inotify_fd, pathname,
+                        IN_MODIFY | IN_CLOSE_WRITE) < 0) { // err
+    close(watch->inotify_fd);
+    watch->inotify_fd = -1;
+  }
+}
+
+void file_watch_destroy(file_watch_t *watch) {
+  if (watch->inotify_fd >= 0) {
+    close(watch->inotify_fd);
+    watch->inotify_fd = -1;
+  }
+}
+
+// Discards pending events, then checks for data behind the file position.
+static bool grown(const file_watch_t *watch, int fd) {
+  char events[4096];
+  while (read(watch->inotify_fd, events, sizeof(events)) > 0) {
+  }
+  struct stat st;
+  const off_t position = lseek(fd, 0, SEEK_CUR);
+  return position >= 0 && fstat(fd, &st) == 0 && st.st_size > position;
+}
+
+bool file_watch_wait(file_watch_t *watch, int fd, wait_policy_t *policy) {
+  if (watch->inotify_fd < 0) {
+    return false;
+  }
+  const int saved_errno = errno;
+  const off_t position = lseek(fd, 0, SEEK_CUR);
+  if (position != watch->idle_position) {
+    // read from since the last timeout
+    wait_policy_arrived(policy);
+  }
+  if (!wait_policy_should_wait(policy)) {
+    errno = saved_errno;
+    return false;
+  }
+  const uint64_t start = profile_now_ns();
+  bool arrived = false;
+  for (unsigned i = 0; i < policy->spins && !arrived; i++) {
+    arrived = grown(watch, fd);
+  }
+  if (arrived) {
+    wait_policy_update(policy, WAIT_SPUN);
+  } else {
+    // an event after this check ends the wait right away
+    if (!grown(watch, fd)) {
+      struct pollfd pfd = {watch->inotify_fd, POLLIN, 0};
+      const struct timespec timeout = {policy->block_ns / 1000000000,
+                                       policy->block_ns % 1000000000};
+      ppoll(&pfd, 1, &timeout, NULL);
+    }
+    arrived = grown(watch, fd);
+    wait_policy_update(policy, arrived ? WAIT_WOKEN : WAIT_TIMED_OUT);
+    if (!arrived) {
+      watch->idle_position = position;
+    }
+  }
+  policy->waited_ns += profile_now_ns() - start;
+  errno = saved_errno;
+  return arrived;
+}
+
+static void add_stream(watched_stream_t *stream) {
+  pthread_mutex_lock(&streams_lock);
+  if (stream_count < MAX_STREAMS) {
+    streams[stream_count++] = stream;
+    atomic_store(&watched, stream_count);
+    stream = NULL;
+  }
+  pthread_mutex_unlock(&streams_lock);
+  if (stream != NULL) { // err
+    file_watch_destroy(&stream->watch);
+    free(stream);
+  }
+}
+
+void stream_watch(FILE *file, const char *pathname, bool writer) {
+  const int saved_errno = errno;
+  char path[PATH_MAX];
+  channel_profile_t *profile =
+      channel_path(pathname, path) ? profile_channel(path, false) : NULL;
+  if (writer && profile == NULL) {
+    errno = saved_errno;
+    return;
+  }
+  watched_stream_t *stream = malloc(sizeof(watched_stream_t));
+  if (stream == NULL) { // err
+    errno = saved_errno;
+    return;
+  }
+  *stream = (watched_stream_t){file,    {-1, -1}, NULL, {0, 0, false, 0},
+                               profile, 0};
+  stream->wait = &stream->own_wait;
+  wait_policy_init(stream->wait);
+  if (!writer) {
+    // still profiled if it cannot be watched
+    file_watch_init(&stream->watch, pathname);
+  }
+  if (stream->watch.inotify_fd < 0 && profile == NULL) {
+    free(stream);
+    errno = saved_errno;
+    return;
+  }
+
+  add_stream(stream);
+  errno = saved_errno;
+}
+
+void stream_track(FILE *file, channel_profile_t *profile,
+                  wait_policy_t *wait) {
+  watched_stream_t *stream = malloc(sizeof(watched_stream_t));
+  if (stream == NULL) { // err
+    return;
+  }
+  *stream = (watched_stream_t){file,    {-1, -1}, wait, {0, 0, false, 0},
+                               profile, wait->waited_ns};
+  add_stream(stream);
+}
+
+static watched_stream_t *find_stream(FILE *file, bool remove) {
+  watched_stream_t *stream = NULL;
+  pthread_mutex_lock(&streams_lock);
+  for (int i = 0; i < stream_count; i++) {
+    if (streams[i]->file == file) {
+      stream = streams[i];
+      if (remove) {
+        streams[i] = streams[--stream_count];
+        atomic_store(&watched, stream_count);
+      }
+      break;
+    }
+  }
+  pthread_mutex_unlock(&streams_lock);
+  return stream;
+}
+
+void stream_unwatch(FILE *file) {
+  if (!atomic_load_explicit(&watched, memory_order_relaxed)) {
+    return;
+  }
+  watched_stream_t *stream = find_stream(file, true);
+  if (stream != NULL) {
+    file_watch_destroy(&stream->watch);
+    free(stream);
+  }
+}
+
+void stream_profile(FILE *file, bool write, size_t bytes, uint64_t ns) {
+  if (!atomic_load_explicit(&profile_enabled, memory_order_relaxed) ||
+      !atomic_load_explicit(&watched, memory_order_relaxed)) {
+    return;
+  }
+  watched_stream_t *stream = find_stream(file, false);
+  if (stream == NULL || stream->profile == NULL) {
+    return;
+  }
+  if (write) {
+    profile_write(stream->profile, bytes, ns);
+  } else {
+    profile_read(stream->profile, bytes,
+                 stream->wait->waited_ns - stream->profiled_wait_ns);
+    stream->profiled_wait_ns = stream->wait->waited_ns;
+  }
+}
+
+bool stream_wait(FILE *file) {
+  if (!atomic_load_explicit(&watched, memory_order_relaxed)) {
+    return false;
+  }
+  watched_stream_t *stream = find_stream(file, false);
+  if (stream == NULL) {
+    return false;
+  }
+  return file_watch_wait(&stream->watch, fileno(file), stream->wait);
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "profile.h"
+#include "wait.h"
+
+/*
+ * Waiting for data on channel files that are not redirected to memory (see
+ * channels.h), because the transport is off or the file could not be
+ * redirected. Without it, a reader at the end of such a file calls fread in
+ * a loop and burns a full core. Streams the emulator opens for reading are
+ * watched with inotify. A short fread at the end of a watched file then
+ * waits until the file is modified, with the policy in wait.h, and reads
+ * again.
+ *
+ * Only fread is covered. Other stdio reads on these streams still return the
+ * end of file right away.
+ *
+ * While profiling (see profile.h), freads and fwrites on these streams and
+ * on the streams of in-memory channels are also counted in their channel's
+ * profile, so both kinds are counted per call.
+ */
+
+// A channel file read through a file descriptor, watched for modifications.
+typedef struct {
+  // -1 if the file could not be watched
+  int inotify_fd;
+  // position at which the last wait timed out
+  off_t idle_position;
+} file_watch_t;
+
+// Starts watching the file `pathname`.
+void file_watch_init(file_watch_t *watch, const char *pathname);
+void file_watch_destroy(file_watch_t *watch);
+
+// Waits as `policy` says until the file behind `fd` grows past the position
+// of `fd`. Returns false right away for unwatched files and for files that
+// were not read from since a wait on them timed out, and if the file did not
+// grow in time.
+bool file_watch_wait(file_watch_t *watch, int fd, wait_policy_t *policy);
+
+// Starts watching `file`, the channel file `pathname` opened for reading, or
+// for writing if `writer` is set. Writers are only watched while profiling.
+void stream_watch(FILE *file, const char *pathname, bool writer);
+
+// Starts profiling `file`, a stream on an in-memory channel (see channels.h)
+// whose reads wait as `wait` says.
+void stream_track(FILE *file, channel_profile_t *profile,
+                  wait_policy_t *wait);
+
+// Stops watching `file` before it is closed.
+void stream_unwatch(FILE *file);
+
+// Counts an fread or fwrite of `bytes` on `file` that took `ns`, if it is
+// watched and profiling is on. The wait time of reads is taken from the
+// stream's waits.
+void stream_profile(FILE *file, bool write, size_t bytes, uint64_t ns);
+
+// Waits for a watched stream at the end of its file to grow. Returns false
+// right away for other streams, and if the file did not grow in time.
+bool stream_wait(FILE *file);
@@ -0,0 +1,73 @@
+#define _GNU_SOURCE
+#include "wait.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static wait_config_t config;
+static pthread_once_t configured = PTHREAD_ONCE_INIT;
+// the channel that the thread last found empty, until it reads data
+static __thread const wait_policy_t *last_empty;
+
+static void configure(void) {
+  const char *spins = getenv("CHANFIX_SPIN");
+  const char *wait_us = getenv("CHANFIX_WAIT_US");
+  const char *idle_wait_us = getenv("CHANFIX_IDLE_WAIT_US");
+  // spinning only delays the writer if both share the CPU
+  config.max_spins = spins                            ? strtoul(spins, NULL, 10)
+                     : sysconf(_SC_NPROCESSORS_ONLN) > 1 ? 1000
+                                                         : 0;
+  config.block_ns = (wait_us ? strtol(wait_us, NULL, 10) : 100) * 1000;
+  config.max_block_ns =
+      (idle_wait_us ? strtol(idle_wait_us, NULL, 10) : 10000) * 1000;
+  if (config.max_block_ns < config.block_ns) {
+    config.max_block_ns = config.block_ns;
+  }
+}
+
+void wait_policy_init(wait_policy_t *policy) {
+  pthread_once(&configured, configure);
+  policy->spins = config.max_spins;
+  policy->block_ns = config.block_ns;
+  policy->active = true;
+  policy->waited_ns = 0;
+}
+
+void wait_policy_update(wait_policy_t *policy, wait_outcome_t outcome) {
+  switch (outcome) {
+  case WAIT_SPUN:
+  case WAIT_WOKEN:
+    // the writer is active, spinning a bit longer may avoid the next block
+    policy->spins = policy->spins ? 2 * policy->spins : 1;
+    if (policy->spins > config.max_spins) {
+      policy->spins = config.max_spins;
+    }
+    wait_policy_arrived(policy);
+    break;
+  case WAIT_TIMED_OUT:
+    policy->spins /= 2;
+    if (!policy->active) {
+      // a blocking read of an idle channel, the writer wakes it anyway
+      policy->block_ns = 2 * policy->block_ns < config.max_block_ns
+                             ? 2 * policy->block_ns
+                             : config.max_block_ns;
+    }
+    policy->active = false;
+    break;
+  }
+}
+
+bool wait_policy_should_wait(wait_policy_t *policy) {
+  const bool again = last_empty == policy;
+  last_empty = policy;
+  return policy->active || again;
+}
+
+void wait_policy_arrived(wait_policy_t *policy) {
+  policy->block_ns = config.block_ns;
+  policy->active = true;
+  last_empty = NULL;
+}
+
+void wait_thread_read(void) { last_empty = NULL; }
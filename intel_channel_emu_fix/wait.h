@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Adaptive spin-then-block policy for readers waiting on an empty channel.
+ * A reader first polls its channel up to `spins` times and then blocks for
+ * up to `block_ns`, until a writer wakes it. If the wait times out, it still
+ * sees the end of file, so non-blocking channel reads keep working.
+ *
+ * A channel is active until a wait on it times out, and becomes active again
+ * once a read returns data. A thread that finds an idle channel empty sees
+ * the end of file right away if it found another channel empty since, so
+ * kernels that poll several channels in turn with non-blocking reads are not
+ * held up by those that stay empty. If it reads the same idle channel again
+ * with nothing read in between, as a blocking read does, it waits, and each
+ * wait that times out doubles the block timeout.
+ *
+ * The spin budget doubles whenever data arrived while waiting and halves
+ * whenever the wait timed out, up to CHANFIX_SPIN polls (default: 1000,
+ * 0 on a single CPU). The block timeout is CHANFIX_WAIT_US microseconds
+ * (default: 100), and grows up to CHANFIX_IDLE_WAIT_US microseconds
+ * (default: 10000) while the channel stays idle. Each reader adapts on its
+ * own.
+ */
+
+typedef struct {
+  unsigned max_spins;
+  long block_ns;
+  long max_block_ns;
+} wait_config_t;
+
+typedef struct {
+  unsigned spins;
+  long block_ns;
+  // cleared when a wait times out, set when data arrives
+  bool active;
+  // total time spent waiting, for profiling
+  uint64_t waited_ns;
+} wait_policy_t;
+
+typedef enum {
+  WAIT_SPUN,
+  WAIT_WOKEN,
+  WAIT_TIMED_OUT,
+} wait_outcome_t;
+
+void wait_policy_init(wait_policy_t *policy);
+void wait_policy_update(wait_policy_t *policy, wait_outcome_t outcome);
+// Whether a read that found the channel empty should wait for data.
+bool wait_policy_should_wait(wait_policy_t *policy);
+// A read of the channel returned data.
+void wait_policy_arrived(wait_policy_t *policy);
+// The calling thread read data from a stream whose policy is not at hand.
+void wait_thread_read(void);
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield");
+#endif
+}
@@ -2,50 +2,264 @@
 #include <dlfcn.h>
 #include <errno.h>
 #include <execinfo.h>
+#include <link.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
-#include <stdlib.h>
 #include <string.h>
 
-#define BT_BUF_SIZE 100
+#include "channels.h"
+#include "profile.h"
+#include "streams.h"
+#include "wait.h"
 
-FILE *fopen(const char *pathname, const char *mode) {
+#define BT_BUF_SIZE 16
+#define MAX_RANGES 64
 
-  FILE *(*fopen_real)(const char *pathname, const char *mode) = dlsym(RTLD_NEXT, "fopen");
+// Libraries whose text segments are tracked to classify callers.
+typedef enum {
+  CALLER_OTHER,
+  CALLER_EMULATOR,
+  // std::fstream opens files through libstdc++, check its callers
+  CALLER_STREAMS,
+} caller_t;
 
-  if (fopen_real == NULL) { // err
-    errno = ELIBACC;
-    return NULL;
+static const struct {
+  const char *name;
+  caller_t caller;
+} tracked[] = {
+    {"libOclCpuBackEnd_emu.so", CALLER_EMULATOR},
+    {"libstdc++.so", CALLER_STREAMS},
+};
+
+typedef struct {
+  uintptr_t begin, end;
+  caller_t caller;
+} range_t;
+
+static FILE *(*fopen_real)(const char *pathname, const char *mode);
+static FILE *(*fopen64_real)(const char *pathname, const char *mode);
+static FILE *(*freopen_real)(const char *pathname, const char *mode,
+                             FILE *stream);
+static FILE *(*fdopen_real)(int fd, const char *mode);
+static size_t (*fread_real)(void *ptr, size_t size, size_t nmemb,
+                            FILE *stream);
+static size_t (*fwrite_real)(const void *ptr, size_t size, size_t nmemb,
+                             FILE *stream);
+static int (*fclose_real)(FILE *stream);
+static pthread_once_t resolved = PTHREAD_ONCE_INIT;
+
+// Text ranges as of the last time libraries were loaded or unloaded.
+static pthread_mutex_t ranges_lock = PTHREAD_MUTEX_INITIALIZER;
+static range_t ranges[MAX_RANGES];
+static int range_count;
+static bool emulator_loaded;
+static unsigned long long ranges_generation = ~0ull;
+
+static void resolve(void) {
+  fopen_real = dlsym(RTLD_NEXT, "fopen");
+  fopen64_real = dlsym(RTLD_NEXT, "fopen64");
+  freopen_real = dlsym(RTLD_NEXT, "freopen");
+  fdopen_real = dlsym(RTLD_NEXT, "fdopen");
+  fread_real = dlsym(RTLD_NEXT, "fread");
+  fwrite_real = dlsym(RTLD_NEXT, "fwrite");
+  fclose_real = dlsym(RTLD_NEXT, "fclose");
+}
+
+// Number of library loads and unloads so far, from the first object.
+static int read_generation(struct dl_phdr_info *info, size_t size,
+                           void *data) {
+  unsigned long long *generation = data;
+  if (size >= offsetof(struct dl_phdr_info, dlpi_subs) +
+                  sizeof(info->dlpi_subs)) {
+    *generation = info->dlpi_adds + info->dlpi_subs;
+  } else { // too old to tell, always refresh
+    *generation = ranges_generation + 1;
+  }
+  return 1;
+}
+
+static int collect_ranges(struct dl_phdr_info *info, size_t size,
+                          void *data) {
+  (void)size;
+  (void)data;
+  for (size_t i = 0; i < sizeof(tracked) / sizeof(tracked[0]); i++) {
+    if (!info->dlpi_name || !strstr(info->dlpi_name, tracked[i].name)) {
+      continue;
+    }
+    for (int j = 0; j < info->dlpi_phnum; j++) {
+      const ElfW(Phdr) *phdr = &info->dlpi_phdr[j];
+      if (phdr->p_type != PT_LOAD || !(phdr->p_flags & PF_X) ||
+          range_count == MAX_RANGES) {
+        continue;
+      }
+      const uintptr_t begin = info->dlpi_addr + phdr->p_vaddr;
+      ranges[range_count++] =
+          (range_t){begin, begin + phdr->p_memsz, tracked[i].caller};
+      emulator_loaded |= tracked[i].caller == CALLER_EMULATOR;
+    }
   }
+  return 0;
+}
 
-  FILE *ret = fopen_real(pathname, mode);
+// Must be called with ranges_lock held.
+static caller_t lookup(const void *address) {
+  const uintptr_t addr = (uintptr_t)address;
+  for (int i = 0; i < range_count; i++) {
+    if (addr >= ranges[i].begin && addr < ranges[i].end) {
+      return ranges[i].caller;
+    }
+  }
+  return CALLER_OTHER;
+}
 
-  if (ret == NULL) { // err
-    return ret;
+// CALLER_EMULATOR for direct calls from the emulator, CALLER_STREAMS for calls
+// it made through libstdc++ and CALLER_OTHER for all other calls.
+static caller_t classify_caller(const void *return_address) {
+  pthread_mutex_lock(&ranges_lock);
+  unsigned long long generation;
+  dl_iterate_phdr(read_generation, &generation);
+  if (generation != ranges_generation) {
+    range_count = 0;
+    emulator_loaded = false;
+    dl_iterate_phdr(collect_ranges, NULL);
+    ranges_generation = generation;
   }
+  const caller_t caller =
+      emulator_loaded ? lookup(return_address) : CALLER_OTHER;
+  pthread_mutex_unlock(&ranges_lock);
 
-  bool triggered = false;
+  if (caller != CALLER_STREAMS) {
+    return caller;
+  }
 
+  // unwound without the lock, the first backtrace loads libgcc_s
   void *stackbuf[BT_BUF_SIZE];
-  int btlen = backtrace(stackbuf, BT_BUF_SIZE);
-  char **symbols = backtrace_symbols(stackbuf, btlen);
+  const int btlen = backtrace(stackbuf, BT_BUF_SIZE);
+  bool triggered = false;
+  pthread_mutex_lock(&ranges_lock);
+  for (int i = 0; i < btlen && !triggered; i++) {
+    triggered = lookup(stackbuf[i]) == CALLER_EMULATOR;
+  }
+  pthread_mutex_unlock(&ranges_lock);
+  return triggered ? CALLER_STREAMS : CALLER_OTHER;
+}
 
-  if (symbols == NULL) { // err
-    return ret;
+static FILE *unbuffer_for_emulator(FILE *file, const void *return_address) {
+  if (file != NULL && classify_caller(return_address) != CALLER_OTHER) {
+    setvbuf(file, NULL, _IONBF, 0); // ignore any errors
   }
+  return file;
+}
 
-  for (int i = 0; i < btlen; i++) {
-    if (strstr(symbols[i], "libOclCpuBackEnd_emu.so")) {
-      triggered = true;
+// Channel files the emulator opens directly are replaced by in-memory
+// channels. Other files it opens, and those used through std::fstream, which
+// needs a file descriptor, are unbuffered. Those it reads with fread wait for
+// data at their end, and are profiled along with those it writes.
+static FILE *open_for_emulator(FILE *(*open_real)(const char *, const char *),
+                               const char *pathname, const char *mode,
+                               caller_t caller) {
+  FILE *file = caller == CALLER_EMULATOR ? channel_open(pathname, mode) : NULL;
+  if (file == NULL) {
+    file = open_real(pathname, mode);
+    if (file != NULL) {
+      setvbuf(file, NULL, _IONBF, 0); // ignore any errors
+      if (caller == CALLER_EMULATOR && !strchr(mode, '+')) {
+        stream_watch(file, pathname, mode[0] != 'r');
+      }
     }
   }
+  return file;
+}
+
+FILE *fopen(const char *pathname, const char *mode) {
+  pthread_once(&resolved, resolve);
+  if (fopen_real == NULL) { // err
+    errno = ELIBACC;
+    return NULL;
+  }
+  const caller_t caller = classify_caller(__builtin_return_address(0));
+  if (caller != CALLER_OTHER) {
+    return open_for_emulator(fopen_real, pathname, mode, caller);
+  }
+  return fopen_real(pathname, mode);
+}
+
+FILE *fopen64(const char *pathname, const char *mode) {
+  pthread_once(&resolved, resolve);
+  if (fopen64_real == NULL) { // err
+    errno = ELIBACC;
+    return NULL;
+  }
+  const caller_t caller = classify_caller(__builtin_return_address(0));
+  if (caller != CALLER_OTHER) {
+    return open_for_emulator(fopen64_real, pathname, mode, caller);
+  }
+  return fopen64_real(pathname, mode);
+}
+
+FILE *freopen(const char *pathname, const char *mode, FILE *stream) {
+  pthread_once(&resolved, resolve);
+  if (freopen_real == NULL) { // err
+    errno = ELIBACC;
+    return NULL;
+  }
+  return unbuffer_for_emulator(freopen_real(pathname, mode, stream),
+                               __builtin_return_address(0));
+}
+
+FILE *fdopen(int fd, const char *mode) {
+  pthread_once(&resolved, resolve);
+  if (fdopen_real == NULL) { // err
+    errno = ELIBACC;
+    return NULL;
+  }
+  return unbuffer_for_emulator(fdopen_real(fd, mode),
+                               __builtin_return_address(0));
+}
 
-  // malloced by backtrace_symbols()
-  free(symbols);
+size_t fread(void *ptr, size_t size, size_t nmemb, FILE *stream) {
+  pthread_once(&resolved, resolve);
+  if (fread_real == NULL) { // err
+    errno = ELIBACC;
+    return 0;
+  }
+  size_t done = fread_real(ptr, size, nmemb, stream);
+  // only short reads can be on a channel file waiting for data
+  if (done < nmemb && size && feof(stream) && stream_wait(stream)) {
+    clearerr(stream);
+    done += fread_real((char *)ptr + done * size, size, nmemb - done, stream);
+  }
+  if (done) {
+    wait_thread_read();
+  }
+  stream_profile(stream, false, done * size, 0);
+  return done;
+}
 
-  if (triggered) {
-    setvbuf(ret, NULL, _IONBF, 0); // ignore any errors
+size_t fwrite(const void *ptr, size_t size, size_t nmemb, FILE *stream) {
+  pthread_once(&resolved, resolve);
+  if (fwrite_real == NULL) { // err
+    errno = ELIBACC;
+    return 0;
+  }
+  if (!atomic_load_explicit(&profile_enabled, memory_order_relaxed)) {
+    return fwrite_real(ptr, size, nmemb, stream);
   }
+  const uint64_t start = profile_now_ns();
+  const size_t done = fwrite_real(ptr, size, nmemb, stream);
+  stream_profile(stream, true, done * size, profile_now_ns() - start);
+  return done;
+}
 
-  return ret;
+int fclose(FILE *stream) {
+  pthread_once(&resolved, resolve);
+  if (fclose_real == NULL) { // err
+    errno = ELIBACC;
+    return EOF;
+  }
+  stream_unwatch(stream);
+  return fclose_real(stream);
 }